@@ -1 +1 @@
-from adbi import ADBI, ADBIException
\ No newline at end of file
+from adbi import ADBI, ADBIException, TRACEPOINT_MODES
\ No newline at end of file
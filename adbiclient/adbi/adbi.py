@@ -1,12 +1,17 @@
 from rsock import ReliableSocket
-from packet import Packet, Header, Payload
+from packet import Packet, Header, Payload, RawPayload
 from collections import namedtuple
 import struct
+import mmap
+import os
 
 Symbol = namedtuple('Symbol', 'address name')
 Tracepoint = namedtuple('Tracepoint', 'address handler')
 Injectable = namedtuple('Injectable', 'id filename refs type name comment')
 
+# Tracepoint modes in the order of their numeric values used by TPCF.
+TRACEPOINT_MODES = ('handler', 'count', 'cover')
+
 class ADBIException(Exception):
     pass
 
@@ -20,12 +25,15 @@ class ADBI(object):
 
         self.connection = None
         self.seqgen = seqgen()
+        self.pending = {}
 
     def __check_connection(self):
         if not self.connection:
             raise ADBIException('Not connected.')
 
     def connect(self, address):
+        """Connect to the server.  The address is either a (host, port) tuple or the name of the server's abstract
+        unix socket (on the device only)."""
         if self.connection:
             raise ADBIException('Already connected.')
         self.connection = ReliableSocket(address)
@@ -34,36 +42,89 @@ class ADBI(object):
         self.__check_connection()
         self.connection.close()
         self.connection = None
+        self.pending = {}
 
     def __recv(self):
         header = Header.unpack_from(self.connection.recv(Header.size))
+        # file descriptors arrive along with the packet header
+        fds = self.connection.take_fds()
         payload = self.connection.recv(header.length)
-        payload = Payload.unpack_from(payload)
-        return Packet(header, payload)
+        if header.type == 'BTCH':
+            payload = Packet.unpack_many(payload)
+        else:
+            payload = Payload.unpack_from(payload)
+        return Packet(header, payload, fds)
 
     def __send(self, packet):
         self.connection.send(packet.pack())
 
-    def request(self, type, payload=None):
-        self.__check_connection()
+    def __packet(self, type, payload=None):
         if payload is None:
             payload = Payload()
         header = Header(type,
                         next(self.seqgen),
                         len(payload.pack()))
-        packet = Packet(header, payload)
-        self.__send(packet)
-        response = self.__recv()
+        return Packet(header, payload)
 
+    @staticmethod
+    def check(response):
         if response.type == 'FAIL':
             raise ADBIException(response.get('msg', 'Request failed.'))
         if response.type == 'USUP':
             raise ADBIException(response.get('msg', 'Not supported.'))
         if response.type == 'MALF':
             raise ADBIException('Protocol error: {:}'.format(response.get('msg', '?')))
+        return response
 
+    def send(self, type, payload=None):
+        """Send a request without waiting for the response.  Return the sequence number of the request."""
+        self.__check_connection()
+        packet = self.__packet(type, payload)
+        self.__send(packet)
+        return packet.header.seq
+
+    def receive(self, seq):
+        """Return the response to the request with the given sequence number.  Responses to other requests received in
+        the meantime are kept until they are asked for.  Streamed responses consist of many packets with the same
+        sequence number, each call returns the next one."""
+        self.__check_connection()
+        while not self.pending.get(seq):
+            response = self.__recv()
+            self.pending.setdefault(response.header.seq, []).append(response)
+        response = self.pending[seq].pop(0)
+        if not self.pending[seq]:
+            del self.pending[seq]
         return response
 
+    def request(self, type, payload=None):
+        return self.check(self.receive(self.send(type, payload)))
+
+    def pipeline(self, requests, check=True):
+        """Send all requests (pairs of packet type and payload) at once and then collect the responses.  The
+        responses are returned in the order of requests."""
+        seqs = [self.send(type, payload) for type, payload in requests]
+        responses = [self.receive(seq) for seq in seqs]
+        if check:
+            for response in responses:
+                self.check(response)
+        return responses
+
+    def batch(self, requests, check=True):
+        """Send all requests (pairs of packet type and payload) in a single batch packet.  The server handles them in
+        one pass.  The responses are returned in the order of requests."""
+        packets = [self.__packet(type, payload) for type, payload in requests]
+        data = ''.join(packet.pack() for packet in packets)
+        self.__check_connection()
+        packet = Packet(Header('BTCH', next(self.seqgen), len(data)), RawPayload(data))
+        self.__send(packet)
+        response = self.check(self.receive(packet.header.seq))
+        responses = dict((x.header.seq, x) for x in response.payload)
+        responses = [responses[packet.header.seq] for packet in packets]
+        if check:
+            for response in responses:
+                self.check(response)
+        return responses
+
     def ping(self):
         return self.request('PING')
 
@@ -78,13 +139,11 @@ class ADBI(object):
         payload = Payload()
         payload.put_u32('pid', pid)
         response = self.request('MAPS', payload)
-
-        def iter_segments():
-            for i in xrange(response.get('segc', 0)):
-                def get(what):
-                    return response.get('seg{:}[{:}]'.format(what, i))
-                yield get('lo'), get('hi'), get('type'), get('file'), get('off')
-        return sorted(iter_segments())
+        return sorted(zip(response.get('seglo', []),
+                          response.get('seghi', []),
+                          response.get('segtype', []),
+                          response.get('segfile', []),
+                          response.get('segoff', [])))
 
     def explain_address(self, pid, address):
         payload = Payload()
@@ -98,15 +157,66 @@ class ADBI(object):
         payload.put_u64('address', address)
         payload.put_u32('size', size)
         response = self.request('MEMD', payload)
-        words = (response.get('word[%i]' % x) for x in xrange(response.get('size', 0)))
-        def tobytes(word):
-            a = (word >> 24) & 0xff
-            b = (word >> 16) & 0xff
-            c = (word >> 8) & 0xff
-            d = (word) & 0xff
-            return ''.join(chr(x) for x in (d, c, b, a))
-        bytes = (tobytes(x) for x in words)
-        return ''.join(bytes)
+        return response.get('data', '')
+
+    def dump_stream(self, pid, address, size, racy=False, chunk=None):
+        """Read a large range of process memory.  Yield (address, data) pairs as chunks arrive.  Unless racy is set,
+        the process is stopped during the whole dump."""
+        payload = Payload()
+        payload.put_u32('pid', pid)
+        payload.put_u64('address', address)
+        payload.put_u64('size', size)
+        payload.put_u32('racy', 1 if racy else 0)
+        if chunk is not None:
+            payload.put_u32('chunk', chunk)
+        seq = self.send('MEMS', payload)
+        while True:
+            response = self.receive(seq)
+            if response.type != 'MEMC':
+                self.check(response)
+                return
+            yield response.get('address'), response.get('data')
+
+    def dump_shared(self, pid, address, size, racy=False):
+        """Read process memory into shared memory.  Return a read-only mmap object with the data.  Works only when
+        connected through the unix socket."""
+        payload = Payload()
+        payload.put_u32('pid', pid)
+        payload.put_u64('address', address)
+        payload.put_u64('size', size)
+        payload.put_u32('racy', 1 if racy else 0)
+        response = self.request('MEMF', payload)
+        if not response.fds:
+            raise ADBIException('No file descriptor received.')
+        try:
+            return mmap.mmap(response.fds[0], response.get('size'), mmap.MAP_SHARED, mmap.PROT_READ)
+        finally:
+            for fd in response.fds:
+                os.close(fd)
+
+    EVENTS = ['process', 'thread', 'exit', 'thread-exit', 'exec', 'segment', 'tracepoint-error']
+
+    def subscribe(self, events=None):
+        """Subscribe to asynchronous events (a list of names from EVENTS, all by default, empty list unsubscribes).
+        Return the sequence number to pass to events()."""
+        if events is None:
+            events = self.EVENTS
+        mask = 0
+        for event in events:
+            mask |= 1 << self.EVENTS.index(event)
+        payload = Payload()
+        payload.put_u32('mask', mask)
+        seq = self.send('SUBS', payload)
+        self.check(self.receive(seq))
+        return seq
+
+    def events(self, seq):
+        """Wait for the next EVNT packet of the subscription and return a pair of event list and the number of events
+        lost because the client didn't keep up.  Each event is a dict with event, pid, tid, arg and info keys."""
+        response = self.receive(seq)
+        keys = ('event', 'pid', 'tid', 'arg', 'info')
+        events = [dict(zip(keys, values)) for values in zip(*[response.get(key, []) for key in keys])]
+        return events, response.get('lost', 0)
 
     @property
     def processes(self):
@@ -133,6 +243,17 @@ class ADBI(object):
         payload.put_u32('loglevel', loglevel)
         return self.request('LLEV', payload)
 
+    def get_latency(self, reset=False):
+        """Return the stop-to-resume latency histogram of adbiserver as a tuple (count, total, max, buckets).  Times
+        are in microseconds, bucket i counts stops resumed in less than 2^i us.  If reset is true, the histogram
+        is cleared afterwards."""
+        payload = Payload()
+        if reset:
+            payload.put_u32('reset', 1)
+        response = self.request('LATS', payload)
+        return (response.get('count', 0), response.get('total', 0), response.get('max', 0),
+                response.get('buckets', []))
+
     def attach(self, pid):
         payload = Payload()
         payload.put_u32('pid', pid)
@@ -177,6 +298,73 @@ class ADBI(object):
             postfix = '[%i]' % i
             yield Tracepoint(response.get('tpta' + postfix), response.get('tpth' + postfix))
 
+    def configure_tracepoints(self, iid, address=None, mode=None, predicate=None, rate=None):
+        """Change options of the tracepoint of injectable iid at the given file address or of all its tracepoints if
+        no address is given.  Options which are None are left unchanged, an empty predicate removes the condition."""
+        payload = Payload()
+        payload.put_u32('iid', iid)
+        if address is not None:
+            payload.put_u32('address', address)
+        if mode is not None:
+            payload.put_u32('mode', TRACEPOINT_MODES.index(mode))
+        if predicate is not None:
+            payload.put_str('predicate', predicate)
+        if rate is not None:
+            payload.put_u32('rate', rate)
+        return self.request('TPCF', payload)
+
+    def enable_tracepoints(self, iid, addresses=None):
+        """Enable tracepoints of injectable iid at the given file addresses or all its tracepoints."""
+        return self.__toggle_tracepoints('TPEN', iid, addresses)
+
+    def disable_tracepoints(self, iid, addresses=None):
+        """Disable tracepoints of injectable iid at the given file addresses or all its tracepoints.  Disabled
+        tracepoints stay installed and can be enabled again quickly."""
+        return self.__toggle_tracepoints('TPDI', iid, addresses)
+
+    def __toggle_tracepoints(self, request, iid, addresses):
+        payload = Payload()
+        payload.put_u32('iid', iid)
+        if addresses:
+            payload.put_u32_array('address', addresses)
+        return self.request(request, payload)
+
+    def add_tracepoint(self, iid, handler, address=None, pid=None, rtaddr=None):
+        """Add a tracepoint calling the handler exported by injectable iid.  The tracepoint location is given either
+        as a file address or as a runtime address in process pid.  Return the file address of the tracepoint."""
+        payload = Payload()
+        payload.put_u32('iid', iid)
+        payload.put_str('handler', handler)
+        if address is not None:
+            payload.put_u32('address', address)
+        if pid is not None:
+            payload.put_u32('pid', pid)
+            payload.put_u64('rtaddr', rtaddr)
+        response = self.request('TPAD', payload)
+        return response.get('address')
+
+    def remove_tracepoint(self, iid, address):
+        """Remove a tracepoint added by add_tracepoint."""
+        payload = Payload()
+        payload.put_u32('iid', iid)
+        payload.put_u32('address', address)
+        return self.request('TPRM', payload)
+
+    def get_counters(self, pid):
+        """Return a sorted list of (address, hits) pairs of counting tracepoints in the given process."""
+        payload = Payload()
+        payload.put_u32('pid', pid)
+        response = self.request('CNTR', payload)
+        return sorted(zip(response.get('cntad', []), response.get('cnthit', [])))
+
+    def get_coverage(self, pid):
+        """Return a sorted list of runtime addresses of coverage tracepoints hit in the given process and the number
+        of all coverage tracepoints in the process."""
+        payload = Payload()
+        payload.put_u32('pid', pid)
+        response = self.request('COVR', payload)
+        return sorted(response.get('covad', [])), response.get('covt', 0)
+
     def iter_injectables(self):
         response = self.request('INJQ')
         for i in xrange(response.get('injc', 0)):
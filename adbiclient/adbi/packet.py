@@ -41,6 +41,11 @@ class Header(object):
                                 self.seq,
                                 self.length)
 
+def unpack_array(code, size, data):
+    """Decode a little-endian array of integers with a single unpack call."""
+    return list(struct.unpack('<%i%s' % (len(data) // size, code), data))
+
+
 class Payload(object):
 
     class Element(object):
@@ -53,6 +58,10 @@ class Payload(object):
             U64 = 0x20
             I64 = 0x21
             STR = 0x80
+            BLOB = 0x81
+            STR_ARRAY = 0x82
+            U32_ARRAY = 0x90
+            U64_ARRAY = 0xa0
 
         def __init__(self, name, type, value):
             self.type = type
@@ -73,6 +82,14 @@ class Payload(object):
                 return struct.pack('<i', self.value)
             elif self.type == self.Type.STR:
                 return self.value + '\0'
+            elif self.type == self.Type.BLOB:
+                return self.value
+            elif self.type == self.Type.STR_ARRAY:
+                return ''.join(x + '\0' for x in self.value)
+            elif self.type == self.Type.U32_ARRAY:
+                return struct.pack('<%iI' % len(self.value), *self.value)
+            elif self.type == self.Type.U64_ARRAY:
+                return struct.pack('<%iQ' % len(self.value), *self.value)
             else:
                 raise ValueError('Invalid data type: {:}.'.format(self.type))
 
@@ -81,44 +98,69 @@ class Payload(object):
                    self.name + '\0' + self.binvalue
 
     def __init__(self, elements=None):
-        if elements is None:
-            self.elements = []
-        else:
-            self.elements = elements
+        self.elements = []
+        self.index = {}
+        for element in elements or []:
+            self.append(element)
+
+    def append(self, element):
+        self.elements.append(element)
+        # Like the server, prefer the first entry if names are duplicated.
+        self.index.setdefault(element.name, element)
 
     def pack(self):
         elements = self.elements + [self.Element('', self.Element.Type.TERMINATOR, None)]
         return ''.join([x.pack() for x in elements])
 
     def put_u64(self, name, val):
-        self.elements.append(self.Element(name,
-                                          self.Element.Type.U64,
-                                          val))
+        self.append(self.Element(name,
+                                 self.Element.Type.U64,
+                                 val))
 
     def put_i64(self, name, val):
-        self.elements.append(self.Element(name,
-                                          self.Element.Type.I64,
-                                          val))
+        self.append(self.Element(name,
+                                 self.Element.Type.I64,
+                                 val))
 
     def put_u32(self, name, val):
-        self.elements.append(self.Element(name,
-                                          self.Element.Type.U32,
-                                          val))
+        self.append(self.Element(name,
+                                 self.Element.Type.U32,
+                                 val))
 
     def put_i32(self, name, val):
-        self.elements.append(self.Element(name,
-                                          self.Element.Type.I32,
-                                          val))
+        self.append(self.Element(name,
+                                 self.Element.Type.I32,
+                                 val))
 
     def put_str(self, name, val):
-        self.elements.append(self.Element(name,
-                                          self.Element.Type.STR,
-                                          val))
+        self.append(self.Element(name,
+                                 self.Element.Type.STR,
+                                 val))
+
+    def put_blob(self, name, val):
+        self.append(self.Element(name,
+                                 self.Element.Type.BLOB,
+                                 val))
+
+    def put_str_array(self, name, val):
+        self.append(self.Element(name,
+                                 self.Element.Type.STR_ARRAY,
+                                 list(val)))
+
+    def put_u32_array(self, name, val):
+        self.append(self.Element(name,
+                                 self.Element.Type.U32_ARRAY,
+                                 list(val)))
+
+    def put_u64_array(self, name, val):
+        self.append(self.Element(name,
+                                 self.Element.Type.U64_ARRAY,
+                                 list(val)))
 
     def get(self, name, default=None):
-        for e in self.elements:
-            if e.name == name:
-                return e.value
+        e = self.index.get(name)
+        if e is not None:
+            return e.value
         if default is not None:
             return default
         else:
@@ -149,6 +191,14 @@ class Payload(object):
                     value = struct.unpack('<I', value)[0]
                 elif type == cls.Element.Type.STR:
                     value = value[:-1]
+                elif type == cls.Element.Type.BLOB:
+                    pass
+                elif type == cls.Element.Type.STR_ARRAY:
+                    value = value.split('\0')[:-1]
+                elif type == cls.Element.Type.U32_ARRAY:
+                    value = unpack_array('I', 4, value)
+                elif type == cls.Element.Type.U64_ARRAY:
+                    value = unpack_array('Q', 8, value)
                 elif type == cls.Element.Type.TERMINATOR:
                     break
                 else:
@@ -159,10 +209,22 @@ class Payload(object):
         return cls(list(iter_elements()))
 
 
+class RawPayload(object):
+    """Payload consisting of raw bytes, used by batch packets."""
+
+    def __init__(self, data):
+        self.data = data
+
+    def pack(self):
+        return self.data
+
+
 class Packet(object):
-    def __init__(self, header, payload):
+    def __init__(self, header, payload, fds=None):
         self.header = header
         self.payload = payload
+        # file descriptors received along with the packet (unix socket only)
+        self.fds = fds or []
 
     @property
     def type(self):
@@ -178,4 +240,17 @@ class Packet(object):
     def unpack_from(cls, data):
         header = Header.unpack_from(data)
         payload = Payload.unpack_from(data[Header.struct.size:])
-        return cls(header, payload)
\ No newline at end of file
+        return cls(header, payload)
+
+    @classmethod
+    def unpack_many(cls, data):
+        """Unpack a sequence of packets, e.g. the payload of a batch packet."""
+        result = []
+        offset = 0
+        while offset < len(data):
+            header = Header.unpack_from(data[offset:])
+            offset += Header.size
+            payload = Payload.unpack_from(data[offset:offset + header.length])
+            offset += header.length
+            result.append(cls(header, payload))
+        return result
\ No newline at end of file
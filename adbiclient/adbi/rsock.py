@@ -1,9 +1,89 @@
 import socket
+import ctypes
+import ctypes.util
+import struct
+
+SOL_SOCKET = 1
+SCM_RIGHTS = 1
+
+
+class iovec(ctypes.Structure):
+    _fields_ = [('iov_base', ctypes.c_void_p),
+                ('iov_len', ctypes.c_size_t)]
+
+
+class msghdr(ctypes.Structure):
+    _fields_ = [('msg_name', ctypes.c_void_p),
+                ('msg_namelen', ctypes.c_uint32),
+                ('msg_iov', ctypes.POINTER(iovec)),
+                ('msg_iovlen', ctypes.c_size_t),
+                ('msg_control', ctypes.c_void_p),
+                ('msg_controllen', ctypes.c_size_t),
+                ('msg_flags', ctypes.c_int)]
+
+
+class cmsghdr(ctypes.Structure):
+    _fields_ = [('cmsg_len', ctypes.c_size_t),
+                ('cmsg_level', ctypes.c_int),
+                ('cmsg_type', ctypes.c_int)]
+
+
+libc = None
+
+
+def recvmsg_fds(sock, length, maxfds=4):
+    """Receive up to length bytes from a unix socket.  Return a pair of data and list of file descriptors passed using
+    SCM_RIGHTS."""
+    global libc
+    if libc is None:
+        libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+
+    buf = ctypes.create_string_buffer(length)
+    iov = iovec(ctypes.cast(buf, ctypes.c_void_p), length)
+    align = ctypes.sizeof(ctypes.c_size_t)
+    space = ctypes.sizeof(cmsghdr) + (maxfds * 4 + align - 1) // align * align
+    control = ctypes.create_string_buffer(space)
+
+    msg = msghdr()
+    msg.msg_iov = ctypes.pointer(iov)
+    msg.msg_iovlen = 1
+    msg.msg_control = ctypes.cast(control, ctypes.c_void_p)
+    msg.msg_controllen = space
+
+    while True:
+        got = libc.recvmsg(sock.fileno(), ctypes.byref(msg), 0)
+        if got >= 0:
+            break
+        errno = ctypes.get_errno()
+        if errno != 4:  # EINTR
+            raise socket.error(errno, 'recvmsg failed')
+
+    fds = []
+    offset = 0
+    while offset + ctypes.sizeof(cmsghdr) <= msg.msg_controllen:
+        cmsg = cmsghdr.from_buffer_copy(control.raw[offset:offset + ctypes.sizeof(cmsghdr)])
+        if cmsg.cmsg_len < ctypes.sizeof(cmsghdr):
+            break
+        if cmsg.cmsg_level == SOL_SOCKET and cmsg.cmsg_type == SCM_RIGHTS:
+            data = control.raw[offset + ctypes.sizeof(cmsghdr):offset + cmsg.cmsg_len]
+            fds.extend(struct.unpack('{:}i'.format(len(data) // 4), data[:len(data) // 4 * 4]))
+        offset += (cmsg.cmsg_len + align - 1) // align * align
+
+    return buf.raw[:got], fds
+
 
 class ReliableSocket(object):
 
     def __init__(self, address):
-        self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        """Connect to the given address.  A (host, port) tuple is a TCP address, a string is the name of an abstract
+        unix socket (only available on the device)."""
+        self.unix = isinstance(address, basestring)
+        self.fds = []
+        if self.unix:
+            self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            address = '\0' + address
+        else:
+            self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         try:
             self.socket.connect(address)
         except socket.error as e:
@@ -20,11 +100,20 @@ class ReliableSocket(object):
     def recv(self, length):
         result = ''
         while len(result) < length:
-            chunk = self.socket.recv(length - len(result))
+            if self.unix:
+                chunk, fds = recvmsg_fds(self.socket, length - len(result))
+                self.fds.extend(fds)
+            else:
+                chunk = self.socket.recv(length - len(result))
             if not chunk:
                 raise IOError('Connection error.')
             result += chunk
         return result
 
+    def take_fds(self):
+        """Return the file descriptors received so far and forget them."""
+        fds, self.fds = self.fds, []
+        return fds
+
     def close(self):
-        self.socket.close()
\ No newline at end of file
+        self.socket.close()
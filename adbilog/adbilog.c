@@ -2,17 +2,23 @@
 #include <assert.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #define PORT 2222
 
+/* Name of the abstract unix socket.  Handlers on the device connect to it before trying TCP. */
+#define UNIX_NAME "adbilog"
+
 static int tcp_server_sock = -1;
+static int unix_server_sock = -1;
 
 static fd_set sock_set;
 static int socket_nfds = 0;
@@ -49,6 +55,38 @@ static void disconnect(int fd) {
     }
 }
 
+static bool init_unix() {
+
+    struct sockaddr_un address;
+    
+    unix_server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (unix_server_sock < 0) {
+        perror("error creating unix socket");
+        return false;
+    }
+    
+    /* abstract socket address: leading null byte, no terminating null byte */
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path + 1, UNIX_NAME, strlen(UNIX_NAME));
+    
+    if (bind(unix_server_sock, (struct sockaddr *) &address,
+             offsetof(struct sockaddr_un, sun_path) + 1 + strlen(UNIX_NAME)) < 0) {
+        perror("error binding unix socket");
+        return false;
+    }
+    
+    if (listen(unix_server_sock, 16) < 0) {
+        perror("error listening on unix socket");
+        return false;
+    }
+    
+    socket_add_fd(unix_server_sock);
+    
+    return true;
+}
+
 static bool init() {
 
     struct sockaddr_in address;
@@ -77,6 +115,13 @@ static bool init() {
     
     socket_add_fd(tcp_server_sock);
     
+    /* the unix socket is optional, handlers fall back to TCP */
+    if (!init_unix()) {
+        if (unix_server_sock >= 0)
+            close(unix_server_sock);
+        unix_server_sock = -1;
+    }
+    
     return true;
 }
 
@@ -84,10 +129,13 @@ static void cleanup() {
     if (tcp_server_sock >= 0)
         disconnect(tcp_server_sock);
     tcp_server_sock = -1;
+    if (unix_server_sock >= 0)
+        disconnect(unix_server_sock);
+    unix_server_sock = -1;
 }
 
-static void incomming() {
-    int client = accept(tcp_server_sock, NULL, NULL);
+static void incomming(int server_sock) {
+    int client = accept(server_sock, NULL, NULL);
     if (client == -1) {
         perror("error connecting client");
         return;
@@ -124,9 +172,9 @@ static void loop() {
             if (FD_ISSET(fd, &tmp_set)) {
                 --res;
                 /* fd is readable */
-                if (fd == tcp_server_sock) {
+                if ((fd == tcp_server_sock) || (fd == unix_server_sock)) {
                     /* incoming connection */
-                    incomming();
+                    incomming(fd);
                 } else {
                     /* incoming data */
                     read_data(fd);
@@ -1,18 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "communication/communication.h"
 #include "communication/protocol.h"
+#include "communication/event.h"
 
 #include "process/process.h"
 #include "process/thread.h"
 
+#include "procutil/ptrace.h"
 #include "procutil/wait.h"
 #include "injectable/injectable.h"
 
 #include "util/signal.h"
 #include "util/capabilities.h"
+#include "util/eventloop.h"
 
 #include "logger.h"
 
@@ -20,14 +24,22 @@ static void cleanup() {
     debug("Cleaning up...");
     process_cleanup();
     comm_cleanup();
+    event_cleanup();
+    wait_cleanup();
+    eventloop_cleanup();
     protocol_cleanup();
     injectable_cleanup();
     debug("Cleanup complete.");
 }
 
+/* Control socket configuration, set by command line options. */
+static int comm_port = COMM_PORT;
+static const char * comm_unix_name = COMM_UNIX_NAME;
+
 static void init() {
 
-    int initialized = protocol_init() && caps_init() && signal_init() && comm_init() && injectable_init();
+    int initialized = protocol_init() && caps_init() && signal_init() && eventloop_init() &&
+                      wait_init() && comm_init(comm_port, comm_unix_name) && injectable_init();
     
     if (!initialized) {
         fatal("Initialization failed.");
@@ -58,20 +70,16 @@ static void loop() {
         }
         #endif
         
-        signal_wait();
+        /* Dispatch socket and SIGCHLD events.  Block only if there are no pending child events, which can happen if
+         * the last wait_main call didn't collect all of them. */
+        eventloop_wait(!wait_pending());
         
-        if (likely(signal_child)) {
+        if (likely(wait_pending())) {
             wait_main();
         }
         
-        if (unlikely(signal_io)) {
-            comm_handle_io();
-            signal_io = 0;
-        }
-        
-        if (unlikely(signal_disconnected)) {
-            comm_handle_io();
-        }
+        /* Notify subscribed clients about everything that happened in this iteration. */
+        event_flush();
         
         if (unlikely(signal_alarm)) {
             alarm(10);
@@ -84,8 +92,50 @@ static void loop() {
 }
 
 
-int main(/* int argc, char * argv[] */) {
+static void usage(const char * name) {
+    fprintf(stderr,
+            "Usage: %s [-a] [-p PORT] [-u NAME]\n"
+            "  -a       attach with PTRACE_ATTACH and stop threads with SIGSTOP instead of PTRACE_SEIZE\n"
+            "  -p PORT  listen on the given TCP port, 0 disables TCP (default: %d)\n"
+            "  -u NAME  listen on the given abstract unix socket, empty name disables it (default: %s)\n",
+            name, COMM_PORT, COMM_UNIX_NAME);
+}
+
+static void parse_args(int argc, char * argv[]) {
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "ap:u:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                ptrace_seize_mode = false;
+                break;
+            case 'p': {
+                    char * end;
+                    long port = strtol(optarg, &end, 10);
+                    if (*end || (port < 0) || (port > 65535)) {
+                        usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                    }
+                    comm_port = (int) port;
+                    break;
+                }
+            case 'u':
+                comm_unix_name = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int main(int argc, char * argv[]) {
 
+    parse_args(argc, argv);
+    
     info("Welcome to ADBI server.");
     debug("Built on %s at %s.", __DATE__, __TIME__);
     
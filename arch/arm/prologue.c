@@ -0,0 +1,25 @@
+#include "tracepoint/tracepoint.h"
+#include "tracepoint/prologue.h"
+
+/* Prologues are not implemented for ARM and Thumb, tracepoints always use plain handler templates. */
+size_t prologue_encode(const tracepoint_t * tracepoint, address_t address, void * out) {
+    UNUSED(tracepoint);
+    UNUSED(address);
+    UNUSED(out);
+    return 0;
+}
+
+/* Without prologues there are no exclusive loops in trampolines. */
+bool prologue_is_exclusive(insn_t insn) {
+    UNUSED(insn);
+    return false;
+}
+
+/* Predicates are not supported either, so no register names are recognized. */
+bool prologue_parse_register(const char * name, size_t length, unsigned int * reg, unsigned int * size) {
+    UNUSED(name);
+    UNUSED(length);
+    UNUSED(reg);
+    UNUSED(size);
+    return false;
+}
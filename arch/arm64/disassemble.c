@@ -93,7 +93,7 @@ void arm64_disassemble_handler(thread_t * thread, tracepoint_t * tracepoint, voi
     struct process_t * process = thread->process;
     insn_t insn;
     offset_t offset = 0;
-    address_t base = tracepoint->trampoline;
+    address_t base = tracepoint_template_address(tracepoint);
 
     int is_patched(size_t bytes) {
         for (offset_t x = 0; x < (offset_t) bytes; ++x) {
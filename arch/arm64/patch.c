@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "process/process.h"
 #include "procutil/mem.h"
 
@@ -41,15 +43,58 @@ bool patch_insn(thread_t * thread, address_t address, insn_kind_t kind, insn_t i
     //debug("Patching instruction in process %s at %p with: %x\t%s", str_process(thread->process),
     //        (void *) address, insn, arm64_disassemble_extended(insn, kind, address));
 
+    uint8_t bytes[4];
+    size_t size = patch_encode_insn(kind, insn, bytes);
+    return (mem_write(thread, address, size, bytes) == size);
+}
+
+/* Store the memory representation of the given instruction in out.  Return its size. */
+size_t patch_encode_insn(insn_kind_t kind, insn_t insn, void * out) {
     if (kind == INSN_KIND_T32_16) {
         uint16_t insn16 = (uint16_t) insn;
-        return (mem_write(thread, address, 2, &insn16) == 2);
+        memcpy(out, &insn16, 2);
+        return 2;
     } else {
         if (kind == INSN_KIND_T32_32)
             insn = t32_swap_halfwords(insn);
-        return (mem_write(thread, address, 4, &insn) == 4);
+        memcpy(out, &insn, 4);
+        return 4;
     }
-    
+}
+
+#define VENEER_INSN_A32         0xe51ff004    /* ldr pc, [pc, #-4] */
+#define VENEER_INSN_T32_32      0xf8dff000    /* ldr.w pc, [pc, #0] */
+
+size_t patch_encode_veneer(insn_kind_t kind, address_t address, address_t dest, void * out) {
+    uint32_t code[2];
+
+    assert((address % VENEER_SIZE) == 0);
+
+    switch (kind) {
+        case INSN_KIND_A64:
+            /* A64 has no indirect branch without a scratch register, so the veneer is a plain branch and longer
+             * distances are covered by chaining veneers. */
+            if (!arm64_check_relative_jump_kind(kind, address, dest))
+                return 0;
+            return patch_encode_insn(kind, arm64_get_relative_jump_insn(kind, address, dest), out);
+        case INSN_KIND_A32:
+            /* The literal follows the instruction, PC reads as address + 8. */
+            code[0] = VENEER_INSN_A32;
+            code[1] = (uint32_t) dest;
+            break;
+        case INSN_KIND_T32_16:
+        case INSN_KIND_T32_32:
+            /* The literal follows the instruction, PC reads as address + 4.  The loaded address keeps the Thumb
+             * state. */
+            patch_encode_insn(INSN_KIND_T32_32, VENEER_INSN_T32_32, &code[0]);
+            code[1] = (uint32_t) dest | 1;
+            break;
+        default:
+            adbi_bug_unrechable();
+            return 0;
+    }
+    memcpy(out, code, sizeof(code));
+    return sizeof(code);
 }
 
 void patch_breakpoint(thread_t * thread, address_t address, insn_kind_t kind) {
@@ -0,0 +1,549 @@
+#include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "tracepoint/tracepoint.h"
+#include "tracepoint/prologue.h"
+#include "tracepoint/predicate.h"
+#include "tracepoint/slot.h"
+
+/* Prologues are implemented for A64 only.  They use x15, x16 and x17 as scratch registers and they preserve the
+ * condition flags.  The registers and the flags are saved in a frame below the stack pointer:
+ *
+ *      [sp, #0]    x16
+ *      [sp, #8]    x17
+ *      [sp, #16]   x15
+ *      [sp, #24]   nzcv (only if the prologue evaluates a predicate)
+ *
+ * The prologue is assembled by a tiny assembler.  Branches refer to labels, which are resolved when the code is
+ * complete, and 64-bit constants are placed in a literal pool after the code.
+ */
+
+#define A64_FRAME_SIZE          32
+
+#define A64_STP_X16_X17_PRE     0xa9be47f0      /* stp  x16, x17, [sp, #-32]! */
+#define A64_STR_X15_SP16        0xf9000bef      /* str  x15, [sp, #16] */
+#define A64_LDR_X15_SP16        0xf9400bef      /* ldr  x15, [sp, #16] */
+#define A64_STR_X15_SP24        0xf9000fef      /* str  x15, [sp, #24] */
+#define A64_LDR_X15_SP24        0xf9400fef      /* ldr  x15, [sp, #24] */
+#define A64_LDP_X16_X17_POST    0xa8c247f0      /* ldp  x16, x17, [sp], #32 */
+#define A64_MRS_X15_NZCV        0xd53b420f      /* mrs  x15, nzcv */
+#define A64_MSR_NZCV_X15        0xd51b420f      /* msr  nzcv, x15 */
+#define A64_LDXR_X17_X16        0xc85f7e11      /* ldxr x17, [x16] */
+#define A64_ADD_X17_1           0x91000631      /* add  x17, x17, #1 */
+#define A64_STXR_W15_X17_X16    0xc80f7e11      /* stxr w15, x17, [x16] */
+#define A64_LDR_X15_X16_8       0xf940060f      /* ldr  x15, [x16, #8] */
+#define A64_MOV_X17_X15         0xaa0f03f1      /* mov  x17, x15 */
+#define A64_SUB_X17_1           0xd1000631      /* sub  x17, x17, #1 */
+#define A64_MOV_W17_1           0x52800031      /* mov  w17, #1 */
+#define A64_STRB_W17_X16        0x39000211      /* strb w17, [x16] */
+#define A64_STR_W17_X16         0xb9000211      /* str  w17, [x16] */
+#define A64_DC_CVAU_X16         0xd50b7b30      /* dc   cvau, x16 */
+#define A64_IC_IVAU_X16         0xd50b7530      /* ic   ivau, x16 */
+#define A64_DSB_ISH             0xd5033b9f      /* dsb  ish */
+#define A64_ISB                 0xd5033fdf      /* isb */
+#define A64_NOP                 0xd503201f      /* nop */
+
+#define A64_B                   0x14000000
+#define A64_B_COND              0x54000000
+#define A64_CBNZ_W              0x35000000
+#define A64_CBNZ_X              0xb5000000
+#define A64_LDR_LITERAL_X       0x58000000
+#define A64_ADR                 0x10000000
+
+#define A64_X15                 15
+#define A64_X16                 16
+#define A64_X17                 17
+#define A64_SP                  31
+
+/* Condition codes of unsigned comparisons. */
+#define A64_COND_EQ             0x0
+#define A64_COND_NE             0x1
+#define A64_COND_HS             0x2
+#define A64_COND_LO             0x3
+#define A64_COND_HI             0x8
+#define A64_COND_LS             0x9
+
+#define A64_MAX_INSNS           (PROLOGUE_MAX_SIZE / 4)
+#define A64_MAX_LABELS          (PREDICATE_MAX_NODES + 4)
+
+typedef enum a64_fixup_kind_t {
+    /* branch to a label (imm26) */
+    A64_FIXUP_B,
+    /* conditional branch or compare and branch to a label (imm19) */
+    A64_FIXUP_B19,
+    /* load of a literal (imm19) */
+    A64_FIXUP_LITERAL,
+    /* address of a label (imm21) */
+    A64_FIXUP_ADR,
+    /* branch to the template instance following the prologue */
+    A64_FIXUP_TEMPLATE,
+    /* branch to the out-of-line part of the template */
+    A64_FIXUP_OOL,
+} a64_fixup_kind_t;
+
+typedef struct a64_fixup_t {
+    a64_fixup_kind_t kind;
+    size_t at;
+    unsigned int target;
+} a64_fixup_t;
+
+typedef struct a64_asm_t {
+    insn_t code[A64_MAX_INSNS];
+    size_t count;
+
+    /* instruction indices of labels */
+    size_t labels[A64_MAX_LABELS];
+    unsigned int label_count;
+
+    a64_fixup_t fixups[A64_MAX_INSNS];
+    size_t fixup_count;
+
+    uint64_t literals[A64_MAX_INSNS / 2];
+    size_t literal_count;
+
+    /* index of the literal holding a branch from the prologue start to the out-of-line part or -1 */
+    long ool_branch_literal;
+
+    bool overflow;
+} a64_asm_t;
+
+static void a64_emit(a64_asm_t * as, insn_t insn) {
+    if (as->count == A64_MAX_INSNS) {
+        as->overflow = true;
+        return;
+    }
+    as->code[as->count++] = insn;
+}
+
+static void a64_emit_fixup(a64_asm_t * as, insn_t insn, a64_fixup_kind_t kind, unsigned int target) {
+    if (as->fixup_count == A64_MAX_INSNS) {
+        as->overflow = true;
+        return;
+    }
+    as->fixups[as->fixup_count].kind = kind;
+    as->fixups[as->fixup_count].at = as->count;
+    as->fixups[as->fixup_count].target = target;
+    ++as->fixup_count;
+    a64_emit(as, insn);
+}
+
+static unsigned int a64_label(a64_asm_t * as) {
+    assert(as->label_count < A64_MAX_LABELS);
+    as->labels[as->label_count] = (size_t) -1;
+    return as->label_count++;
+}
+
+static void a64_bind(a64_asm_t * as, unsigned int label) {
+    as->labels[label] = as->count;
+}
+
+static void a64_b(a64_asm_t * as, unsigned int label) {
+    a64_emit_fixup(as, A64_B, A64_FIXUP_B, label);
+}
+
+static void a64_b_cond(a64_asm_t * as, unsigned int cond, unsigned int label) {
+    a64_emit_fixup(as, A64_B_COND | cond, A64_FIXUP_B19, label);
+}
+
+/* ldr xt, =value */
+static void a64_ldr_literal(a64_asm_t * as, unsigned int rt, uint64_t value) {
+    if (as->literal_count == A64_MAX_INSNS / 2) {
+        as->overflow = true;
+        return;
+    }
+    as->literals[as->literal_count] = value;
+    a64_emit_fixup(as, A64_LDR_LITERAL_X | rt, A64_FIXUP_LITERAL, as->literal_count++);
+}
+
+/* Resolve all references and store the code followed by the literal pool in out.  Return the size. */
+static size_t a64_finish(a64_asm_t * as, address_t address, address_t ool, void * out) {
+    /* The literal pool is 8-byte aligned relative to the prologue start. */
+    size_t pool = (as->count + 1) & ~1;
+    size_t size = (pool + 2 * as->literal_count) * 4;
+    uint8_t * bytes = out;
+
+    if (as->overflow || (size > PROLOGUE_MAX_SIZE))
+        return 0;
+
+    for (size_t i = 0; i < as->fixup_count; ++i) {
+        const a64_fixup_t * fixup = &as->fixups[i];
+        address_t from = address + fixup->at * 4;
+        insn_t * insn = &as->code[fixup->at];
+        offset_t offset;
+
+        switch (fixup->kind) {
+            case A64_FIXUP_B:
+                assert(as->labels[fixup->target] != (size_t) -1);
+                offset = ((offset_t) as->labels[fixup->target] - (offset_t) fixup->at) * 4;
+                *insn |= ((insn_t) offset >> 2) & 0x03ffffff;
+                break;
+            case A64_FIXUP_B19:
+                assert(as->labels[fixup->target] != (size_t) -1);
+                offset = ((offset_t) as->labels[fixup->target] - (offset_t) fixup->at) * 4;
+                *insn |= (((insn_t) offset >> 2) & 0x7ffff) << 5;
+                break;
+            case A64_FIXUP_LITERAL:
+                offset = ((offset_t) (pool + 2 * fixup->target) - (offset_t) fixup->at) * 4;
+                *insn |= (((insn_t) offset >> 2) & 0x7ffff) << 5;
+                break;
+            case A64_FIXUP_ADR:
+                assert(as->labels[fixup->target] != (size_t) -1);
+                offset = ((offset_t) as->labels[fixup->target] - (offset_t) fixup->at) * 4;
+                *insn |= (((insn_t) offset & 3) << 29) | ((((insn_t) offset >> 2) & 0x7ffff) << 5);
+                break;
+            case A64_FIXUP_TEMPLATE:
+                *insn = arm64_get_relative_jump_insn(INSN_KIND_A64, from, address + size);
+                break;
+            case A64_FIXUP_OOL:
+                *insn = arm64_get_relative_jump_insn(INSN_KIND_A64, from, address + size + ool);
+                break;
+        }
+    }
+
+    if (as->ool_branch_literal >= 0)
+        as->literals[as->ool_branch_literal] = arm64_get_relative_jump_insn(INSN_KIND_A64, address,
+                                                                           address + size + ool);
+
+    memset(bytes, 0, size);
+    memcpy(bytes, as->code, as->count * 4);
+    memcpy(bytes + pool * 4, as->literals, as->literal_count * 8);
+    return size;
+}
+
+/**********************************************************************************************************************/
+
+/* Load the original value of the given register into rt. */
+static void a64_load_register(a64_asm_t * as, unsigned int reg, unsigned int rt) {
+    switch (reg) {
+        case A64_SP:
+            /* add rt, sp, #frame */
+            a64_emit(as, 0x91000000 | (A64_FRAME_SIZE << 10) | (A64_SP << 5) | rt);
+            break;
+        case A64_X16:
+        case A64_X17:
+        case A64_X15:
+            /* ldr rt, [sp, #slot] */
+            a64_emit(as, 0xf9400000 | ((reg == A64_X15 ? 2 : reg - A64_X16) << 10) | (A64_SP << 5) | rt);
+            break;
+        default:
+            /* mov rt, xreg */
+            a64_emit(as, 0xaa0003e0 | (reg << 16) | rt);
+            break;
+    }
+}
+
+/* Replace the address in rt with the value of the given size stored at rt + offset.  x15 may be clobbered. */
+static void a64_load_memory(a64_asm_t * as, unsigned int rt, int64_t offset, unsigned int size) {
+    static const insn_t ldr[] = { 0x39400000, 0x79400000, 0xb9400000, 0xf9400000 };    /* ldr(b|h) rt, [rn, #imm] */
+    static const insn_t ldur[] = { 0x38400000, 0x78400000, 0xb8400000, 0xf8400000 };   /* ldur(b|h) rt, [rn, #imm] */
+    unsigned int shift = (size == 8) ? 3 : (size == 4) ? 2 : (size == 2) ? 1 : 0;
+
+    if ((offset >= 0) && !(offset & (size - 1)) && ((offset >> shift) < 4096)) {
+        a64_emit(as, ldr[shift] | ((offset >> shift) << 10) | (rt << 5) | rt);
+    } else if ((offset >= -256) && (offset < 256)) {
+        a64_emit(as, ldur[shift] | ((offset & 0x1ff) << 12) | (rt << 5) | rt);
+    } else {
+        /* ldr x15, =offset; add rt, rt, x15 */
+        a64_ldr_literal(as, A64_X15, offset);
+        a64_emit(as, 0x8b000000 | (A64_X15 << 16) | (rt << 5) | rt);
+        a64_emit(as, ldr[shift] | (rt << 5) | rt);
+    }
+}
+
+static void a64_load_operand(a64_asm_t * as, const predicate_operand_t * operand, unsigned int rt) {
+    switch (operand->kind) {
+        case PREDICATE_OPERAND_CONST:
+            if ((uint64_t) operand->value < 0x10000)
+                /* movz rt, #value */
+                a64_emit(as, 0xd2800000 | (operand->value << 5) | rt);
+            else
+                a64_ldr_literal(as, rt, operand->value);
+            break;
+        case PREDICATE_OPERAND_REG:
+            a64_load_register(as, operand->reg, rt);
+            break;
+        case PREDICATE_OPERAND_MEM:
+            a64_load_register(as, operand->reg, rt);
+            a64_load_memory(as, rt, operand->value, operand->size);
+            break;
+    }
+}
+
+/* Compare two operands and branch to the label matching the result.  The comparison is 32 bits wide if all
+ * non-constant operands are 32 bits wide or narrower. */
+static void a64_compare(a64_asm_t * as, const predicate_node_t * node, unsigned int on_true, unsigned int on_false) {
+    static const unsigned int cond[] = {
+        [PREDICATE_EQ] = A64_COND_EQ,
+        [PREDICATE_NE] = A64_COND_NE,
+        [PREDICATE_LT] = A64_COND_LO,
+        [PREDICATE_LE] = A64_COND_LS,
+        [PREDICATE_GT] = A64_COND_HI,
+        [PREDICATE_GE] = A64_COND_HS,
+    };
+    bool wide = (node->lhs.size > 4) || ((node->rhs.kind != PREDICATE_OPERAND_CONST) && (node->rhs.size > 4));
+    insn_t sf = wide ? 0x80000000 : 0;
+    uint64_t imm = node->rhs.value;
+
+    if (!wide)
+        imm &= 0xffffffff;
+
+    a64_load_operand(as, &node->lhs, A64_X16);
+
+    if ((node->rhs.kind == PREDICATE_OPERAND_CONST) && (imm < 4096)) {
+        /* cmp x16, #imm */
+        a64_emit(as, 0x7100001f | sf | (imm << 10) | (A64_X16 << 5));
+    } else {
+        /* cmp x16, x17 */
+        a64_load_operand(as, &node->rhs, A64_X17);
+        a64_emit(as, 0x6b00001f | sf | (A64_X17 << 16) | (A64_X16 << 5));
+    }
+
+    a64_b_cond(as, cond[node->op], on_true);
+    a64_b(as, on_false);
+}
+
+static void a64_predicate(a64_asm_t * as, const predicate_t * predicate, unsigned int index, unsigned int on_true,
+                          unsigned int on_false) {
+    const predicate_node_t * node = &predicate->nodes[index];
+    unsigned int next;
+
+    switch (node->type) {
+        case PREDICATE_AND:
+            next = a64_label(as);
+            a64_predicate(as, predicate, node->left, next, on_false);
+            a64_bind(as, next);
+            a64_predicate(as, predicate, node->right, on_true, on_false);
+            break;
+        case PREDICATE_OR:
+            next = a64_label(as);
+            a64_predicate(as, predicate, node->left, on_true, next);
+            a64_bind(as, next);
+            a64_predicate(as, predicate, node->right, on_true, on_false);
+            break;
+        case PREDICATE_CMP:
+            a64_compare(as, node, on_true, on_false);
+            break;
+    }
+}
+
+/**********************************************************************************************************************/
+
+/* Atomically increment the counter in the tracepoint slot:
+ *
+ *      ldr     x16, =counter
+ *  1:  ldxr    x17, [x16]
+ *      add     x17, x17, #1
+ *      stxr    w15, x17, [x16]
+ *      cbnz    w15, 1b
+ */
+static void a64_count(a64_asm_t * as, const tracepoint_t * tracepoint) {
+    unsigned int retry = a64_label(as);
+
+    a64_ldr_literal(as, A64_X16, tracepoint->slot + offsetof(tracepoint_slot_t, hits));
+    a64_bind(as, retry);
+    a64_emit(as, A64_LDXR_X17_X16);
+    a64_emit(as, A64_ADD_X17_1);
+    a64_emit(as, A64_STXR_W15_X17_X16);
+    a64_emit_fixup(as, A64_CBNZ_W | A64_X15, A64_FIXUP_B19, retry);
+}
+
+/* Decrement the sampling countdown in the tracepoint slot and branch to skip unless it reached zero.  An exhausted
+ * countdown is reloaded from the rate, so every rate-th hit passes:
+ *
+ *          ldr     x16, =countdown
+ *  1:      ldr     x15, [x16, #8]
+ *          ldxr    x17, [x16]
+ *          cbnz    x17, 2f
+ *          mov     x17, x15
+ *  2:      sub     x17, x17, #1
+ *          stxr    w15, x17, [x16]
+ *          cbnz    w15, 1b
+ *          cbnz    x17, skip
+ *
+ * The flags are not affected.
+ */
+static void a64_sample(a64_asm_t * as, const tracepoint_t * tracepoint, unsigned int skip) {
+    unsigned int retry = a64_label(as);
+    unsigned int decrement = a64_label(as);
+
+    a64_ldr_literal(as, A64_X16, tracepoint->slot + offsetof(tracepoint_slot_t, countdown));
+    a64_bind(as, retry);
+    a64_emit(as, A64_LDR_X15_X16_8);
+    a64_emit(as, A64_LDXR_X17_X16);
+    a64_emit_fixup(as, A64_CBNZ_X | A64_X17, A64_FIXUP_B19, decrement);
+    a64_emit(as, A64_MOV_X17_X15);
+    a64_bind(as, decrement);
+    a64_emit(as, A64_SUB_X17_1);
+    a64_emit(as, A64_STXR_W15_X17_X16);
+    a64_emit_fixup(as, A64_CBNZ_W | A64_X15, A64_FIXUP_B19, retry);
+    a64_emit_fixup(as, A64_CBNZ_X | A64_X17, A64_FIXUP_B19, skip);
+}
+
+/* Mark the hit in the coverage map and replace the nop at the prologue entry with a branch to the out-of-line part of
+ * the template, so that later hits pass through the trampoline without running the prologue:
+ *
+ *          mov     w17, #1
+ *          ldr     x16, =cover
+ *          strb    w17, [x16]
+ *          adr     x16, entry
+ *          ldr     x17, =<b ool>
+ *          str     w17, [x16]
+ *          dc      cvau, x16
+ *          dsb     ish
+ *          ic      ivau, x16
+ *          dsb     ish
+ *          isb
+ *
+ * Replacing a nop with a branch is one of the few code modifications allowed while other threads may execute the
+ * instruction.  Threads which still see the nop mark the map again, which is harmless.
+ */
+static void a64_cover(a64_asm_t * as, const tracepoint_t * tracepoint, unsigned int entry) {
+    a64_emit(as, A64_MOV_W17_1);
+    a64_ldr_literal(as, A64_X16, tracepoint->cover);
+    a64_emit(as, A64_STRB_W17_X16);
+    a64_emit_fixup(as, A64_ADR | A64_X16, A64_FIXUP_ADR, entry);
+    a64_ldr_literal(as, A64_X17, 0);
+    if (!as->overflow)
+        as->ool_branch_literal = as->literal_count - 1;
+    a64_emit(as, A64_STR_W17_X16);
+    a64_emit(as, A64_DC_CVAU_X16);
+    a64_emit(as, A64_DSB_ISH);
+    a64_emit(as, A64_IC_IVAU_X16);
+    a64_emit(as, A64_DSB_ISH);
+    a64_emit(as, A64_ISB);
+}
+
+static void a64_restore(a64_asm_t * as, bool flags) {
+    if (flags) {
+        a64_emit(as, A64_LDR_X15_SP24);
+        a64_emit(as, A64_MSR_NZCV_X15);
+    }
+    a64_emit(as, A64_LDR_X15_SP16);
+    a64_emit(as, A64_LDP_X16_X17_POST);
+}
+
+/* The prologue has the following structure:
+ *
+ *  entry:  <cover mode: nop, replaced by b ool after the first hit>
+ *          <save scratch registers and flags>
+ *          <evaluate the predicate, branch to skip if false>
+ *          <sampling: branch to skip unless the hit is sampled>
+ *          <count mode: increment the counter, continue at skip>
+ *          <cover mode: mark the map and patch the entry, continue at skip>
+ *          <restore>
+ *          b       template
+ *  skip:   <restore>
+ *          b       ool
+ *          <literal pool>
+ */
+size_t prologue_encode(const tracepoint_t * tracepoint, address_t address, void * out) {
+    a64_asm_t as;
+    bool flags = tracepoint->predicate != NULL;
+    unsigned int skip, entry;
+
+    if (tracepoint->insn_kind != INSN_KIND_A64)
+        return 0;
+
+    if ((tracepoint->mode == TRACEPOINT_MODE_HANDLER) && !tracepoint->predicate && !tracepoint->sampled)
+        return 0;
+
+    as.count = 0;
+    as.label_count = 0;
+    as.fixup_count = 0;
+    as.literal_count = 0;
+    as.ool_branch_literal = -1;
+    as.overflow = false;
+
+    skip = a64_label(&as);
+    entry = a64_label(&as);
+
+    a64_bind(&as, entry);
+    if (tracepoint->mode == TRACEPOINT_MODE_COVER)
+        a64_emit(&as, A64_NOP);
+
+    a64_emit(&as, A64_STP_X16_X17_PRE);
+    a64_emit(&as, A64_STR_X15_SP16);
+    if (flags) {
+        a64_emit(&as, A64_MRS_X15_NZCV);
+        a64_emit(&as, A64_STR_X15_SP24);
+    }
+
+    if (tracepoint->predicate) {
+        unsigned int pass = a64_label(&as);
+        a64_predicate(&as, tracepoint->predicate, tracepoint->predicate->count - 1, pass, skip);
+        a64_bind(&as, pass);
+    }
+
+    if (tracepoint->sampled)
+        a64_sample(&as, tracepoint, skip);
+
+    if (tracepoint->mode == TRACEPOINT_MODE_COUNT) {
+        a64_count(&as, tracepoint);
+    } else if (tracepoint->mode == TRACEPOINT_MODE_COVER) {
+        a64_cover(&as, tracepoint, entry);
+    } else {
+        a64_restore(&as, flags);
+        a64_emit_fixup(&as, A64_B, A64_FIXUP_TEMPLATE, 0);
+    }
+
+    a64_bind(&as, skip);
+    a64_restore(&as, flags);
+    a64_emit_fixup(&as, A64_B, A64_FIXUP_OOL, 0);
+
+    return a64_finish(&as, address, tracepoint->template->ool, out);
+}
+
+/* The exclusive loops of a64_count and a64_sample consist of these instructions.  Both loops restart at a label
+ * before the ldxr, so a thread anywhere in the loop, including the cbnz instructions, may need to run it again. */
+bool prologue_is_exclusive(insn_t insn) {
+    switch (insn) {
+        case A64_LDR_X15_X16_8:
+        case A64_LDXR_X17_X16:
+        case A64_MOV_X17_X15:
+        case A64_ADD_X17_1:
+        case A64_SUB_X17_1:
+        case A64_STXR_W15_X17_X16:
+            return true;
+        default:
+            break;
+    }
+
+    /* cbnz w15, <label> or cbnz x17, <label> */
+    return ((insn & 0xff00001f) == (A64_CBNZ_W | A64_X15)) || ((insn & 0xff00001f) == (A64_CBNZ_X | A64_X17));
+}
+
+/* A64 registers: x0-x30, w0-w30, fp, lr and sp. */
+bool prologue_parse_register(const char * name, size_t length, unsigned int * reg, unsigned int * size) {
+    char * end;
+    unsigned long number;
+
+    if ((length == 2) && !strncmp(name, "sp", 2)) {
+        *reg = A64_SP;
+        *size = 8;
+        return true;
+    }
+
+    if ((length == 2) && !strncmp(name, "fp", 2)) {
+        *reg = 29;
+        *size = 8;
+        return true;
+    }
+
+    if ((length == 2) && !strncmp(name, "lr", 2)) {
+        *reg = 30;
+        *size = 8;
+        return true;
+    }
+
+    if ((length < 2) || (length > 3) || ((name[0] != 'x') && (name[0] != 'w')) || !isdigit((unsigned char) name[1]))
+        return false;
+
+    number = strtoul(name + 1, &end, 10);
+    if ((end != name + length) || (number > 30))
+        return false;
+
+    *reg = number;
+    *size = (name[0] == 'x') ? 8 : 4;
+    return true;
+}
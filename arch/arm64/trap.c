@@ -4,7 +4,9 @@
 #include "procutil/ptrace.h"
 #include "process/linker.h"
 
-bool thread_trap(thread_t * thread) {
+/* Handle a trap of the thread.  If jump_only is set, only tracepoint hits are handled, which need no remote calls (see
+ * wait_serve).  Return true if the trap was handled. */
+bool thread_trap(thread_t * thread, bool jump_only) {
 
     pt_regs regs;
     address_t ip, jump_target;
@@ -17,6 +19,9 @@ bool thread_trap(thread_t * thread) {
     ip = regs.pc;
     jump_target = jump_get(thread->process, ip);
     
+    if (jump_only && !jump_target)
+        return false;
+        
     debug("Thread %s hit a break at %s.", str_thread(thread), str_address(thread->process, ip));
     
     #if 0   /* enable to see full context on each hit */
@@ -4,49 +4,149 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <signal.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
 
-#include "signal.h"
+#include "tree.h"
+
+#include "util/eventloop.h"
+
 #include "protocol.h"
+#include "communication.h"
+#include "event.h"
+
+/* Maximum accepted size of a request payload.  Anything larger is treated as a protocol error. */
+#define COMM_MAX_PAYLOAD (16 * 1024 * 1024)
+
+/* Amount of data read from a client connection in a single read call. */
+#define COMM_READ_CHUNK 4096
+
+/* Stream producers are called only if less data is waiting to be sent. */
+#define COMM_STREAM_THRESHOLD (64 * 1024)
+
+/* Maximum number of stream producer calls per event loop iteration.  This makes sure that a fast stream does not
+ * delay handling of other clients and traced processes. */
+#define COMM_STREAM_BUDGET 8
+
+/* If more data than the high watermark is waiting to be sent to a client, requests from the client are not handled
+ * until the amount drops below the low watermark.  This way a client which doesn't read its responses can't make the
+ * server buffer an unlimited amount of data. */
+#define COMM_HIGH_WATERMARK (4 * 1024 * 1024)
+#define COMM_LOW_WATERMARK  (1024 * 1024)
+
+/* Maximum number of iovecs passed to a single sendmsg call. */
+#define COMM_IOV_MAX 64
+
+/* Growable byte buffer used for incoming data of client connections. */
+typedef struct comm_buffer_t {
+    uint8_t * data;
+    size_t size;
+    size_t capacity;
+} comm_buffer_t;
+
+/* Packet waiting in the outbound queue of a client connection. */
+typedef struct comm_packet_t {
+    struct comm_packet_t * next;
+    packet_header_t head;
+    void * payload;         /* owned by the queue */
+    int fd;                 /* file descriptor passed along with the packet or -1, owned by the queue */
+} comm_packet_t;
+
+/* Client connection. */
+struct comm_client_t {
+    int fd;
+    bool local;             /* connected through a unix domain socket, file descriptors can be passed */
+    comm_buffer_t in;       /* received data, which was not handled yet */
+    
+    /* Outbound packet queue. */
+    struct {
+        comm_packet_t * first;
+        comm_packet_t * last;
+        size_t size;        /* total amount of bytes waiting to be sent */
+        size_t sent;        /* amount of bytes of the first packet already sent */
+    } out;
+    
+    bool throttled;         /* requests are not handled, because too much data is waiting to be sent */
+    bool eof;               /* the client shut down its side of the connection, no more requests are read */
+    
+    /* Active response stream. */
+    struct {
+        comm_producer_t producer;
+        void (*release)(void *);
+        void * data;
+    } stream;
+};
+
+/* Listening socket. */
+typedef struct comm_listener_t {
+    int fd;
+    int family;             /* AF_INET or AF_UNIX */
+} comm_listener_t;
+
+static comm_listener_t comm_listener_tcp = { -1, AF_INET };
+static comm_listener_t comm_listener_unix = { -1, AF_UNIX };
+
+/* Connected clients, indexed by socket file descriptor. */
+static tree_t comm_clients = NULL;
+
+/***********************************************************************************************************************
+ * Buffers
+ **********************************************************************************************************************/
+
+/* Make sure at least count bytes can be appended to the buffer without reallocation. */
+static void comm_buffer_reserve(comm_buffer_t * buffer, size_t count) {
+    if (buffer->size + count > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : COMM_READ_CHUNK;
+        while (buffer->size + count > capacity)
+            capacity *= 2;
+        buffer->data = adbi_realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+}
+
+/* Remove count bytes from the beginning of the buffer. */
+static void comm_buffer_consume(comm_buffer_t * buffer, size_t count) {
+    assert(count <= buffer->size);
+    buffer->size -= count;
+    if (buffer->size)
+        memmove(buffer->data, buffer->data + count, buffer->size);
+}
+
+static void comm_buffer_free(comm_buffer_t * buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
 
-static int comm_server_sock = -1;
-static int comm_connection_sock = -1;
+/***********************************************************************************************************************
+ * Sockets
+ **********************************************************************************************************************/
 
-/* Set up the file descriptor for asynchronous operation.  Set the O_NONBLOCK and O_ASYNC flags. Also make sure the
- * current process will receive the SIGIO signals related to this file descriptor. */
-static bool comm_enable_async_io(int fd) {
-    /* Set flags. */
+/* Set the O_NONBLOCK flag on the given file descriptor. */
+static bool comm_set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     
-    if (flags == -1)
-        goto fail;
-        
-    if (fcntl(fd, F_SETFL, flags | O_ASYNC | O_NONBLOCK) == -1)
-        goto fail;
-        
-    /* Make sure we'll receive the SIGIO signals. */
-    if (fcntl(fd, F_SETOWN, getpid()) == -1)
-        goto fail;
-        
-    debug("Asynchronous I/O operation enabled on fd %i.", fd);
+    if ((flags == -1) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+        error("Error enabling non-blocking operation on fd %i: %s.", fd, strerror(errno));
+        return false;
+    }
+    
     return true;
-fail:
-    error("Error enabling asynchronous I/O operation on fd %i: %s.", fd, strerror(errno));
-    return false;
 }
 
-/* Set a single option on the server socket using setsockopt. */
-static bool comm_setsockopt(int option, int value) {
+/* Set a single option on a socket using setsockopt. */
+static bool comm_setsockopt(int sock, int option, int value) {
     int optval = value;
     socklen_t optlen = sizeof(optval);
-    return (setsockopt(comm_server_sock, SOL_SOCKET, option, &optval, optlen) >= 0);
+    return (setsockopt(sock, SOL_SOCKET, option, &optval, optlen) >= 0);
 }
 
 /* Close a socket gracefully by first shutting it down and then closing the fd. */
@@ -55,7 +155,7 @@ static void close_socket(int sock) {
     if (shutdown(sock, SHUT_RDWR) < 0) {
         /* Shutdown failed. This is okay only if the socket is not connected anymore (this occurs on
          * unexpected disconnection).  All other errors here are unacceptable and mean that we have a bug. */
-        adbi_assure(errno == ENOTCONN);
+        adbi_assure((errno == ENOTCONN) || (errno == EINVAL));
     }
     
     /* Close the connection. We need to do this in a loop, because close can fail. See man for details. */
@@ -64,215 +164,521 @@ static void close_socket(int sock) {
     }
 }
 
-/* Close client connection if not closed already. */
-static void comm_close_connection() {
-    if (comm_connection_sock >= 0) {
-        close_socket(comm_connection_sock);
-        comm_connection_sock = -1;
-        info("Client connection closed.");
+/* Finish the active stream of the client. */
+static void comm_stream_end(comm_client_t * client) {
+    void (*release)(void *) = client->stream.release;
+    void * data = client->stream.data;
+    
+    client->stream.producer = NULL;
+    client->stream.release = NULL;
+    client->stream.data = NULL;
+    
+    if (release)
+        release(data);
+}
+
+/* Close a client connection and release all its resources. */
+static void comm_close_client(comm_client_t * client) {
+    event_unsubscribe(client);
+    if (client->stream.producer)
+        comm_stream_end(client);
+    eventloop_remove(client->fd);
+    tree_remove(&comm_clients, client->fd);
+    close_socket(client->fd);
+    info("Client connection %d closed.", client->fd);
+    comm_buffer_free(&client->in);
+    while (client->out.first) {
+        comm_packet_t * packet = client->out.first;
+        client->out.first = packet->next;
+        if (packet->fd >= 0)
+            close(packet->fd);
+        free(packet->payload);
+        free(packet);
     }
+    free(client);
 }
 
-/* Close server socket if not closed already. */
-static void comm_close_server() {
-    if (comm_server_sock >= 0) {
-        close_socket(comm_server_sock);
-        comm_server_sock = -1;
+/* Close a listening socket if not closed already. */
+static void comm_close_server(comm_listener_t * listener) {
+    if (listener->fd >= 0) {
+        eventloop_remove(listener->fd);
+        close_socket(listener->fd);
+        listener->fd = -1;
         info("Server socket closed.");
     }
 }
 
-/* Open server socket on given port and start listening.  Return success flag.  This function doesn't call accept, so
- * it doesn't block. */
-static int comm_init_server(int port) {
+/***********************************************************************************************************************
+ * Client connections
+ **********************************************************************************************************************/
 
-    struct sockaddr_in address;
+/* Queue a packet for sending to the client.  The payload is taken over from the packet (see packet_take_payload), so
+ * in most cases it is not copied. */
+void comm_queue(comm_client_t * client, const packet_t * packet) {
+    comm_queue_fd(client, packet, -1);
+}
+
+/* Return true if file descriptors can be passed to the client (see comm_queue_fd). */
+bool comm_client_local(const comm_client_t * client) {
+    return client->local;
+}
+
+/* Queue a packet for sending to the client and pass the file descriptor fd along with it (using SCM_RIGHTS).  The
+ * queue takes ownership of the descriptor, it is closed after sending.  The client receives the descriptor together
+ * with the first bytes of the packet header.  Only local clients (see comm_client_local) can receive descriptors. */
+void comm_queue_fd(comm_client_t * client, const packet_t * packet, int fd) {
+    comm_packet_t * queued = adbi_malloc(sizeof(comm_packet_t));
     
-    assert(comm_server_sock == -1);
+    debug("Queuing packet (%u bytes).", (unsigned int) packet->head.length);
+    assert((fd < 0) || client->local);
     
-    comm_server_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    queued->next = NULL;
+    queued->head = packet->head;
+    queued->payload = packet_take_payload(packet);
+    queued->fd = fd;
     
-    if (comm_server_sock < 0) {
-        error("Error creating TCP socket.");
-        goto fail;
-    }
+    if (client->out.last)
+        client->out.last->next = queued;
+    else
+        client->out.first = queued;
+    client->out.last = queued;
     
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
-    address.sin_addr.s_addr = INADDR_ANY;
+    client->out.size += sizeof(packet_header_t) + packet->head.length;
+}
+
+/* Return true if a lot of data is waiting to be sent to the client.  Unsolicited data should be held back then. */
+bool comm_client_busy(const comm_client_t * client) {
+    return client->throttled || (client->out.size > COMM_LOW_WATERMARK);
+}
+
+/* Update the events monitored on the client socket.  Stop reading requests while throttled or after the client shut
+ * down its side of the connection and wait for EPOLLOUT only if there is something left to send. */
+static bool comm_update_events(comm_client_t * client) {
+    return eventloop_modify(client->fd, ((client->throttled || client->eof) ? 0 : EPOLLIN) |
+                            ((client->out.first || client->stream.producer) ? EPOLLOUT : 0));
+}
+
+/* Queue a packet, which is not a response to a request being handled (e.g. an event notification).  The packet is
+ * sent when the socket becomes writable. */
+void comm_post(comm_client_t * client, const packet_t * packet) {
+    comm_queue(client, packet);
+    comm_update_events(client);
+}
+
+/* Start a response stream on the given client connection.  The producer is called from the event loop until it returns
+ * false.  The release function is called with the data pointer when the stream ends (also if the client disconnects).
+ * Only one stream can be active on a connection at a time.  Return false if there already is an active stream. */
+bool comm_stream_start(comm_client_t * client, comm_producer_t producer, void (*release)(void *), void * data) {
+    if (client->stream.producer)
+        return false;
+    client->stream.producer = producer;
+    client->stream.release = release;
+    client->stream.data = data;
+    return true;
+}
+
+/* Remove count sent bytes from the outbound queue. */
+static void comm_consume(comm_client_t * client, size_t count) {
+    assert(count <= client->out.size);
+    client->out.size -= count;
     
-    if (!comm_setsockopt(SO_REUSEADDR, 1))
-        warning("Can not set SO_REUSEADDR option of listening socket. You may have trouble creating sockets at this "
-                "address after adbiserver exits.");
+    while (count) {
+        comm_packet_t * packet = client->out.first;
+        size_t left = sizeof(packet_header_t) + packet->head.length - client->out.sent;
+        
+        if (count < left) {
+            client->out.sent += count;
+            return;
+        }
+        
+        count -= left;
+        client->out.sent = 0;
+        client->out.first = packet->next;
+        if (!client->out.first)
+            client->out.last = NULL;
+        if (packet->fd >= 0)
+            close(packet->fd);
+        free(packet->payload);
+        free(packet);
+    }
+}
+
+/* Send out as much queued data as possible without blocking.  Headers and payloads of many packets are sent using a
+ * single sendmsg call.  A packet carrying a file descriptor always starts a new sendmsg call, so that the descriptor
+ * arrives with the packet header.  Return false if the connection failed. */
+static bool comm_send(comm_client_t * client) {
+    while (client->out.first) {
+        struct iovec iov[COMM_IOV_MAX];
+        struct msghdr msg;
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        comm_packet_t * first = client->out.first;
+        size_t skip = client->out.sent;
+        int iovcnt = 0;
+        
+        for (comm_packet_t * packet = first; packet && (iovcnt + 2 <= COMM_IOV_MAX); packet = packet->next) {
+            if ((packet != first) && (packet->fd >= 0))
+                break;
                 
-    if (bind(comm_server_sock, (struct sockaddr *) &address, sizeof(address)) < 0) {
-        error("Error binding TCP socket to port %i.", port);
-        goto fail;
+            if (skip < sizeof(packet_header_t)) {
+                iov[iovcnt].iov_base = (char *) &packet->head + skip;
+                iov[iovcnt].iov_len = sizeof(packet_header_t) - skip;
+                ++iovcnt;
+                skip = 0;
+            } else {
+                skip -= sizeof(packet_header_t);
+            }
+            
+            if (packet->head.length > skip) {
+                iov[iovcnt].iov_base = (char *) packet->payload + skip;
+                iov[iovcnt].iov_len = packet->head.length - skip;
+                ++iovcnt;
+            }
+            skip = 0;
+        }
+        
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        
+        if ((first->fd >= 0) && !client->out.sent) {
+            struct cmsghdr * cmsg;
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &first->fd, sizeof(int));
+        }
+        
+        ssize_t res = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        
+        if (res >= 0) {
+            if ((res > 0) && (first->fd >= 0)) {
+                /* The descriptor was passed, the receiver has its own reference now. */
+                close(first->fd);
+                first->fd = -1;
+            }
+            comm_consume(client, res);
+        } else if (errno == EINTR) {
+            /* Retry. */
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            /* Socket buffer is full, wait for EPOLLOUT. */
+            break;
+        } else {
+            error("Error sending data to client %d: %s.", client->fd, strerror(errno));
+            return false;
+        }
     }
     
-    comm_enable_async_io(comm_server_sock);
+    return true;
+}
+
+static bool comm_handle_requests(comm_client_t * client);
+
+/* Send queued data, feed the active stream and resume handling of requests if the client was throttled.  Return false
+ * if the connection failed.  This function never blocks, the rest of the data is sent when the socket becomes
+ * writable. */
+static bool comm_flush(comm_client_t * client) {
+    unsigned int budget = COMM_STREAM_BUDGET;
     
-    if (listen(comm_server_sock, 1) < 0) {
-        error("Error listening on TCP socket at port %i.", port);
-        goto fail;
+    while (1) {
+        if (!comm_send(client))
+            return false;
+            
+        if (client->throttled && (client->out.size <= COMM_LOW_WATERMARK)) {
+            /* Handle the requests left in the input buffer. */
+            client->throttled = false;
+            if (!comm_handle_requests(client))
+                return false;
+            continue;
+        }
+        
+        if (!client->stream.producer || (client->out.size >= COMM_STREAM_THRESHOLD) || !budget--)
+            break;
+            
+        if (!client->stream.producer(client, client->stream.data))
+            comm_stream_end(client);
     }
     
-    info("Listening on port %d.", port);
-    
-    return 1;
-    
-fail:
-    if (comm_server_sock >= 0)
-        close(comm_server_sock);
-    comm_server_sock = -1;
-    return 0;
+    return comm_update_events(client);
 }
 
-/* Try to accept a client connection on the server socket.  Do not block.  If there's no client waiting for an accept,
- * return false immediately.  If a client connects, close server socket, so no other client can connect, and return
- * true. */
-static bool comm_answer() {
-    info("Waiting for connection.");
-    
-    comm_connection_sock = accept(comm_server_sock, NULL, NULL);
+/* Handle all complete request packets received from the client and queue the responses.  Return false if the
+ * connection must be closed. */
+static bool comm_handle_requests(comm_client_t * client) {
+    size_t offset = 0;
     
-    if (comm_connection_sock < 0) {
-        if (errno == EWOULDBLOCK) {
-            /* Nobody's there. */
-        } else
-            error("Connection failed: %s", strerror(errno));
-        return false;
+    while (client->in.size - offset >= sizeof(packet_header_t)) {
+        packet_t request;
+        const packet_t * response;
+        
+        if (client->out.size > COMM_HIGH_WATERMARK) {
+            /* The client doesn't read the responses fast enough. */
+            debug("Throttling client %d.", client->fd);
+            client->throttled = true;
+            break;
+        }
+        
+        memcpy(&request.head, client->in.data + offset, sizeof(packet_header_t));
+        
+        if (request.head.length > COMM_MAX_PAYLOAD) {
+            error("Client %d sent a packet with invalid payload size (%u bytes).", client->fd,
+                  (unsigned int) request.head.length);
+            return false;
+        }
+        
+        if (client->in.size - offset - sizeof(packet_header_t) < request.head.length) {
+            /* Incomplete packet, wait for more data. */
+            break;
+        }
+        
+        /* The payload is not copied.  It points into the input buffer at an arbitrary offset, so it has no particular
+         * alignment.  Payload entries are packed, so values are unaligned even in an aligned payload anyway.  Handlers
+         * must copy values out of the payload (read_deref in protocol.c uses memcpy) instead of dereferencing the
+         * pointers returned by the payload API.  The payload is only valid until the handler returns. */
+        request.payload = client->in.data + offset + sizeof(packet_header_t);
+        request.client = client;
+        offset += sizeof(packet_header_t) + request.head.length;
+        
+        response = handle_packet(&request);
+        if (response)
+            comm_queue(client, response);
     }
     
-    /* We don't expect more than one client, so we close the listening socket. */
-    comm_close_server();
-    
-    /* Setup asynchronous IO */
-    comm_enable_async_io(comm_connection_sock);
-    
-    info("Accepted client connection.");
+    comm_buffer_consume(&client->in, offset);
     return true;
 }
 
-/* Send out count bytes of data from buf. The function blocks until all data is sent or an error occurs.
- * Return success flag. */
-static bool comm_send(const void * buf, unsigned int count) {
-
-    while (count > 0) {
-        ssize_t sent_bytes = write(comm_connection_sock, buf, count);
-        
-        if (sent_bytes >= 0) {
-            count -= sent_bytes;
-            buf += sent_bytes;
+/* Read all data available on the client socket.  Returns:
+ *   1  on success
+ *   0  if the client shut down the connection
+ *  -1  on failure */
+static int comm_receive(comm_client_t * client) {
+    while (1) {
+        comm_buffer_reserve(&client->in, COMM_READ_CHUNK);
+        ssize_t res = recv(client->fd, client->in.data + client->in.size, client->in.capacity - client->in.size,
+                           MSG_DONTWAIT);
+                           
+        if (res > 0) {
+            client->in.size += res;
+        } else if (res == 0) {
+            info("Client %d shut down the connection.", client->fd);
+            return 0;
+        } else if (errno == EINTR) {
+            /* Retry. */
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            /* No more data. */
+            return 1;
         } else {
-            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                /* That's ok, retry. */
-            } else {
-                /* Error */
-                error("Error sending data: %s.", strerror(errno));
-                return false;
-            }
+            error("Error receiving data from client %d: %s.", client->fd, strerror(errno));
+            return -1;
         }
     }
-    return true;
 }
 
+/* Return true if the client shut down its side of the connection and everything was sent to it, including the
+ * responses to requests held back while throttled and the active stream. */
+static bool comm_client_done(const comm_client_t * client) {
+    return client->eof && !client->throttled && !client->out.first && !client->stream.producer;
+}
 
-/* Read count bytes and store them in buf. If wait is true, the function blocks until count bytes are available.
- * Returns:
- *   0  on failure (e.g. disconnect)
- *   1  on success
- *  -1  if wait is zero and no data is available  */
-static int comm_read_raw(void * buf, unsigned int count, bool wait) {
-
-    while (count > 0) {
-        ssize_t received_bytes = read(comm_connection_sock, buf, count);
+/* Event loop callback of client connections. */
+static void comm_client_io(int fd, uint32_t events, void * data) {
+    comm_client_t * client = data;
+    assert(client->fd == fd);
+    
+    if (events & EPOLLIN) {
+        int res = comm_receive(client);
         
-        if (received_bytes > 0) {
-            count -= (int) received_bytes;
-            buf += (int) received_bytes;
-            /* We received at least one byte, so now we always wait for count bytes to become available. */
-            wait = true;
-        } else {
-            if (received_bytes == 0) {
-                warning("Connection shut down.");
-                return 0;
-            } else if (errno != EWOULDBLOCK) {
-                error("Error receiving data: %s.", strerror(errno));
-                return 0;
-            } else if (!wait) {
-                /* operation would block. */
-                return -1;
-            }
+        if ((res < 0) || !comm_handle_requests(client)) {
+            comm_close_client(client);
+            return;
         }
+        
+        if (res == 0) {
+            /* The client may have sent its last requests and shut down its side of the connection.  Stop reading, but
+             * keep the connection until all the responses are sent. */
+            client->eof = true;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        comm_close_client(client);
+        return;
     }
     
-    return 1;
+    if (!comm_flush(client) || comm_client_done(client))
+        comm_close_client(client);
 }
 
-static void comm_got_data() {
-    packet_header_t head;
+/* Event loop callback of the listening sockets.  Accept all pending connections. */
+static void comm_server_io(int fd, uint32_t events, void * data) {
+    comm_listener_t * listener = data;
+    UNUSED(events);
+    assert(listener->fd == fd);
     
     while (1) {
-    
-        switch (comm_read_raw(&head, sizeof(packet_header_t), false)) {
-            case 1:
-                /* Success, read payload. */
-                {
-                    packet_t * request = packet_create(&head);
-                    const packet_t * response;
-                    if (comm_read_raw(request->payload, head.length, true)) {
-                        response = handle_packet(request);
-                        if (response) {
-                            debug("Sending response packet (%u bytes).", (unsigned int) response->head.length);
-                            comm_send(&response->head, sizeof(packet_header_t));
-                            comm_send(response->payload, response->head.length);
-                        }
-                    } else {
-                        /* Error, disconnect. */
-                        comm_close_connection();
-                        comm_init_server(9999);
-                        return;
-                    }
-                    packet_free(request);
-                }
-                return;
-            case 0:
-                /* Error, disconnect. */
-                comm_close_connection();
-                comm_init_server(9999);
-                return;
-            case -1:
-                /* Timeout, no more data. */
-                return;
+        int sock = accept(fd, NULL, NULL);
+        
+        if (sock < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                error("Connection failed: %s", strerror(errno));
+            return;
         }
+        
+        if (!comm_set_nonblocking(sock)) {
+            close_socket(sock);
+            continue;
+        }
+        
+        comm_client_t * client = adbi_malloc(sizeof(comm_client_t));
+        memset(client, 0, sizeof(comm_client_t));
+        client->fd = sock;
+        client->local = (listener->family == AF_UNIX);
+        
+        if (!eventloop_add(sock, EPOLLIN, comm_client_io, client)) {
+            close_socket(sock);
+            free(client);
+            continue;
+        }
+        
+        tree_insert(&comm_clients, sock, client);
+        info("Accepted %s client connection %d.", client->local ? "local" : "TCP", sock);
+    }
+}
+
+/* Start listening on a bound server socket and register it in the event loop.  Incoming connections are accepted by
+ * comm_server_io.  Return success flag. */
+static bool comm_listen(comm_listener_t * listener) {
+    if (!comm_set_nonblocking(listener->fd))
+        return false;
+        
+    if (listen(listener->fd, SOMAXCONN) < 0) {
+        error("Error listening on socket: %s.", strerror(errno));
+        return false;
+    }
+    
+    return eventloop_add(listener->fd, EPOLLIN, comm_server_io, listener);
+}
+
+/* Open TCP server socket on given port and start listening.  Return success flag. */
+static bool comm_init_tcp(int port) {
+
+    struct sockaddr_in address;
+    comm_listener_t * listener = &comm_listener_tcp;
+    
+    assert(listener->fd == -1);
+    
+    listener->fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    
+    if (listener->fd < 0) {
+        error("Error creating TCP socket.");
+        goto fail;
+    }
+    
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+    
+    if (!comm_setsockopt(listener->fd, SO_REUSEADDR, 1))
+        warning("Can not set SO_REUSEADDR option of listening socket. You may have trouble creating sockets at this "
+                "address after adbiserver exits.");
+                
+    if (bind(listener->fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        error("Error binding TCP socket to port %i.", port);
+        goto fail;
     }
+    
+    if (!comm_listen(listener))
+        goto fail;
+        
+    info("Listening on port %d.", port);
+    
+    return true;
+    
+fail:
+    if (listener->fd >= 0)
+        close(listener->fd);
+    listener->fd = -1;
+    return false;
 }
 
-/* This function is called when we receive a SIGIO. */
-void comm_handle_io() {
-    if (comm_connection_sock >= 0) {
-        /* Nobody is connected, maybe there's an incoming connection. */
-        comm_got_data();
-    } else if (comm_server_sock >= 0) {
-        /* We have a connection */
-        comm_answer();
+/* Open unix domain server socket in the abstract namespace (the name is not visible in the file system) and start
+ * listening.  Return success flag. */
+static bool comm_init_unix(const char * name) {
+
+    struct sockaddr_un address;
+    comm_listener_t * listener = &comm_listener_unix;
+    size_t length = strlen(name);
+    
+    assert(listener->fd == -1);
+    
+    if (length + 1 > sizeof(address.sun_path)) {
+        error("Unix socket name too long: %s.", name);
+        return false;
     }
+    
+    listener->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (listener->fd < 0) {
+        error("Error creating unix socket.");
+        goto fail;
+    }
+    
+    /* Abstract socket addresses start with a null byte and are not null terminated. */
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path + 1, name, length);
+    
+    if (bind(listener->fd, (struct sockaddr *) &address, offsetof(struct sockaddr_un, sun_path) + 1 + length) < 0) {
+        error("Error binding unix socket to @%s: %s.", name, strerror(errno));
+        goto fail;
+    }
+    
+    if (!comm_listen(listener))
+        goto fail;
+        
+    info("Listening on unix socket @%s.", name);
+    
+    return true;
+    
+fail:
+    if (listener->fd >= 0)
+        close(listener->fd);
+    listener->fd = -1;
+    return false;
 }
 
 /* Communication clean-up function. */
 void comm_cleanup() {
-    comm_close_connection();
-    comm_close_server();
+    while (!tree_empty(&comm_clients))
+        comm_close_client(tree_get_any_val(&comm_clients));
+    comm_close_server(&comm_listener_tcp);
+    comm_close_server(&comm_listener_unix);
 }
 
-/* Communication initialization function. */
-bool comm_init() {
-    if (comm_init_server(9999))
-        return 1;
-    else {
-        fatal("Error initializing communication.");
-        return 0;
+/* Communication initialization function.  Listen on the given TCP port (unless it's zero) and on the given abstract
+ * unix socket (unless it's NULL or empty). */
+bool comm_init(int port, const char * unix_name) {
+    bool ok = true;
+    
+    if (port)
+        ok = comm_init_tcp(port);
+        
+    if (ok && unix_name && *unix_name)
+        ok = comm_init_unix(unix_name);
+        
+    if (ok && (comm_listener_tcp.fd < 0) && (comm_listener_unix.fd < 0)) {
+        error("No control socket configured.");
+        ok = false;
     }
+    
+    if (!ok)
+        fatal("Error initializing communication.");
+        
+    return ok;
 }
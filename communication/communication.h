@@ -1,9 +1,29 @@
 #ifndef ASYNCIO_H
 #define ASYNCIO_H
 
-bool comm_init(void);
+#include "protocol.h"
+
+typedef struct comm_client_t comm_client_t;
+
+/* Stream producer callback.  Streams allow sending responses, which are too large to construct at once.  The producer
+ * is called each time the client's output buffer runs low and should queue the next packet using comm_queue.  It
+ * returns false after queueing the last packet of the stream. */
+typedef bool (*comm_producer_t)(comm_client_t * client, void * data);
+
+/* Default control socket addresses. */
+#define COMM_PORT 9999
+#define COMM_UNIX_NAME "adbi"
+
+bool comm_init(int port, const char * unix_name);
 void comm_cleanup(void);
 
-void comm_handle_io(void);
+void comm_queue(comm_client_t * client, const packet_t * packet);
+void comm_queue_fd(comm_client_t * client, const packet_t * packet, int fd);
+bool comm_client_local(const comm_client_t * client);
+bool comm_client_busy(const comm_client_t * client);
+
+void comm_post(comm_client_t * client, const packet_t * packet);
+
+bool comm_stream_start(comm_client_t * client, comm_producer_t producer, void (*release)(void *), void * data);
 
 #endif
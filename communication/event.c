@@ -0,0 +1,262 @@
+#include <string.h>
+
+#include "tree.h"
+
+#include "communication.h"
+#include "payload.h"
+#include "protocol.h"
+#include "event.h"
+
+/* Asynchronous events.
+ *
+ * Clients subscribe to events using the SUBS request.  Events are not sent immediately when they occur.  They are
+ * collected for each subscriber and sent as a single EVNT packet by event_flush, which is called once per iteration of
+ * the main loop.  The EVNT packet carries the sequence number of the SUBS request and contains the events as a set of
+ * parallel arrays (event, pid, tid, arg and info).
+ *
+ * If a subscriber doesn't read its data fast enough, its events are held back and collected until the connection
+ * drains.  Consecutive segment events of the same file are merged into one.  If too many events are pending, new
+ * events are dropped and only counted.  The number of dropped events is reported in the lost field of the next EVNT
+ * packet. */
+
+/* Maximum number of events pending for a single subscriber. */
+#define EVENT_PENDING_MAX 4096
+
+/* Packet type of event packets. */
+#define EVENT_PACKET_TYPE packet_id("EVNT")
+
+typedef struct event_t {
+    unsigned int type;
+    pid_t pid;
+    pid_t tid;
+    uint64_t arg;
+    char * info;
+} event_t;
+
+typedef struct event_subscriber_t {
+    comm_client_t * client;
+    uint32_t seq;           /* sequence number of the SUBS request */
+    uint32_t mask;          /* subscribed event types */
+    
+    event_t * pending;
+    size_t count;
+    size_t capacity;
+    
+    uint32_t lost;          /* number of events dropped since the last EVNT packet */
+} event_subscriber_t;
+
+/* Subscribers indexed by client pointer. */
+static tree_t event_subscribers = NULL;
+
+/* Union of the masks of all subscribers. */
+static uint32_t event_mask = 0;
+
+static payload_buffer_t * event_payload = NULL;
+
+static const char * event_name(unsigned int type) {
+    switch (type) {
+        case EVENT_PROCESS:
+            return "process";
+        case EVENT_THREAD:
+            return "thread";
+        case EVENT_EXIT:
+            return "exit";
+        case EVENT_THREAD_EXIT:
+            return "thread-exit";
+        case EVENT_EXEC:
+            return "exec";
+        case EVENT_SEGMENT:
+            return "segment";
+        case EVENT_TRACEPOINT_ERROR:
+            return "tracepoint-error";
+        default:
+            adbi_bug_unrechable();
+    }
+}
+
+static void event_update_mask() {
+    event_mask = 0;
+    TREE_ITER(&event_subscribers, node) {
+        event_subscriber_t * subscriber = node->val;
+        event_mask |= subscriber->mask;
+    }
+}
+
+static void event_discard_pending(event_subscriber_t * subscriber) {
+    for (size_t i = 0; i < subscriber->count; ++i)
+        free(subscriber->pending[i].info);
+    subscriber->count = 0;
+}
+
+/* Return true if the event can be merged with the last pending event. */
+static bool event_mergeable(const event_subscriber_t * subscriber, const event_t * event) {
+    const event_t * last;
+    
+    if (!subscriber->count || (event->type != EVENT_SEGMENT))
+        return false;
+        
+    last = &subscriber->pending[subscriber->count - 1];
+    
+    return (last->type == EVENT_SEGMENT) && (last->pid == event->pid) && last->info && event->info &&
+           (strcmp(last->info, event->info) == 0);
+}
+
+static void event_append(event_subscriber_t * subscriber, const event_t * event) {
+    if (event_mergeable(subscriber, event))
+        return;
+        
+    if (subscriber->count == EVENT_PENDING_MAX) {
+        ++subscriber->lost;
+        return;
+    }
+    
+    if (subscriber->count == subscriber->capacity) {
+        subscriber->capacity = subscriber->capacity ? subscriber->capacity * 2 : 16;
+        subscriber->pending = adbi_realloc(subscriber->pending, subscriber->capacity * sizeof(event_t));
+    }
+    
+    subscriber->pending[subscriber->count] = *event;
+    subscriber->pending[subscriber->count].info = event->info ? strdup(event->info) : NULL;
+    ++subscriber->count;
+}
+
+/* Return true if any client is subscribed to events of the given type.  Can be used to avoid collecting event
+ * information, which nobody is interested in. */
+bool event_wanted(unsigned int type) {
+    return event_mask & type;
+}
+
+/* Report an event to all subscribers.  The arg and info fields have event specific meaning:
+ *   process            arg is the parent process pid
+ *   segment            arg is the start address of the segment, info is the file name
+ *   exec               info is the executable path
+ *   tracepoint-error   arg is the tracepoint address, info describes the error */
+void event_post(unsigned int type, pid_t pid, pid_t tid, uint64_t arg, const char * info) {
+    event_t event;
+    
+    if (likely(!(event_mask & type)))
+        return;
+        
+    event.type = type;
+    event.pid = pid;
+    event.tid = tid;
+    event.arg = arg;
+    event.info = (char *) info;
+    
+    TREE_ITER(&event_subscribers, node) {
+        event_subscriber_t * subscriber = node->val;
+        if (subscriber->mask & type)
+            event_append(subscriber, &event);
+    }
+}
+
+/* Send the pending events of the subscriber in a single EVNT packet. */
+static void event_send(event_subscriber_t * subscriber) {
+    size_t count = subscriber->count;
+    /* There can be up to EVENT_PENDING_MAX events, which is too much for the stack. */
+    const char ** names = adbi_malloc((count + 1) * sizeof(const char *));
+    const char ** infos = adbi_malloc((count + 1) * sizeof(const char *));
+    uint32_t * pids = adbi_malloc((count + 1) * sizeof(uint32_t));
+    uint32_t * tids = adbi_malloc((count + 1) * sizeof(uint32_t));
+    uint64_t * args = adbi_malloc((count + 1) * sizeof(uint64_t));
+    packet_t packet;
+    
+    for (size_t i = 0; i < count; ++i) {
+        const event_t * event = &subscriber->pending[i];
+        names[i] = event_name(event->type);
+        infos[i] = event->info ? event->info : "";
+        pids[i] = event->pid;
+        tids[i] = event->tid;
+        args[i] = event->arg;
+    }
+    
+    payload_reset(event_payload);
+    payload_put_str_array(event_payload, "event", names, count);
+    payload_put_u32_array(event_payload, "pid", pids, count);
+    payload_put_u32_array(event_payload, "tid", tids, count);
+    payload_put_u64_array(event_payload, "arg", args, count);
+    payload_put_str_array(event_payload, "info", infos, count);
+    if (subscriber->lost)
+        payload_put_u32(event_payload, "lost", subscriber->lost);
+    payload_put_term(event_payload);
+    
+    free(names);
+    free(infos);
+    free(pids);
+    free(tids);
+    free(args);
+    
+    packet.head.type = EVENT_PACKET_TYPE;
+    packet.head.seq = subscriber->seq;
+    packet.head.length = event_payload->size;
+    packet.payload = event_payload->buf;
+    packet.client = subscriber->client;
+    
+    comm_post(subscriber->client, &packet);
+    
+    if (subscriber->lost)
+        warning("Dropped %u events of a slow subscriber.", subscriber->lost);
+        
+    event_discard_pending(subscriber);
+    subscriber->lost = 0;
+}
+
+/* Send pending events to all subscribers, which are not busy. */
+void event_flush() {
+    TREE_ITER(&event_subscribers, node) {
+        event_subscriber_t * subscriber = node->val;
+        if ((subscriber->count || subscriber->lost) && !comm_client_busy(subscriber->client))
+            event_send(subscriber);
+    }
+}
+
+/* Subscribe the client to the events given by mask.  Further events are sent with the given sequence number.  An
+ * existing subscription of the client is replaced (pending events are kept).  Zero mask cancels the subscription. */
+void event_subscribe(comm_client_t * client, uint32_t seq, uint32_t mask) {
+    event_subscriber_t * subscriber = tree_get(&event_subscribers, (tree_key_t) client);
+    
+    if (!mask) {
+        event_unsubscribe(client);
+        return;
+    }
+    
+    if (!subscriber) {
+        subscriber = adbi_malloc(sizeof(event_subscriber_t));
+        memset(subscriber, 0, sizeof(event_subscriber_t));
+        subscriber->client = client;
+        tree_insert(&event_subscribers, (tree_key_t) client, subscriber);
+    }
+    
+    if (!event_payload)
+        event_payload = payload_create();
+        
+    subscriber->seq = seq;
+    subscriber->mask = mask & EVENT_ALL;
+    event_update_mask();
+}
+
+/* Cancel the subscription of the client (if any).  Pending events are discarded. */
+void event_unsubscribe(comm_client_t * client) {
+    event_subscriber_t * subscriber = tree_get(&event_subscribers, (tree_key_t) client);
+    
+    if (!subscriber)
+        return;
+        
+    tree_remove(&event_subscribers, (tree_key_t) client);
+    event_discard_pending(subscriber);
+    free(subscriber->pending);
+    free(subscriber);
+    event_update_mask();
+}
+
+void event_cleanup() {
+    while (!tree_empty(&event_subscribers)) {
+        event_subscriber_t * subscriber = tree_get_any_val(&event_subscribers);
+        event_unsubscribe(subscriber->client);
+    }
+    
+    if (event_payload) {
+        payload_free(event_payload);
+        event_payload = NULL;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <sys/types.h>
+
+/* Event types.  They are also used as bits of the subscription mask. */
+#define EVENT_PROCESS           0x01    /* new process was created (fork) */
+#define EVENT_THREAD            0x02    /* new thread was created (clone) */
+#define EVENT_EXIT              0x04    /* last thread of a process exited */
+#define EVENT_THREAD_EXIT       0x08    /* thread exited */
+#define EVENT_EXEC              0x10    /* process executed a new program */
+#define EVENT_SEGMENT           0x20    /* new file was mapped (e.g. library loaded) */
+#define EVENT_TRACEPOINT_ERROR  0x40    /* tracepoint could not be installed */
+
+#define EVENT_ALL               0x7f
+
+struct comm_client_t;
+
+bool event_wanted(unsigned int type);
+void event_post(unsigned int type, pid_t pid, pid_t tid, uint64_t arg, const char * info);
+
+void event_subscribe(struct comm_client_t * client, uint32_t seq, uint32_t mask);
+void event_unsubscribe(struct comm_client_t * client);
+
+void event_flush(void);
+void event_cleanup(void);
+
+#endif
@@ -10,6 +10,10 @@ enum payload_type {
     PAYLOAD_TYPE_U64 = 0x20,
     PAYLOAD_TYPE_I64 = 0x21,
     PAYLOAD_TYPE_STR = 0x80,
+    PAYLOAD_TYPE_BLOB = 0x81,
+    PAYLOAD_TYPE_STR_ARRAY = 0x82,
+    PAYLOAD_TYPE_U32_ARRAY = 0x90,
+    PAYLOAD_TYPE_U64_ARRAY = 0xa0,
 };
 
 typedef packed_struct payload_element_info_t {
@@ -27,12 +31,22 @@ payload_buffer_t * payload_create() {
     payload_buffer_t * result = adbi_malloc(sizeof(payload_buffer_t));
     result->allocated = 64;
     result->size = 0;
+    result->last = 0;
     result->buf = adbi_malloc(result->allocated);
     return result;
 }
 
 void payload_reset(payload_buffer_t * pb) {
     pb->size = 0;
+    pb->last = 0;
+}
+
+char * payload_detach(payload_buffer_t * pb) {
+    char * result = pb->buf;
+    pb->allocated = 64;
+    pb->buf = adbi_malloc(pb->allocated);
+    payload_reset(pb);
+    return result;
 }
 
 void payload_free(payload_buffer_t * pb) {
@@ -45,10 +59,9 @@ void payload_free(payload_buffer_t * pb) {
  * Payload construction
  **********************************************************************************************************************/
 
-static void payload_append_bytes(payload_buffer_t * pb,
-                                 const void * data,
-                                 size_t count) {
-                                 
+/* Make sure count more bytes fit into the buffer. */
+static void payload_reserve_bytes(payload_buffer_t * pb, size_t count) {
+
     size_t allocate = pb->allocated;
     
     while (count + pb->size > allocate) {
@@ -60,28 +73,45 @@ static void payload_append_bytes(payload_buffer_t * pb,
         pb->buf = adbi_realloc(pb->buf, allocate);
         pb->allocated = allocate;
     }
-    
+}
+
+static void payload_append_bytes(payload_buffer_t * pb,
+                                 const void * data,
+                                 size_t count) {
+                                 
+    payload_reserve_bytes(pb, count);
     memcpy(pb->buf + pb->size, data, count);
     pb->size += count;
     
 }
 
-static void payload_add_element(payload_buffer_t * pb,
-                                enum payload_type type,
-                                const char * name,
-                                const void * data,
-                                size_t count) {
-                                
+/* Append the header and the name of an element.  The caller must append exactly data_size bytes of data. */
+static void payload_add_element_head(payload_buffer_t * pb,
+                                     enum payload_type type,
+                                     const char * name,
+                                     size_t data_size) {
+                                     
     payload_element_info_t info;
     
     info.type = (uint8_t) type;
     info.reserved = 0;
     info.name_size = strlen(name) + 1; /* We store the terminator too. */
-    info.data_size = count;
+    info.data_size = data_size;
     
+    pb->last = pb->size;
+    payload_reserve_bytes(pb, sizeof(payload_element_info_t) + info.name_size + data_size);
     payload_append_bytes(pb, &info, sizeof(payload_element_info_t));
     payload_append_bytes(pb, name, info.name_size);
-    payload_append_bytes(pb, data, info.data_size);
+}
+
+static void payload_add_element(payload_buffer_t * pb,
+                                enum payload_type type,
+                                const char * name,
+                                const void * data,
+                                size_t count) {
+                                
+    payload_add_element_head(pb, type, name, count);
+    payload_append_bytes(pb, data, count);
 }
 
 #define payload_put(type, type_enum, postfix)                                           \
@@ -102,6 +132,49 @@ void payload_put_str(payload_buffer_t * pb, const char * name, const char * val)
                         val ? strlen(val) + 1 : 1);
 }
 
+void payload_put_blob(payload_buffer_t * pb, const char * name, const void * data, size_t size) {
+    payload_add_element(pb, PAYLOAD_TYPE_BLOB, name, data, size);
+}
+
+void * payload_put_blob_uninit(payload_buffer_t * pb, const char * name, size_t size) {
+    payload_add_element_head(pb, PAYLOAD_TYPE_BLOB, name, size);
+    pb->size += size;
+    return pb->buf + pb->size - size;
+}
+
+void payload_shrink_last(payload_buffer_t * pb, size_t size) {
+    payload_element_info_t * info = (payload_element_info_t *) (pb->buf + pb->last);
+    
+    assert(pb->size > pb->last);
+    assert(info->type != PAYLOAD_TYPE_TERMINATOR);
+    assert(size <= info->data_size);
+    
+    pb->size -= info->data_size - size;
+    info->data_size = size;
+}
+
+#define payload_put_array(type, type_enum, postfix)                                                                 \
+    void payload_put_ ## postfix ## _array(payload_buffer_t * pb, const char * name, const type * vals, size_t count) { \
+        payload_add_element(pb, (type_enum), name, vals, count * sizeof(type));                                     \
+    }
+
+payload_put_array(uint64_t, PAYLOAD_TYPE_U64_ARRAY, u64)
+payload_put_array(uint32_t, PAYLOAD_TYPE_U32_ARRAY, u32)
+
+void payload_put_str_array(payload_buffer_t * pb, const char * name, const char * const * vals, size_t count) {
+    size_t size = 0;
+    
+    for (size_t i = 0; i < count; ++i)
+        size += (vals[i] ? strlen(vals[i]) : 0) + 1;
+        
+    payload_add_element_head(pb, PAYLOAD_TYPE_STR_ARRAY, name, size);
+    
+    for (size_t i = 0; i < count; ++i) {
+        const char * val = vals[i] ? vals[i] : "";
+        payload_append_bytes(pb, val, strlen(val) + 1);
+    }
+}
+
 void payload_put_term(payload_buffer_t * pb) {
     payload_add_element(pb, PAYLOAD_TYPE_TERMINATOR, "", NULL, 0);
 }
@@ -138,6 +211,91 @@ static const payload_element_info_t * payload_element_get_next(const payload_ele
 }
 
 
+/**********************************************************************************************************************
+ * Field index
+ **********************************************************************************************************************/
+
+/* The index is an open addressing hash table of pointers to the entries of a payload, keyed by entry name. */
+struct payload_index_t {
+    const payload_element_info_t ** slots;
+    size_t capacity;    /* Number of slots, always a power of two */
+};
+
+/* FNV-1a hash of a null-terminated string. */
+static uint32_t payload_hash(const char * name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+payload_index_t * payload_index_create() {
+    payload_index_t * index = adbi_malloc(sizeof(payload_index_t));
+    index->capacity = 64;
+    index->slots = adbi_malloc(index->capacity * sizeof(*index->slots));
+    memset(index->slots, 0, index->capacity * sizeof(*index->slots));
+    return index;
+}
+
+void payload_index_free(payload_index_t * index) {
+    free(index->slots);
+    free(index);
+}
+
+/* Insert an element into the index.  If there already is an element with the same name, the index is not modified,
+ * so that the first entry wins (just like in case of a linear search). */
+static void payload_index_insert(payload_index_t * index, const payload_element_info_t * element) {
+    const char * name = payload_element_get_name(element);
+    size_t mask = index->capacity - 1;
+    size_t i = payload_hash(name) & mask;
+    
+    while (index->slots[i]) {
+        if (strcmp(payload_element_get_name(index->slots[i]), name) == 0)
+            return;
+        i = (i + 1) & mask;
+    }
+    
+    index->slots[i] = element;
+}
+
+/* Rebuild the index for the given (correct) payload containing count entries. */
+static void payload_index_build(payload_index_t * index, const char * buf, size_t count) {
+    const payload_element_info_t * element = (const payload_element_info_t *) buf;
+    size_t capacity = 64;
+    
+    /* Keep the load factor below 0.5. */
+    while (capacity < 2 * count)
+        capacity *= 2;
+        
+    if (capacity > index->capacity) {
+        free(index->slots);
+        index->slots = adbi_malloc(capacity * sizeof(*index->slots));
+        index->capacity = capacity;
+    }
+    
+    memset(index->slots, 0, index->capacity * sizeof(*index->slots));
+    
+    while (element->type != PAYLOAD_TYPE_TERMINATOR) {
+        payload_index_insert(index, element);
+        element = payload_element_get_next(element);
+    }
+}
+
+static const payload_element_info_t * payload_index_find(const payload_index_t * index, const char * name) {
+    size_t mask = index->capacity - 1;
+    size_t i = payload_hash(name) & mask;
+    
+    while (index->slots[i]) {
+        if (strcmp(payload_element_get_name(index->slots[i]), name) == 0)
+            return index->slots[i];
+        i = (i + 1) & mask;
+    }
+    
+    return NULL;
+}
+
 /***********************************************************************************************************************
  * Checking payload correctness
  **********************************************************************************************************************/
@@ -186,17 +344,30 @@ static bool payload_check_element(const payload_element_info_t * element, size_t
         case PAYLOAD_TYPE_U64:
             return element->data_size == sizeof(uint64_t);
         case PAYLOAD_TYPE_STR:
-            return ((const char *) payload_element_get_data(element))[element->data_size - 1] == 0;
+            return (element->data_size > 0) &&
+                   ((const char *) payload_element_get_data(element))[element->data_size - 1] == 0;
+        case PAYLOAD_TYPE_BLOB:
+            return true;
+        case PAYLOAD_TYPE_STR_ARRAY:
+            return (element->data_size == 0) ||
+                   ((const char *) payload_element_get_data(element))[element->data_size - 1] == 0;
+        case PAYLOAD_TYPE_U32_ARRAY:
+            return element->data_size % sizeof(uint32_t) == 0;
+        case PAYLOAD_TYPE_U64_ARRAY:
+            return element->data_size % sizeof(uint64_t) == 0;
         default:
             return false;
     }
     
 }
 
-/* Check if the size bytes at buf represent a correct payload buffer. */
-bool payload_check(const char * buf, size_t size) {
+/* Check if the size bytes at buf represent a correct payload buffer.  On success, store the number of entries (not
+ * including the terminator) in count. */
+static bool payload_check_count(const char * buf, size_t size, size_t * count) {
     const payload_element_info_t * element = (const payload_element_info_t *) buf;
     
+    *count = 0;
+    
     while (1) {
         if (!payload_check_element(element, size))
             return false;
@@ -209,6 +380,7 @@ bool payload_check(const char * buf, size_t size) {
             return (size == 0);
         }
         
+        ++*count;
         element = payload_element_get_next(element);
     }
     
@@ -216,6 +388,23 @@ bool payload_check(const char * buf, size_t size) {
     return false;
 }
 
+/* Check if the size bytes at buf represent a correct payload buffer. */
+bool payload_check(const char * buf, size_t size) {
+    size_t count;
+    return payload_check_count(buf, size, &count);
+}
+
+/* Check if the size bytes at buf represent a correct payload buffer and build the index of its entries. */
+bool payload_check_indexed(const char * buf, size_t size, payload_index_t * index) {
+    size_t count;
+    
+    if (!payload_check_count(buf, size, &count))
+        return false;
+        
+    payload_index_build(index, buf, count);
+    return true;
+}
+
 
 /**********************************************************************************************************************
  * Reading fields
@@ -237,12 +426,10 @@ static const payload_element_info_t * payload_find(const void * buf, const char
     return NULL;
 }
 
-static const payload_element_info_t * payload_find_typed(const void * buf, const char * name,
+static const payload_element_info_t * payload_check_type(const payload_element_info_t * element,
         enum payload_type type) {
         
-    const payload_element_info_t * element;
-    
-    if (!(element = payload_find(buf, name)))
+    if (!element)
         return NULL;
         
     if (payload_element_get_type(element) != type)
@@ -251,15 +438,32 @@ static const payload_element_info_t * payload_find_typed(const void * buf, const
     return element;
 }
 
+static const payload_element_info_t * payload_find_typed(const void * buf, const char * name,
+        enum payload_type type) {
+    return payload_check_type(payload_find(buf, name), type);
+}
+
+static const payload_element_info_t * payload_index_find_typed(const payload_index_t * index, const char * name,
+        enum payload_type type) {
+    return payload_check_type(payload_index_find(index, name), type);
+}
+
 /**********************************************************************************************************************/
 
-#define payload_get(type, type_enum, postfix)                                       \
-    const type * payload_get_ ## postfix(const void * buf, const char * name) {     \
-        const payload_element_info_t * element;                                     \
-        if (!(element = payload_find_typed(buf, name, (type_enum))))                \
-            return NULL;                                                            \
-        else                                                                        \
-            return (const type *) payload_element_get_data(element);                \
+#define payload_get(type, type_enum, postfix)                                                           \
+    const type * payload_get_ ## postfix(const void * buf, const char * name) {                         \
+        const payload_element_info_t * element;                                                         \
+        if (!(element = payload_find_typed(buf, name, (type_enum))))                                    \
+            return NULL;                                                                                \
+        else                                                                                            \
+            return (const type *) payload_element_get_data(element);                                    \
+    }                                                                                                   \
+    const type * payload_index_get_ ## postfix(const payload_index_t * index, const char * name) {      \
+        const payload_element_info_t * element;                                                         \
+        if (!(element = payload_index_find_typed(index, name, (type_enum))))                            \
+            return NULL;                                                                                \
+        else                                                                                            \
+            return (const type *) payload_element_get_data(element);                                    \
     }
 
 payload_get(uint64_t, PAYLOAD_TYPE_U64, u64)
@@ -267,3 +471,71 @@ payload_get(int64_t, PAYLOAD_TYPE_I64, i64)
 payload_get(uint32_t, PAYLOAD_TYPE_U32, u32)
 payload_get(int32_t, PAYLOAD_TYPE_I32, i32)
 payload_get(char, PAYLOAD_TYPE_STR, str)
+
+static const void * payload_element_get_blob(const payload_element_info_t * element, size_t * size) {
+    if (!element)
+        return NULL;
+    *size = element->data_size;
+    return payload_element_get_data(element);
+}
+
+const void * payload_get_blob(const void * buf, const char * name, size_t * size) {
+    return payload_element_get_blob(payload_find_typed(buf, name, PAYLOAD_TYPE_BLOB), size);
+}
+
+const void * payload_index_get_blob(const payload_index_t * index, const char * name, size_t * size) {
+    return payload_element_get_blob(payload_index_find_typed(index, name, PAYLOAD_TYPE_BLOB), size);
+}
+
+#define payload_get_array(type, type_enum, postfix)                                                         \
+    const type * payload_get_ ## postfix ## _array(const void * buf, const char * name, size_t * count) {   \
+        const payload_element_info_t * element;                                                             \
+        if (!(element = payload_find_typed(buf, name, (type_enum))))                                        \
+            return NULL;                                                                                    \
+        *count = element->data_size / sizeof(type);                                                         \
+        return (const type *) payload_element_get_data(element);                                            \
+    }                                                                                                       \
+    const type * payload_index_get_ ## postfix ## _array(const payload_index_t * index, const char * name,  \
+            size_t * count) {                                                                               \
+        const payload_element_info_t * element;                                                             \
+        if (!(element = payload_index_find_typed(index, name, (type_enum))))                                \
+            return NULL;                                                                                    \
+        *count = element->data_size / sizeof(type);                                                         \
+        return (const type *) payload_element_get_data(element);                                            \
+    }
+
+payload_get_array(uint64_t, PAYLOAD_TYPE_U64_ARRAY, u64)
+payload_get_array(uint32_t, PAYLOAD_TYPE_U32_ARRAY, u32)
+
+#define payload_array_at(type, postfix)                                 \
+    type payload_ ## postfix ## _at(const type * array, size_t index) { \
+        type value;                                                     \
+        const char * where = (const char *) array;                      \
+        memcpy(&value, where + index * sizeof(type), sizeof(type));     \
+        return value;                                                   \
+    }
+
+payload_array_at(uint64_t, u64)
+payload_array_at(uint32_t, u32)
+
+static const char * payload_element_get_str_array(const payload_element_info_t * element, size_t * count) {
+    const char * data;
+    
+    if (!element)
+        return NULL;
+        
+    data = payload_element_get_data(element);
+    *count = 0;
+    for (size_t i = 0; i < element->data_size; ++i)
+        if (!data[i])
+            ++*count;
+    return data;
+}
+
+const char * payload_get_str_array(const void * buf, const char * name, size_t * count) {
+    return payload_element_get_str_array(payload_find_typed(buf, name, PAYLOAD_TYPE_STR_ARRAY), count);
+}
+
+const char * payload_index_get_str_array(const payload_index_t * index, const char * name, size_t * count) {
+    return payload_element_get_str_array(payload_index_find_typed(index, name, PAYLOAD_TYPE_STR_ARRAY), count);
+}
@@ -19,7 +19,14 @@
  * Currently, the following types of values can be stored in a payload:
  *      * unsigned 32-bit integers (u32);
  *      * signed 32-bit integers (i32);
+ *      * unsigned and signed 64-bit integers (u64, i64);
  *      * strings (length limited to about 4G) (str);
+ *      * binary blobs of arbitrary data (blob);
+ *      * arrays of unsigned 32-bit and 64-bit integers (u32_array, u64_array);
+ *      * arrays of strings, stored as consecutive null-terminated strings (str_array).
+ *
+ * Arrays allow sending lists of values in a single entry instead of a set of entries with indexed names (e.g. foo[0],
+ * foo[1], ...).  Lists of structures are sent as a set of parallel arrays (one array per structure field).
  *
  * Example of payload construction
  *      // Create the buffer
@@ -73,6 +80,7 @@ typedef struct payload_buffer_t {
     char * buf;         /* Pointer to the memory buffer */
     size_t allocated;   /* Amount of allocated memory */
     size_t size;        /* Amount of memory used */
+    size_t last;        /* Offset of the last entry */
 } payload_buffer_t;
 
 /* Create a new resizable buffer for use with payload_put_* functions. */
@@ -86,6 +94,11 @@ void payload_free(payload_buffer_t * pb);
  * during this call. */
 void payload_reset(payload_buffer_t * pb);
 
+/* Take over the memory buffer holding the payload.  The returned pointer must
+ * be freed by the caller.  The payload buffer structure gets a new, empty
+ * memory buffer and can be reused. */
+char * payload_detach(payload_buffer_t * pb);
+
 /* The payload_put_x functions all insert a single data value into the buffer.
  * The internal memory buffer in the pb structure is extended if necessary.
  *
@@ -100,11 +113,42 @@ void payload_put_i64(payload_buffer_t * pb, const char * name, int64_t val);
 void payload_put_u32(payload_buffer_t * pb, const char * name, uint32_t val);
 void payload_put_i32(payload_buffer_t * pb, const char * name, int32_t val);
 void payload_put_str(payload_buffer_t * pb, const char * name, const char * val);
+void payload_put_blob(payload_buffer_t * pb, const char * name, const void * data, size_t size);
+void payload_put_u64_array(payload_buffer_t * pb, const char * name, const uint64_t * vals, size_t count);
+void payload_put_u32_array(payload_buffer_t * pb, const char * name, const uint32_t * vals, size_t count);
+void payload_put_str_array(payload_buffer_t * pb, const char * name, const char * const * vals, size_t count);
 void payload_put_term(payload_buffer_t * pb);
 
+/* Insert a blob of the given size and return a pointer to its (uninitialized) data, so that the caller can fill it
+ * in place.  The pointer is valid only until the next payload_put_x call.  If less data is available than expected,
+ * the blob can be truncated using payload_shrink_last before adding more entries. */
+void * payload_put_blob_uninit(payload_buffer_t * pb, const char * name, size_t size);
+
+/* Reduce the data size of the last entry added to the buffer. */
+void payload_shrink_last(payload_buffer_t * pb, size_t size);
+
 /* Check if the size bytes at buf represents a correct payload buffer. */
 bool payload_check(const char * buf, size_t size);
 
+/* Payload field index
+ *
+ * The payload_get_x functions search the payload linearly, so reading many
+ * fields of a large payload is expensive. A payload index is a hash table of
+ * the payload entries, which allows finding an entry by name in constant time.
+ * The index is built by payload_check_indexed, which also checks the payload
+ * for correctness. The index can be reused for many payloads, it must be
+ * rebuilt each time the indexed buffer changes.
+ *
+ * The payload_index_get_x functions work exactly like their payload_get_x
+ * counterparts, but they use the index instead of the payload buffer.
+ */
+typedef struct payload_index_t payload_index_t;
+
+payload_index_t * payload_index_create();
+void payload_index_free(payload_index_t * index);
+
+bool payload_check_indexed(const char * buf, size_t size, payload_index_t * index);
+
 /* The payload_get_x functions read a single value of data from the buffer.
  *
  * The functions return a pointer which points to the memory address inside the
@@ -127,4 +171,28 @@ const uint32_t * payload_get_u32(const void * buf, const char * name);
 const int32_t * payload_get_i32(const void * buf, const char * name);
 const char * payload_get_str(const void * buf, const char * name);
 
+/* The functions below work like the payload_get_x functions, but they also
+ * return the size of the blob in bytes or the number of array elements. The
+ * strings of a str_array entry are stored one after another, the function
+ * returns a pointer to the first one. */
+const void * payload_get_blob(const void * buf, const char * name, size_t * size);
+const uint64_t * payload_get_u64_array(const void * buf, const char * name, size_t * count);
+const uint32_t * payload_get_u32_array(const void * buf, const char * name, size_t * count);
+const char * payload_get_str_array(const void * buf, const char * name, size_t * count);
+
+const uint64_t * payload_index_get_u64(const payload_index_t * index, const char * name);
+const int64_t * payload_index_get_i64(const payload_index_t * index, const char * name);
+const uint32_t * payload_index_get_u32(const payload_index_t * index, const char * name);
+const int32_t * payload_index_get_i32(const payload_index_t * index, const char * name);
+const char * payload_index_get_str(const payload_index_t * index, const char * name);
+const void * payload_index_get_blob(const payload_index_t * index, const char * name, size_t * size);
+const uint64_t * payload_index_get_u64_array(const payload_index_t * index, const char * name, size_t * count);
+const uint32_t * payload_index_get_u32_array(const payload_index_t * index, const char * name, size_t * count);
+const char * payload_index_get_str_array(const payload_index_t * index, const char * name, size_t * count);
+
+/* Return an element of an array returned by the functions above.  Entries are not aligned in the payload, so the
+ * elements must not be accessed directly. */
+uint64_t payload_u64_at(const uint64_t * array, size_t index);
+uint32_t payload_u32_at(const uint32_t * array, size_t index);
+
 #endif
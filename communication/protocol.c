@@ -1,11 +1,16 @@
 #include <ctype.h>
+#include <errno.h>
+#include <string.h>
 #include <stdarg.h>
 #include <byteswap.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "process/list.h"
 #include "process/process.h"
 #include "process/segment.h"
+#include "process/thread.h"
 
 #include "procutil/mem.h"
 
@@ -17,10 +22,15 @@
 
 #include "tracepoint/jump.h"
 #include "tracepoint/template.h"
+#include "tracepoint/tracepoint.h"
+#include "tracepoint/option.h"
+#include "tracepoint/slot.h"
 
 #include "util/signal.h"
+#include "util/shm.h"
 
 #include "communication.h"
+#include "event.h"
 #include "payload.h"
 #include "protocol.h"
 
@@ -30,10 +40,13 @@
  * file all share one buffer for response packet construction. */
 static payload_buffer_t * payload_buffer;
 
+/* Index of the fields of the request packet currently being handled. */
+static payload_index_t * request_index;
+
 /******************************************************************************/
 
 /* Converts a packet type string to a 4-byte ID. */
-static uint32_t packet_id(const char * type) {
+uint32_t packet_id(const char * type) {
     uint32_t result = 0;
     uint8_t * str = (uint8_t *) type;
     int i;
@@ -49,20 +62,6 @@ static uint32_t packet_id(const char * type) {
 
 /******************************************************************************/
 
-packet_t * packet_create(const packet_header_t * head) {
-    packet_t * packet = adbi_malloc(sizeof(packet_t));
-    memcpy(&packet->head, head, sizeof(packet_header_t));
-    packet->payload = adbi_malloc(head->length);
-    return packet;
-}
-
-void packet_free(packet_t * packet) {
-    free(packet->payload);
-    free(packet);
-}
-
-/******************************************************************************/
-
 /* Create a response packet to the given request. The returned packet's payload
  * is equal to the global packet_buffer value. The returned object is a static
  * local, so it does not require freeing. Before sending out the packet, the
@@ -114,14 +113,16 @@ static const packet_t * say(const packet_t * request, const char * type, const c
 /******************************************************************************/
 
 /* Reading fields */
-#define read_ptr(type, var, name)                               \
-    if (!(var = payload_get_ ## type (request->payload, name))) \
+#define read_ptr(type, var, name)                                   \
+    if (!(var = payload_index_get_ ## type (request_index, name)))  \
         say_MALF("Field missing: '%s'.", name);
 
-#define read_deref(ctype, type, var, name) {        \
-        const ctype * var ## _ptr;                  \
-        read_ptr(type, var ## _ptr, name);          \
-        var = * var ## _ptr;                        \
+#define read_deref(ctype, type, var, name) {              \
+        const ctype * var ## _ptr;                        \
+        ctype var ## _val;                                \
+        read_ptr(type, var ## _ptr, name);                \
+        memcpy(&var ## _val, var ## _ptr, sizeof(ctype)); \
+        var = var ## _val;                                \
     }
 
 #define read_u64x(var, name) read_deref(uint64_t, u64, var, name)
@@ -130,6 +131,22 @@ static const packet_t * say(const packet_t * request, const char * type, const c
 #define read_i32x(var, name) read_deref(uint32_t, u32, var, name)
 #define read_strx(var, name) read_ptr(str, var, name)
 
+/* Reading optional fields, has is set to true if the field is present (var is left unchanged otherwise) */
+#define read_opt_deref(ctype, type, var, has, name) {                                 \
+        const ctype * var ## _ptr = payload_index_get_ ## type (request_index, name); \
+        ctype var ## _val;                                                            \
+        if ((has = (var ## _ptr != NULL))) {                                          \
+            memcpy(&var ## _val, var ## _ptr, sizeof(ctype));                         \
+            var = var ## _val;                                                        \
+        }                                                                             \
+    }
+
+#define read_opt_u64x(var, has, name) read_opt_deref(uint64_t, u64, var, has, name)
+#define read_opt_u32x(var, has, name) read_opt_deref(uint32_t, u32, var, has, name)
+
+#define read_opt_u64(var, has) read_opt_deref(uint64_t, u64, var, has, # var)
+#define read_opt_u32(var, has) read_opt_deref(uint32_t, u32, var, has, # var)
+
 #define read_u64(var) read_deref(uint64_t, u64, var, # var)
 #define read_i64(var) read_deref(uint64_t, u64, var, # var)
 #define read_u32(var) read_deref(uint32_t, u32, var, # var)
@@ -396,6 +413,412 @@ static const packet_t * handle_INJA(const packet_t * request) {
     return handle_INJ_(request, injectable_iter_adbi);
 }
 
+/***********************************************************************************************************************
+ * Tracepoint control
+ **********************************************************************************************************************/
+
+/* Reinstall tracepoints of the injectable in all processes with tracing stopped. */
+static void reinstall_tracepoints(const injectable_t * injectable) {
+    bool tstate;
+    
+    if ((tstate = state_tracing()))
+        state_tracing_set(false);
+        
+    injectable_reinstall_tracepoints(injectable);
+    
+    if (tstate)
+        state_tracing_set(true);
+}
+
+/* Tracepoint options.  The options apply to the tracepoint of the injectable at the given file address or, if the
+ * address is missing, to all its tracepoints.  Only options present in the request are changed.  Changed tracepoints
+ * are reinstalled in all processes.
+ *
+ * Modes: 0 -- call the handler (default), 1 -- only count hits (see CNTR), 2 -- record the first hit (see COVR).
+ *
+ * The predicate is a condition evaluated by the trampoline before the handler is called (or the hit is counted), e.g.
+ * "x0 == 3 && [x1+8] != 0" (see tracepoint/predicate.c).  An empty predicate removes the condition.
+ *
+ * The sampling rate makes the trampoline handle (or count) only every rate-th hit, 1 disables sampling.  Once a
+ * tracepoint samples, its rate is changed in place, without reinstalling it or stopping the processes. */
+static const packet_t * handle_TPCF(const packet_t * request) {
+    uint32_t iid;
+    uint32_t address = 0;
+    uint32_t mode = 0;
+    uint32_t rate = 1;
+    bool has_address;
+    bool has_mode;
+    bool has_rate;
+    const char * text;
+    predicate_t * predicate = NULL;
+    const char * msg = NULL;
+    uint32_t tpc = 0;
+    bool changed = false;
+    bool rate_changed = false;
+    
+    read_u32(iid);
+    
+    read_opt_u32(address, has_address);
+    read_opt_u32(mode, has_mode);
+    text = payload_index_get_str(request_index, "predicate");
+    read_opt_u32(rate, has_rate);
+    
+    const injectable_t * injectable = injectable_get(iid);
+    if (!injectable)
+        say_FAIL("No such injectable: %u.", iid);
+        
+    if (has_mode && (mode >= TRACEPOINT_MODE_MAX))
+        say_MALF("Invalid tracepoint mode: %u.", mode);
+        
+    if (has_rate && !rate)
+        say_MALF("Invalid sampling rate: 0.");
+        
+    if (text && *text && !(predicate = predicate_parse(text, &msg)))
+        say_MALF("Invalid predicate: %s.", msg);
+        
+    void configure(address_t tpaddr, offset_t __attribute__((unused)) handler) {
+        if (has_address && (tpaddr != address))
+            return;
+            
+        tracepoint_options_t * options = tracepoint_options_edit(injectable, tpaddr);
+        if (has_mode && (options->mode != mode)) {
+            options->mode = mode;
+            changed = true;
+        }
+        if (text && (predicate || options->predicate)) {
+            tracepoint_options_set_predicate(options, predicate ? predicate_dup(predicate) : NULL);
+            changed = true;
+        }
+        if (has_rate && (options->rate != rate)) {
+            options->rate = rate;
+            rate_changed = true;
+        }
+        ++tpc;
+    }
+    
+    injectable_iter_tracepoints(injectable, configure);
+    
+    free(predicate);
+    
+    if (!tpc) {
+        if (has_address)
+            say_FAIL("Injectable %u defines no tracepoint at %#x.", iid, address);
+        else
+            say_FAIL("Injectable %u defines no tracepoints.", iid);
+    }
+    
+    if (rate_changed && !changed && !injectable_set_tracepoint_rate(injectable, has_address ? address : 0, rate)) {
+        /* Some tracepoints don't sample yet. */
+        changed = true;
+    }
+    
+    if (changed)
+        reinstall_tracepoints(injectable);
+    
+    write_u32(tpc);
+    say_OKAY("%u tracepoint%s configured.", tpc, tpc == 1 ? "" : "s");
+}
+
+/* Enable or disable tracepoints of the injectable at the given file addresses or, if the address array is missing, all
+ * its tracepoints.  Only the patched instructions are flipped, injections and trampolines stay in place. */
+static const packet_t * handle_TPE_(const packet_t * request, bool enabled) {
+    uint32_t iid;
+    const uint32_t * address;
+    size_t addrc = 0;
+    uint32_t tpc = 0;
+    bool changed = false;
+    bool tstate;
+    
+    bool selected(uint32_t tpaddr) {
+        if (!address)
+            return true;
+        for (size_t i = 0; i < addrc; ++i) {
+            if (payload_u32_at(address, i) == tpaddr)
+                return true;
+        }
+        return false;
+    }
+    
+    read_u32(iid);
+    address = payload_index_get_u32_array(request_index, "address", &addrc);
+    
+    const injectable_t * injectable = injectable_get(iid);
+    if (!injectable)
+        say_FAIL("No such injectable: %u.", iid);
+        
+    for (size_t i = 0; i < addrc; ++i) {
+        uint32_t tpaddr = payload_u32_at(address, i);
+        if (!injectable_has_tracepoint(injectable, tpaddr))
+            say_FAIL("Injectable %u defines no tracepoint at %#x.", iid, tpaddr);
+    }
+    
+    void toggle(address_t tpaddr, offset_t __attribute__((unused)) handler) {
+        if (!selected(tpaddr))
+            return;
+            
+        tracepoint_options_t * options = tracepoint_options_edit(injectable, tpaddr);
+        if (options->enabled != enabled) {
+            options->enabled = enabled;
+            changed = true;
+        }
+        ++tpc;
+    }
+    
+    injectable_iter_tracepoints(injectable, toggle);
+    
+    if (changed) {
+        bool ok;
+        
+        if ((tstate = state_tracing()))
+            state_tracing_set(false);
+            
+        ok = injectable_toggle_tracepoints(injectable);
+        
+        if (tstate)
+            state_tracing_set(true);
+            
+        if (!ok)
+            say_FAIL("Error %s tracepoints of injectable %u.", enabled ? "enabling" : "disabling", iid);
+    }
+    
+    write_u32(tpc);
+    say_OKAY("%u tracepoint%s %s.", tpc, tpc == 1 ? "" : "s", enabled ? "enabled" : "disabled");
+}
+
+/* Enable tracepoints. */
+static const packet_t * handle_TPEN(const packet_t * request) {
+    return handle_TPE_(request, true);
+}
+
+/* Disable tracepoints. */
+static const packet_t * handle_TPDI(const packet_t * request) {
+    return handle_TPE_(request, false);
+}
+
+/* Add a tracepoint at runtime.  The handler is a function exported by the injectable.  The tracepoint location is
+ * either a file address in the binary the injectable is bound to or a runtime address in the given process, which is
+ * translated to a file address.  The tracepoint is installed in all processes, which map the binary (the injectable
+ * is injected where necessary), and the file address is returned. */
+static const packet_t * handle_TPAD(const packet_t * request) {
+    uint32_t iid;
+    const char * handler;
+    uint32_t address = 0;
+    uint32_t pid = 0;
+    uint64_t rtaddr = 0;
+    bool has_address;
+    bool has_pid;
+    bool has_rtaddr;
+    address_t tpaddr = 0;
+    offset_t offset;
+    const char * msg = NULL;
+    bool tstate;
+    
+    read_u32(iid);
+    read_str(handler);
+    
+    read_opt_u32(address, has_address);
+    read_opt_u32(pid, has_pid);
+    read_opt_u64(rtaddr, has_rtaddr);
+    
+    const injectable_t * injectable = injectable_get(iid);
+    if (!injectable)
+        say_FAIL("No such injectable: %u.", iid);
+        
+    if (!(offset = injectable_get_exported_symbol(injectable, handler)))
+        say_FAIL("Injectable %u does not export %s.", iid, handler);
+        
+    if (has_address) {
+        tpaddr = address;
+    } else if (has_pid && has_rtaddr) {
+        process_t * process = process_get(pid);
+        if (!process)
+            say_FAIL("Not attached to %u.", (unsigned int) pid);
+            
+        /* The segment doesn't need to be injected yet, adding the tracepoint injects it. */
+        const segment_t * segment = segment_get(process, rtaddr);
+        if (segment && segment->filename && (injectable_get_binding(segment->filename) == injectable))
+            tpaddr = segment_addr2fo(segment, rtaddr);
+        process_put(process);
+        
+        if (!tpaddr)
+            say_FAIL("Address %p is not in a segment bound to injectable %u.", (void *) (address_t) rtaddr, iid);
+    } else {
+        say_MALF("Tracepoint address missing.");
+    }
+    
+    if (!injectable_add_tracepoint(injectable, tpaddr, offset, &msg))
+        say_FAIL("Error adding tracepoint at %#lx: %s.", tpaddr, msg);
+        
+    if ((tstate = state_tracing()))
+        state_tracing_set(false);
+        
+    /* Install the tracepoint in segments with the injectable and inject the injectable into segments, which had no
+     * tracepoints so far (e.g. if the injectable only defines handlers). */
+    injectable_reinstall_tracepoints(injectable);
+    injectable_attach(injectable);
+    
+    if (tstate)
+        state_tracing_set(true);
+    
+    write_u32x("address", tpaddr);
+    say_OKAY("Tracepoint added at %#lx.", tpaddr);
+}
+
+/* Remove a tracepoint added at runtime.  The tracepoint is uninstalled from all processes. */
+static const packet_t * handle_TPRM(const packet_t * request) {
+    uint32_t iid;
+    uint32_t address;
+    const char * msg = NULL;
+    
+    read_u32(iid);
+    read_u32(address);
+    
+    const injectable_t * injectable = injectable_get(iid);
+    if (!injectable)
+        say_FAIL("No such injectable: %u.", iid);
+        
+    if (!injectable_remove_tracepoint(injectable, address, &msg))
+        say_FAIL("Error removing tracepoint at %#x: %s.", address, msg);
+        
+    reinstall_tracepoints(injectable);
+    say_OKAY("Tracepoint at %#x removed.", address);
+}
+
+/* Iterate over tracepoints of the process in the given mode (count or cover).  The block holds count entries of the
+ * given size read from the slot area at base, i.e. hit counters or the coverage map.  The callback gets each tracepoint
+ * together with its entry.  Return false if the block is missing or doesn't contain the entry of some tracepoint. */
+static bool iter_slot_tracepoints(process_t * process, tracepoint_mode_t mode, const void * block, address_t base,
+                                  size_t count, size_t size, void (*callback)(const tracepoint_t *, const void *)) {
+    bool ret = true;
+    
+    void callback_segment(segment_t * segment) {
+        TREE_ITER(&segment->tracepoints, node) {
+            const tracepoint_t * tracepoint = node->val;
+            address_t address = (mode == TRACEPOINT_MODE_COUNT) ? tracepoint->slot : tracepoint->cover;
+            size_t index = (address - base) / size;
+            
+            if (tracepoint->mode != mode)
+                continue;
+                
+            if (!block || (index >= count)) {
+                ret = false;
+                continue;
+            }
+            
+            callback(tracepoint, (const char *) block + index * size);
+        }
+    }
+    
+    segment_iter(process, callback_segment);
+    return ret;
+}
+
+/* Tracepoint hit counters.  Counters of all counting tracepoints of the process are read at once, without stopping
+ * the process.  The tracepoint runtime addresses and their counters are reported as parallel arrays. */
+static const packet_t * handle_CNTR(const packet_t * request) {
+    uint32_t pid;
+    process_t * process;
+    tracepoint_slot_t * slots;
+    address_t base = 0;
+    size_t count = 0;
+    bool readable;
+    
+    uint32_t cntc = 0;
+    uint32_t allocated = 0;
+    uint64_t * addr = NULL;
+    uint64_t * hits = NULL;
+    
+    void callback(const tracepoint_t * tracepoint, const void * entry) {
+        const tracepoint_slot_t * slot = entry;
+        
+        if (cntc == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            addr = adbi_realloc(addr, allocated * sizeof(*addr));
+            hits = adbi_realloc(hits, allocated * sizeof(*hits));
+        }
+        
+        addr[cntc] = tracepoint->address;
+        hits[cntc] = slot->hits;
+        ++cntc;
+    }
+    
+    read_u32(pid);
+    if (!(process = process_get(pid)))
+        say_FAIL("Not attached to %u.", (unsigned int) pid);
+        
+    slots = slots_read(process, &base, &count);
+    readable = iter_slot_tracepoints(process, TRACEPOINT_MODE_COUNT, slots, base, count, sizeof(tracepoint_slot_t),
+                                     callback);
+    process_put(process);
+    free(slots);
+    
+    if (readable) {
+        payload_put_u64_array(payload_buffer, "cntad", addr, cntc);
+        payload_put_u64_array(payload_buffer, "cnthit", hits, cntc);
+        write_u32(cntc);
+    }
+    
+    free(addr);
+    free(hits);
+    
+    if (!readable)
+        say_FAIL("Error reading counters of process %u.", pid);
+        
+    say_OKAY("Process %u has %u counting tracepoint%s.", pid, cntc, cntc == 1 ? "" : "s");
+}
+
+/* Tracepoint coverage.  The coverage map of the process is read at once, without stopping the process.  The runtime
+ * addresses of coverage tracepoints which were hit are reported, along with the number of all coverage tracepoints. */
+static const packet_t * handle_COVR(const packet_t * request) {
+    uint32_t pid;
+    process_t * process;
+    uint8_t * map;
+    address_t base = 0;
+    size_t count = 0;
+    bool readable;
+    
+    uint32_t covc = 0;
+    uint32_t covt = 0;
+    uint32_t allocated = 0;
+    uint64_t * addr = NULL;
+    
+    void callback(const tracepoint_t * tracepoint, const void * entry) {
+        const uint8_t * hit = entry;
+        
+        ++covt;
+        if (!*hit)
+            return;
+            
+        if (covc == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            addr = adbi_realloc(addr, allocated * sizeof(*addr));
+        }
+        addr[covc++] = tracepoint->address;
+    }
+    
+    read_u32(pid);
+    if (!(process = process_get(pid)))
+        say_FAIL("Not attached to %u.", (unsigned int) pid);
+        
+    map = cover_read(process, &base, &count);
+    readable = iter_slot_tracepoints(process, TRACEPOINT_MODE_COVER, map, base, count, sizeof(uint8_t), callback);
+    process_put(process);
+    free(map);
+    
+    if (readable) {
+        payload_put_u64_array(payload_buffer, "covad", addr, covc);
+        write_u32(covc);
+        write_u32(covt);
+    }
+    
+    free(addr);
+    
+    if (!readable)
+        say_FAIL("Error reading coverage of process %u.", pid);
+        
+    say_OKAY("Process %u hit %u of %u coverage tracepoint%s.", pid, covc, covt, covt == 1 ? "" : "s");
+}
+
 /***********************************************************************************************************************
  * ADBI server control
  **********************************************************************************************************************/
@@ -424,6 +847,26 @@ static const packet_t * handle_STOP(const packet_t * request) {
     say_OKAY("All inferiors are now stopped.");
 }
 
+/* Stop-to-resume latency histogram (see wait_main).  If the optional reset field is non-zero, the histogram is cleared
+ * after replying. */
+static const packet_t * handle_LATS(const packet_t * request) {
+    uint32_t reset = 0;
+    bool has_reset;
+    uint64_t count = thread_latency.count;
+    
+    read_opt_u32(reset, has_reset);
+    
+    write_u64(count);
+    write_u64x("total", thread_latency.total);
+    write_u64x("max", thread_latency.max);
+    payload_put_u64_array(payload_buffer, "buckets", thread_latency.buckets, LATENCY_BUCKETS);
+    
+    if (has_reset && reset)
+        latency_reset(&thread_latency);
+        
+    say_OKAY("%llu stop%s measured.", (unsigned long long) count, count == 1 ? "" : "s");
+}
+
 /* Ping (succeeds always) */
 static const packet_t * handle_PING(const packet_t * request) {
     say_OKAY("Ping-pong.");
@@ -435,6 +878,26 @@ static const packet_t * handle_QUIT(const packet_t * request) {
     say_OKAY("ADBI Server quitting.");
 }
 
+/* Event subscription.  The mask field selects the event types (see event.h), zero cancels the subscription.  Events
+ * are sent as EVNT packets with the sequence number of this request. */
+static const packet_t * handle_SUBS(const packet_t * request) {
+    uint32_t mask;
+    
+    read_u32(mask);
+    
+    if (!request->client)
+        say_USUP("Subscriptions are not supported in this context.");
+        
+    event_subscribe(request->client, request->head.seq, mask);
+    
+    write_u32x("mask", mask & EVENT_ALL);
+    
+    if (mask)
+        say_OKAY("Subscribed to events %#x.", mask & EVENT_ALL);
+    else
+        say_OKAY("Unsubscribed from events.");
+}
+
 /* Directory listing. */
 static const packet_t * handle_LDIR(const packet_t * request) {
     const char * path;
@@ -496,22 +959,23 @@ static const packet_t * handle_MEMD(const packet_t * request) {
     uint64_t address;
     uint32_t size;
     process_t * process;
-    uint32_t * data;
+    void * data;
     bool is_running;
     
     read_u32(pid);
     read_u64(address);
     read_u32(size);
     
-    size &= ~(0x3);
     if (size > 1024 * 10)
         size = 1024 * 10;
         
     if (!(process = process_get(pid)))
         say_FAIL("Not attached to %u.", (unsigned int) pid);
         
-
-    data = adbi_malloc(size);
+    write_u64(address);
+    
+    /* Read directly into the response buffer. */
+    data = payload_put_blob_uninit(payload_buffer, "data", size);
 
     if ((is_running = process_is_running(process)))
         process_stop(process);
@@ -521,47 +985,260 @@ static const packet_t * handle_MEMD(const packet_t * request) {
     if (is_running)
         process_continue(process);
 
-    size &= ~(0x3);
-    size /= sizeof(size);
+    payload_shrink_last(payload_buffer, size);
     
-    for (typeof(size) i = 0; i < size; ++i) {
-        char name[16];
-        adbi_assure(snprintf(name, 16, "word[%u]", i) < 16);
-        write_u32x(name, data[i]);
-    }
-    
-    write_u64(address);
     write_u32(size);
     process_put(process);
-    free(data);
     say_OKAY("Dumped %u bytes.", size);
 }
 
-/* Process memory map. */
+/* Streaming memory dump.
+ *
+ * The MEMS request reads size bytes of process memory starting at address.  The memory is read in chunks, which are
+ * sent as MEMC packets (with address and data fields) as soon as they are read.  All of them carry the sequence number
+ * of the request.  The stream ends with an OKAY response containing the total size of data read (or a FAIL response
+ * if nothing could be read).  Reading stops at the first page, which can't be read.
+ *
+ * Unless the racy field is set to a non-zero value, the process is held stopped during the whole dump (see
+ * process_hold), even if other requests resume the traced processes in the meantime. */
+
+/* Default and maximum chunk size. */
+#define MEMSTREAM_CHUNK         (256 * 1024)
+#define MEMSTREAM_CHUNK_MAX     (4 * 1024 * 1024)
+
+typedef struct memstream_t {
+    process_t * process;
+    packet_t origin;        /* header of the request */
+    address_t start;
+    address_t address;      /* next address to read */
+    address_t end;
+    uint32_t chunk;
+    bool held;              /* the process is held stopped during the dump */
+} memstream_t;
+
+static bool memstream_produce(comm_client_t * client, void * data) {
+    memstream_t * stream = data;
+    size_t size = stream->end - stream->address;
+    size_t read;
+    
+    if (size > stream->chunk)
+        size = stream->chunk;
+        
+    payload_reset(payload_buffer);
+    write_u64x("address", stream->address);
+    read = mem_read_process(stream->process, stream->address, size,
+                            payload_put_blob_uninit(payload_buffer, "data", size));
+    payload_shrink_last(payload_buffer, read);
+    
+    if (read) {
+        comm_queue(client, respond(&stream->origin, "MEMC"));
+        stream->address += read;
+    }
+    
+    if ((read == size) && (stream->address < stream->end))
+        return true;
+        
+    /* Last chunk sent. */
+    uint64_t size_read = stream->address - stream->start;
+    payload_reset(payload_buffer);
+    write_u64x("size", size_read);
+    
+    if (size_read) {
+        comm_queue(client, say(&stream->origin, "OKAY", "Dumped %llu bytes.", (unsigned long long) size_read));
+    } else {
+        comm_queue(client, say(&stream->origin, "FAIL", "Can't read memory at %p.", (void *) stream->start));
+    }
+    
+    return false;
+}
+
+static void memstream_release(void * data) {
+    memstream_t * stream = data;
+    
+    if (stream->held)
+        process_unhold(stream->process);
+        
+    process_put(stream->process);
+    free(stream);
+}
+
+static const packet_t * handle_MEMS(const packet_t * request) {
+    uint32_t pid;
+    uint64_t address;
+    uint64_t size;
+    uint32_t racy = 0;
+    uint32_t chunk = 0;
+    bool has_racy;
+    bool has_chunk;
+    process_t * process;
+    memstream_t * stream;
+    
+    read_u32(pid);
+    read_u64(address);
+    read_u64(size);
+    
+    read_opt_u32(racy, has_racy);
+    read_opt_u32(chunk, has_chunk);
+    
+    if (!size)
+        say_FAIL("Nothing to dump.");
+        
+    if (address + size < address)
+        say_FAIL("Invalid address range.");
+        
+    if (!(process = process_get(pid)))
+        say_FAIL("Not attached to %u.", (unsigned int) pid);
+        
+    stream = adbi_malloc(sizeof(memstream_t));
+    stream->process = process;
+    stream->origin.head = request->head;
+    stream->start = stream->address = address;
+    stream->end = address + size;
+    stream->chunk = (has_chunk && chunk) ? chunk : MEMSTREAM_CHUNK;
+    stream->held = false;
+    
+    if (stream->chunk > MEMSTREAM_CHUNK_MAX)
+        stream->chunk = MEMSTREAM_CHUNK_MAX;
+        
+    if (!comm_stream_start(request->client, memstream_produce, memstream_release, stream)) {
+        process_put(process);
+        free(stream);
+        say_FAIL("Another stream is already active on this connection.");
+    }
+    
+    if (!(has_racy && racy)) {
+        /* Other requests (e.g. STRT or INJL) must not resume the process in the middle of the dump. */
+        process_hold(process);
+        stream->held = true;
+    }
+    
+    debug("Streaming %llu bytes of memory of %s starting at %p.", (unsigned long long) size, str_process(process),
+          (void *) address);
+          
+    /* The responses are sent by the stream producer. */
+    return NULL;
+}
+
+/* Memory dump into shared memory.
+ *
+ * The MEMF request reads size bytes of process memory starting at address into a shared memory file.  The file
+ * descriptor is passed to the client along with the OKAY response, which contains the number of bytes read (the file
+ * size).  The client can map the file, so the data is never copied through the socket.  Only clients connected
+ * through the unix socket can receive file descriptors.
+ *
+ * Unless the racy field is set to a non-zero value, the process is stopped while its memory is read. */
+
+/* Maximum size of a shared memory dump. */
+#define MEMF_MAX (256 * 1024 * 1024)
+
+static const packet_t * handle_MEMF(const packet_t * request) {
+    uint32_t pid;
+    uint64_t address;
+    uint64_t size;
+    uint64_t length;
+    uint32_t racy = 0;
+    bool has_racy;
+    process_t * process;
+    void * data;
+    bool resume = false;
+    int fd;
+    
+    read_u32(pid);
+    read_u64(address);
+    read_u64(size);
+    
+    read_opt_u32(racy, has_racy);
+    
+    if (!request->client || !comm_client_local(request->client))
+        say_USUP("File descriptors can be passed only through the unix socket.");
+        
+    if (!size)
+        say_FAIL("Nothing to dump.");
+        
+    if (size > MEMF_MAX)
+        say_FAIL("Too much data requested (limit is %u bytes).", MEMF_MAX);
+        
+    if (address + size < address)
+        say_FAIL("Invalid address range.");
+        
+    if (!(process = process_get(pid)))
+        say_FAIL("Not attached to %u.", (unsigned int) pid);
+        
+    if ((fd = shm_create("adbi-memf", size)) < 0) {
+        process_put(process);
+        say_FAIL("Error creating shared memory.");
+    }
+    
+    length = size;
+    data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        process_put(process);
+        say_FAIL("Error mapping shared memory.");
+    }
+    
+    if (!(has_racy && racy) && !process_is_stopped(process)) {
+        process_stop(process);
+        resume = true;
+    }
+    
+    size = mem_read_process(process, address, size, data);
+    
+    if (resume)
+        process_continue(process);
+        
+    munmap(data, length);
+    process_put(process);
+    
+    if (!size) {
+        close(fd);
+        say_FAIL("Can't read memory at %p.", (void *) address);
+    }
+    
+    /* Trim the file to the size actually read. */
+    if (ftruncate(fd, size))
+        warning("Error trimming shared memory file: %s.", strerror(errno));
+        
+    write_u64(size);
+    comm_queue_fd(request->client, say(request, "OKAY", "Dumped %llu bytes.", (unsigned long long) size), fd);
+    
+    /* The response was queued along with the file descriptor. */
+    return NULL;
+}
+
+/* Process memory map.  The segments are reported as a set of parallel arrays. */
 static const packet_t * handle_MAPS(const packet_t * request) {
     uint32_t pid;
     process_t * process;
     
     uint32_t segc = 0;
+    uint32_t allocated = 0;
+    
+    struct {
+        uint64_t * lo;
+        uint64_t * hi;
+        uint32_t * off;
+        const char ** type;
+        char ** file;
+    } seg = { NULL, NULL, NULL, NULL, NULL };
     
     void report(const char * type, address_t lo, address_t hi,
                 const char * file, offset_t offset) {
-        char name[16];
-        
-        adbi_assure(snprintf(name, 16, "seglo[%u]", (unsigned int) segc) < 16);
-        write_u64x(name, lo);
-        
-        adbi_assure(snprintf(name, 16, "seghi[%u]", (unsigned int) segc) < 16);
-        write_u64x(name, hi);
         
-        adbi_assure(snprintf(name, 16, "segtype[%u]", (unsigned int) segc) < 16);
-        write_strx(name, type);
-        
-        adbi_assure(snprintf(name, 16, "segfile[%u]", (unsigned int) segc) < 16);
-        write_strx(name, file ? file : "");
+        if (segc == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            seg.lo = adbi_realloc(seg.lo, allocated * sizeof(*seg.lo));
+            seg.hi = adbi_realloc(seg.hi, allocated * sizeof(*seg.hi));
+            seg.off = adbi_realloc(seg.off, allocated * sizeof(*seg.off));
+            seg.type = adbi_realloc(seg.type, allocated * sizeof(*seg.type));
+            seg.file = adbi_realloc(seg.file, allocated * sizeof(*seg.file));
+        }
         
-        adbi_assure(snprintf(name, 16, "segoff[%u]", (unsigned int) segc) < 16);
-        write_u32x(name, file ? offset : 0);
+        seg.lo[segc] = lo;
+        seg.hi[segc] = hi;
+        seg.off[segc] = file ? offset : 0;
+        seg.type[segc] = type;
+        seg.file[segc] = strdup(file ? file : "");
         
         ++segc;
     }
@@ -592,20 +1269,177 @@ static const packet_t * handle_MAPS(const packet_t * request) {
     segment_iter(process, callback_segment);
     injection_iter(process, callback_injection);
     
+    payload_put_u64_array(payload_buffer, "seglo", seg.lo, segc);
+    payload_put_u64_array(payload_buffer, "seghi", seg.hi, segc);
+    payload_put_str_array(payload_buffer, "segtype", seg.type, segc);
+    payload_put_str_array(payload_buffer, "segfile", (const char * const *) seg.file, segc);
+    payload_put_u32_array(payload_buffer, "segoff", seg.off, segc);
     write_u32(segc);
+    
+    for (uint32_t i = 0; i < segc; ++i)
+        free(seg.file[i]);
+    free(seg.lo);
+    free(seg.hi);
+    free(seg.off);
+    free(seg.type);
+    free(seg.file);
+    
     process_put(process);
     say_OKAY("Process %u has %u segment%s.", pid, segc, segc == 1 ? "" : "s");
 }
 
+/***********************************************************************************************************************
+ * Batches
+ **********************************************************************************************************************/
+
+/* A BTCH packet carries a sequence of complete request packets (header and payload each) instead of a regular payload.
+ * The requests are handled in order and the response is a BTCH packet, which carries the sequence of their response
+ * packets.  The responses keep the sequence numbers of the corresponding requests.  Streamed responses (e.g. of MEMS)
+ * are not included in the batch response, they are sent separately.
+ *
+ * If tracing is enabled and the batch doesn't contain STRT or STOP requests, the tracees are stopped only once for the
+ * whole batch instead of once for every request that requires it. */
+
+static struct {
+    char * buf;
+    size_t allocated;
+    size_t size;
+} batch_buffer;
+
+static void batch_append(const void * data, size_t count) {
+    if (batch_buffer.size + count > batch_buffer.allocated) {
+        size_t allocate = batch_buffer.allocated ? batch_buffer.allocated : 256;
+        while (batch_buffer.size + count > allocate)
+            allocate *= 2;
+        batch_buffer.buf = adbi_realloc(batch_buffer.buf, allocate);
+        batch_buffer.allocated = allocate;
+    }
+    memcpy(batch_buffer.buf + batch_buffer.size, data, count);
+    batch_buffer.size += count;
+}
+
+/* Iterate over the requests in a batch packet.  Return false if the batch is malformed. */
+static bool batch_iter(const packet_t * request, void (*callback)(const packet_t * subrequest)) {
+    const char * buf = request->payload;
+    size_t offset = 0;
+    
+    while (offset < request->head.length) {
+        packet_t subrequest;
+        
+        if (request->head.length - offset < sizeof(packet_header_t))
+            return false;
+        memcpy(&subrequest.head, buf + offset, sizeof(packet_header_t));
+        offset += sizeof(packet_header_t);
+        
+        if (request->head.length - offset < subrequest.head.length)
+            return false;
+        subrequest.payload = (void *) (buf + offset);
+        subrequest.client = request->client;
+        offset += subrequest.head.length;
+        
+        if (callback)
+            callback(&subrequest);
+    }
+    
+    return true;
+}
+
+static const packet_t * handle_BTCH(const packet_t * request) {
+    static packet_t response;
+    
+    bool pause_tracing;
+    uint32_t reqc = 0;
+    
+    void check(const packet_t * subrequest) {
+        if ((subrequest->head.type == packet_id("STRT")) || (subrequest->head.type == packet_id("STOP")))
+            pause_tracing = false;
+        ++reqc;
+    }
+    
+    void execute(const packet_t * subrequest) {
+        const packet_t * subresponse;
+        
+        if (subrequest->head.type == packet_id("BTCH")) {
+            payload_reset(payload_buffer);
+            subresponse = say(subrequest, "MALF", "Nested batches are not allowed.");
+        } else {
+            subresponse = handle_packet(subrequest);
+        }
+        
+        if (!subresponse) {
+            /* The response is a stream, it will be sent separately. */
+            return;
+        }
+        
+        batch_append(&subresponse->head, sizeof(packet_header_t));
+        batch_append(subresponse->payload, subresponse->head.length);
+    }
+    
+    pause_tracing = state_tracing();
+    if (!batch_iter(request, check))
+        say_MALF("Batch packet malformed.");
+        
+    debug("Handling batch of %u requests%s.", reqc, pause_tracing ? " with tracees stopped" : "");
+    
+    if (pause_tracing)
+        state_tracing_set(false);
+        
+    batch_buffer.size = 0;
+    batch_iter(request, execute);
+    
+    if (pause_tracing)
+        state_tracing_set(true);
+        
+    response.head.type = packet_id("BTCH");
+    response.head.seq = request->head.seq;
+    response.head.length = batch_buffer.size;
+    response.payload = batch_buffer.buf;
+    return &response;
+}
+
 /******************************************************************************/
 
+/* Payloads smaller than this are copied by packet_take_payload, larger ones are handed over. */
+#define PACKET_TAKE_COPY_MAX 4096
+
+/* Return the payload of a response packet as a buffer owned by the caller.  Large payloads constructed in the shared
+ * response buffers are handed over without copying (the shared buffer is replaced by a new one), small ones are
+ * copied, so that the shared buffers don't need to grow again. */
+void * packet_take_payload(const packet_t * packet) {
+    size_t size = packet->head.length;
+    void * result;
+    
+    if (size > PACKET_TAKE_COPY_MAX) {
+        if (packet->payload == payload_buffer->buf)
+            return payload_detach(payload_buffer);
+            
+        if (packet->payload == batch_buffer.buf) {
+            result = batch_buffer.buf;
+            batch_buffer.buf = NULL;
+            batch_buffer.allocated = batch_buffer.size = 0;
+            return result;
+        }
+    }
+    
+    if (!size)
+        return NULL;
+        
+    result = adbi_malloc(size);
+    memcpy(result, packet->payload, size);
+    return result;
+}
+
 void protocol_cleanup() {
     if (payload_buffer)
         payload_free(payload_buffer);
+    if (request_index)
+        payload_index_free(request_index);
+    free(batch_buffer.buf);
 }
 
 bool protocol_init() {
     payload_buffer = payload_create();
+    request_index = payload_index_create();
     debug("Response payload buffer created.");
     return payload_buffer;
 }
@@ -632,13 +1466,20 @@ static const char * packet_str(uint32_t packet_type) {
 /* Main request packet handling function. Takes a request packet as parameter
  * and returns a response packet. The function always checks the packet payload
  * for correctness. If the packet is correct, it calls the appropriate
- * handle_XXXX function.
+ * handle_XXXX function. NULL is returned if the handler started a stream on
+ * the requesting connection instead of responding directly.
  */
 const packet_t * handle_packet(const packet_t * request) {
 
     payload_reset(payload_buffer);
     
-    if (!payload_check(request->payload, request->head.length)) {
+    /* Batch packets carry packets instead of a regular payload. */
+    if (request->head.type == packet_id("BTCH")) {
+        info("Received BTCH packet.");
+        return handle_BTCH(request);
+    }
+    
+    if (!payload_check_indexed(request->payload, request->head.length, request_index)) {
         warning("Malformed packet received.");
         say_MALF("Packet payload malformed.");
     }
@@ -667,18 +1508,31 @@ const packet_t * handle_packet(const packet_t * request) {
     call_handler(INJA)  /* adbi         */
     call_handler(INJT)  /* tracepoints  */
     
+    /* tracepoint control */
+    call_handler(TPCF)  /* configure    */
+    call_handler(TPEN)  /* enable       */
+    call_handler(TPDI)  /* disable      */
+    call_handler(TPAD)  /* add          */
+    call_handler(TPRM)  /* remove       */
+    call_handler(CNTR)  /* counters     */
+    call_handler(COVR)  /* coverage     */
+    
     /* adbiserver control */
     call_handler(LLEV)
     call_handler(STRT)
     call_handler(STOP)
     call_handler(QUIT)
+    call_handler(LATS)
     
     /* process diagnostics */
     call_handler(ADDR)
     call_handler(MEMD)
+    call_handler(MEMS)
+    call_handler(MEMF)
     call_handler(MAPS)
     
     /* helper requests */
+    call_handler(SUBS)
     call_handler(LDIR)
     call_handler(PING)
     
@@ -12,13 +12,14 @@ typedef packed_struct packet_header_t {
 typedef struct packet_t {
     packet_header_t head;
     void * payload;
+    struct comm_client_t * client;  /* client which sent the packet (requests only) */
 } packet_t;
 
 bool protocol_init();
 void protocol_cleanup();
 
-packet_t * packet_create(const packet_header_t * head);
-void packet_free(packet_t * packet);
+uint32_t packet_id(const char * type);
+void * packet_take_payload(const packet_t * packet);
 
 const packet_t * handle_packet(const packet_t * request);
 
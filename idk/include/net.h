@@ -42,6 +42,12 @@ struct sockaddr_in {
                         sizeof(unsigned short int) - sizeof(struct in_addr)];
 };
 
+#define UNIX_PATH_MAX 108
+struct sockaddr_un {
+    sa_family_t sun_family;
+    char sun_path[UNIX_PATH_MAX];
+};
+
 /* Communication domains */
 #define AF_UNIX 1
 #define AF_INET 2
@@ -4,14 +4,43 @@
 static int adbi_write_fd;
 static mutex_t adbi_write_mutex;
 
-LOCAL int adbi_write_init() {
-    adbi_write_mutex = 0;
+/* Handler output goes to adbilog.  The abstract unix socket is tried first, because it's cheaper than loopback TCP.
+ * If adbilog doesn't listen on it, TCP is used. */
+static const char adbi_write_unix_name[] = "adbilog";
+
+/* Connect the output socket to the abstract unix socket of adbilog. */
+LOCAL int adbi_write_connect_unix() {
+    struct sockaddr_un address;
+    unsigned int length = 0;
+    
+    adbi_write_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int ret = get_errno(&adbi_write_fd);
+    if (ret)
+        return ret;
+        
+    /* Abstract socket addresses start with a null byte and are not null terminated. */
+    address.sun_family = AF_UNIX;
+    address.sun_path[0] = '\0';
+    while (adbi_write_unix_name[length]) {
+        address.sun_path[length + 1] = adbi_write_unix_name[length];
+        ++length;
+    }
+    
+    ret = connect(adbi_write_fd, (const struct sockaddr *) &address, sizeof(sa_family_t) + 1 + length);
+    ret = get_errno(&ret);
+    if (ret)
+        close(adbi_write_fd);
+    return ret;
+}
+
+/* Connect the output socket to the TCP port of adbilog. */
+LOCAL int adbi_write_connect_tcp() {
     struct sockaddr_in address;
     
     adbi_write_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     int ret = get_errno(&adbi_write_fd);
     if (ret)
-        goto out;
+        return ret;
         
     address.sin_family = AF_INET;
     address.sin_port = htons(2222);
@@ -20,9 +49,17 @@ LOCAL int adbi_write_init() {
     ret = connect(adbi_write_fd, (const struct sockaddr *) &address, sizeof(struct sockaddr));
     ret = get_errno(&ret);
     if (ret)
-        goto out;
+        close(adbi_write_fd);
+    return ret;
+}
+
+LOCAL int adbi_write_init() {
+    adbi_write_mutex = 0;
+    
+    int ret = adbi_write_connect_unix();
+    if (ret)
+        ret = adbi_write_connect_tcp();
         
-out:
     if (ret) {
         adbi_write_fd = -1;
     }
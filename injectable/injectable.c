@@ -5,9 +5,14 @@
 #include "process/thread.h"
 #include "process/list.h"
 
+#include "injection/injection.h"
+
 #include "tree.h"
 #include "util/human.h"
 
+#include "tracepoint/option.h"
+#include "tracepoint/tracepoint.h"
+
 static tree_t injectables;
 static tree_t libraries;
 static tree_t bindings;
@@ -32,6 +37,8 @@ static injectable_t * injectable_create(injfile_t * injfile, const char * filena
     injectable->references = 0;
     injectable->id = next_iid++;
     injectable->injfile = injfile;
+    injectable->tpoptions = NULL;
+    injectable->dyntpoints = NULL;
     
     tree_insert(&injectables, injectable->id, injectable);
     if (injectable_is_library(injectable)) {
@@ -56,6 +63,11 @@ static void injectable_free(injectable_t * injectable) {
         tree_remove(&bindings, injectable->id);
     }
     
+    tracepoint_options_clear(injectable);
+    injfile_tpoint_t * tpoint;
+    while ((tpoint = tree_pop(&injectable->dyntpoints)))
+        free(tpoint);
+    
     if (injectable->builtin) {
         /* built-in injectable, do not unload */
     } else {
@@ -136,12 +148,18 @@ const injectable_t * injectable_load(const char * filename, const char ** msg) {
     injectable = injectable_create(injfile, filename);
     
     /* Load the injectable into processes if necessary. */
+    injectable_attach(injectable);
+    
+    return injectable;
+}
+
+/* Inject the injectable into all segments it is bound to, where it isn't injected yet, and install its tracepoints
+ * there.  Segments without any of its tracepoints are skipped.  All processes must be stopped. */
+void injectable_attach(const injectable_t * injectable) {
     void callback(process_t * process) {
         process_attach_injectable(process, injectable);
     }
     process_iter(callback);
-    
-    return injectable;
 }
 
 
@@ -207,6 +225,37 @@ void injectable_cleanup() {
     assert(tree_empty(&bindings));
 }
 
+/* Reinstall tracepoints of the injectable in all processes.  All processes must be stopped. */
+void injectable_reinstall_tracepoints(const injectable_t * injectable) {
+    void reinstall_process(process_t * process) {
+        process_reinstall_injectable(process, injectable);
+    }
+    process_iter(reinstall_process);
+}
+
+/* Enable or disable tracepoints of the injectable in all processes according to their options.  All processes must be
+ * stopped.  Return false if tracepoints could not be toggled in some process. */
+bool injectable_toggle_tracepoints(const injectable_t * injectable) {
+    bool ret = true;
+    void toggle_process(process_t * process) {
+        ret = process_toggle_injectable(process, injectable) && ret;
+    }
+    process_iter(toggle_process);
+    return ret;
+}
+
+/* Change the sampling rate of the injectable's tracepoints at the given file address (or of all of them if the address
+ * is 0) in all processes without reinstalling them.  Return false if some tracepoints must be reinstalled. */
+bool injectable_set_tracepoint_rate(const injectable_t * injectable, address_t address, uint32_t rate) {
+    bool ret = true;
+    void callback(segment_t * segment) {
+        if (segment->injection && (segment->injection->injectable == injectable))
+            ret = tracepoints_set_rate(segment, address, rate) && ret;
+    }
+    segment_iter_all(callback);
+    return ret;
+}
+
 bool injectable_is_library(const injectable_t * injectable) {
     return injfile_is_library(injectable->injfile);
 }
@@ -267,7 +316,70 @@ void injectable_iter_adbi(const injectable_t * injectable, injfile_symbol_callba
     injfile_iter_adbi(injectable->injfile, callback);
 }
 
+/* Iterate over tracepoints defined by the inj file and tracepoints added at runtime. */
 void injectable_iter_tracepoints(const injectable_t * injectable, injfile_tpoint_callback_t callback) {
     injfile_iter_tpoints(injectable->injfile, callback);
+    TREE_ITER(&injectable->dyntpoints, node) {
+        const injfile_tpoint_t * tpoint = node->val;
+        callback(tpoint->address, tpoint->handler_fn);
+    }
+}
+
+/* Return true if the injectable defines a tracepoint at the given file address. */
+bool injectable_has_tracepoint(const injectable_t * injectable, address_t address) {
+    if (tree_get(&injectable->dyntpoints, address))
+        return true;
+    INJECTABLE_ITER_TPOINTS(injectable, tpoint) {
+        if (tpoint->address == address)
+            return true;
+    }
+    return false;
+}
+
+/* Add a tracepoint at the given file address with the given handler (an offset in the injectable) at runtime.  The
+ * tracepoint is not installed by this function (see injectable_reinstall_tracepoints).  Return true on success. */
+bool injectable_add_tracepoint(const injectable_t * injectable, address_t address, offset_t handler,
+                               const char ** msg) {
+    /* Runtime tracepoints are not a part of the injectable file, so they can be added even for a const injectable. */
+    tree_t * tree = (tree_t *) &injectable->dyntpoints;
+    
+    if (injectable_is_library(injectable)) {
+        if (msg) *msg = "library injectables can't define tracepoints";
+        return false;
+    }
+    if (!address) {
+        if (msg) *msg = "invalid tracepoint address";
+        return false;
+    }
+    if (injectable_has_tracepoint(injectable, address)) {
+        if (msg) *msg = "tracepoint already defined";
+        return false;
+    }
+    
+    injfile_tpoint_t * tpoint = adbi_malloc(sizeof(injfile_tpoint_t));
+    tpoint->address = address;
+    tpoint->handler_fn = handler;
+    tree_insert(tree, address, tpoint);
+    return true;
+}
+
+/* Remove a tracepoint added at runtime together with its options.  The tracepoint is not uninstalled by this function.
+ * Return true on success. */
+bool injectable_remove_tracepoint(const injectable_t * injectable, address_t address, const char ** msg) {
+    tree_t * tree = (tree_t *) &injectable->dyntpoints;
+    injfile_tpoint_t * tpoint = tree_get(tree, address);
+    
+    if (!tpoint) {
+        if (msg) *msg = injectable_has_tracepoint(injectable, address) ? "tracepoint defined by the inj file" :
+                            "no such tracepoint";
+        return false;
+    }
+    
+    tree_remove(tree, address);
+    free(tpoint);
+    
+    /* Don't let a tracepoint added later at the same address inherit the options. */
+    tracepoint_options_remove(injectable, address);
+    return true;
 }
 
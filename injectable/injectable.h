@@ -20,6 +20,12 @@ struct injectable_t {
     
     /* is the injectable built-in? */
     bool builtin;
+    
+    /* runtime options of tracepoints: (address_t) -> (tracepoint_options_t *), see tracepoint/option.c */
+    tree_t tpoptions;
+    
+    /* tracepoints added at runtime: (address_t) -> (injfile_tpoint_t *) */
+    tree_t dyntpoints;
 };
 
 typedef struct injectable_t injectable_t;
@@ -28,6 +34,15 @@ injectable_t * injectable_init_builtin(void * buffer, size_t size);
 const injectable_t * injectable_load(const char * filename, const char ** msg);
 
 bool injectable_unload(unsigned int iid, const char ** msg);
+void injectable_attach(const injectable_t * injectable);
+void injectable_reinstall_tracepoints(const injectable_t * injectable);
+bool injectable_toggle_tracepoints(const injectable_t * injectable);
+bool injectable_set_tracepoint_rate(const injectable_t * injectable, address_t address, uint32_t rate);
+
+bool injectable_has_tracepoint(const injectable_t * injectable, address_t address);
+bool injectable_add_tracepoint(const injectable_t * injectable, address_t address, offset_t handler,
+                               const char ** msg);
+bool injectable_remove_tracepoint(const injectable_t * injectable, address_t address, const char ** msg);
 
 bool injectable_is_library(const injectable_t * injectable);
 
@@ -1,6 +1,7 @@
 #include "tree.h"
 
 #include "process/process.h"
+#include "process/artificial.h"
 
 #include "tracepoint/tracepoint.h"
 #include "injectable/injectable.h"
@@ -23,11 +24,13 @@ static injection_t * injection_create(process_t * process, const injectable_t *
     ((injectable_t *) injection->injectable)->references++;
     
     tree_insert(&process->injections, (tree_key_t) injection->injectable, injection);
+    artificial_add_injection(injection);
     
     return injection;
 }
 
 static void injection_free(injection_t * injection) {
+    artificial_remove(injection->process, injection->address);
     tree_remove(&injection->process->injections, (tree_key_t) injection->injectable);
     ((injectable_t *) injection->injectable)->references--;
     free(injection);
@@ -37,21 +40,10 @@ injection_t * injection_get(const process_t * process, const injectable_t * inje
     return tree_get(&process->injections, (tree_key_t) injectable);
 }
 
-/* Check if the given injection contains the given address. */
-static bool injection_contains(const injection_t * injection, address_t address) {
-    address_t start = injection->address;
-    address_t end = start + injection->injectable->injfile->code_size;
-    return (address >= start) && (address < end);
-}
-
 /* Return the injection in the process, which contains the given address. */
 const injection_t * injection_get_by_address(const process_t * process, address_t address) {
-    TREE_ITER(&process->injections, node) {
-        const injection_t * injection = node->val;
-        if (injection_contains(injection, address))
-            return injection;
-    }
-    return NULL;
+    const artificial_t * artificial = artificial_get(process, address);
+    return artificial ? artificial->injection : NULL;
 }
 
 void injection_iter(process_t * process, void callback(injection_t *)) {
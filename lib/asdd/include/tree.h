@@ -246,7 +246,7 @@ static inline node_t * tree_iter_prev(const node_t * node) {
         return NULL;
         
     if (node->links.left)
-        return tree_get_max(node->links.right);
+        return tree_get_max(node->links.left);
         
     while ((node->links.parent) && (node->links.parent->links.left == node))
         node = node->links.parent;
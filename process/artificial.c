@@ -0,0 +1,65 @@
+#include "tree.h"
+
+#include "process.h"
+#include "segment.h"
+#include "artificial.h"
+
+#include "injectable/injfile.h"
+#include "injection/injection.h"
+#include "tracepoint/arena.h"
+
+/* Artificial regions never overlap, so each process keeps them in a tree indexed by start address and an address is
+ * looked up by finding the closest region starting at or below it. */
+
+static void artificial_add(process_t * process, address_t start, size_t size,
+                           arena_t * arena, segment_t * segment, injection_t * injection) {
+    artificial_t * artificial = adbi_malloc(sizeof(artificial_t));
+
+    artificial->start = start;
+    artificial->end = start + size;
+    artificial->arena = arena;
+    artificial->segment = segment;
+    artificial->injection = injection;
+
+    assert(!artificial_get(process, start));
+    assert(!artificial_get(process, artificial->end - 1));
+    tree_insert(&process->artificial, start, artificial);
+}
+
+/* Register a trampoline arena. */
+void artificial_add_arena(process_t * process, arena_t * arena, address_t address, size_t size) {
+    artificial_add(process, address, size, arena, NULL, NULL);
+}
+
+/* Register a page of veneers used by tracepoints of the given segment. */
+void artificial_add_veneers(segment_t * segment, address_t address, size_t size) {
+    artificial_add(segment->process, address, size, NULL, segment, NULL);
+}
+
+/* Register code loaded by the given injection. */
+void artificial_add_injection(injection_t * injection) {
+    size_t size = injection->injectable->injfile->code_size;
+    assert(size);
+    artificial_add(injection->process, injection->address, size, NULL, NULL, injection);
+}
+
+/* Register the tracepoint slot area. */
+void artificial_add_slots(process_t * process, address_t address, size_t size) {
+    artificial_add(process, address, size, NULL, NULL, NULL);
+}
+
+/* Forget the region starting at the given address. */
+void artificial_remove(process_t * process, address_t start) {
+    artificial_t * artificial = tree_get(&process->artificial, start);
+    assert(artificial);
+    tree_remove(&process->artificial, start);
+    free(artificial);
+}
+
+/* Return the artificial region containing the given address or NULL. */
+const artificial_t * artificial_get(const process_t * process, address_t address) {
+    const artificial_t * artificial = tree_get_le(&process->artificial, address);
+    if (artificial && (address < artificial->end))
+        return artificial;
+    return NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef ARTIFICIAL_H_
+#define ARTIFICIAL_H_
+
+#include "tree.h"
+
+struct process_t;
+struct segment_t;
+struct injection_t;
+struct arena_t;
+
+/* Memory region created by us in the inferior process -- a trampoline arena, a page of veneers, injected code or the
+ * tracepoint slot area.  At most one of the arena, segment and injection pointers is set, none for the slot area. */
+typedef struct artificial_t {
+    address_t start, end;
+
+    /* trampoline arena shared by segments */
+    struct arena_t * arena;
+
+    /* segment owning the veneers */
+    struct segment_t * segment;
+
+    /* injection loaded at the region */
+    struct injection_t * injection;
+} artificial_t;
+
+void artificial_add_arena(struct process_t * process, struct arena_t * arena, address_t address, size_t size);
+void artificial_add_veneers(struct segment_t * segment, address_t address, size_t size);
+void artificial_add_injection(struct injection_t * injection);
+void artificial_add_slots(struct process_t * process, address_t address, size_t size);
+void artificial_remove(struct process_t * process, address_t start);
+
+const artificial_t * artificial_get(const struct process_t * process, address_t address);
+
+#endif
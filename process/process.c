@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <sched.h>      /* for sched_yield */
 #include <signal.h>
 
 #include "process.h"
@@ -13,9 +12,13 @@
 #include "configuration/state.h"
 
 #include "procutil/procfs.h"
+#include "procutil/wait.h"
+#include "procutil/mem.h"
 
 #include "injection/inject.h"
 
+#include "tracepoint/prologue.h"
+
 /**********************************************************************************************************************/
 
 /* Create a new process with the given PID. The process is refcounted. */
@@ -28,8 +31,14 @@ static process_t * process_create(pid_t pid) {
     process->segments = NULL;
     process->injections = NULL;
     process->jumps = NULL;
+    process->artificial = NULL;
+    process->arenas = NULL;
+    process->slots = NULL;
     process->references = 1;
+    process->memfd = -1;
     process->stabilizing = false;
+    process->seized = false;
+    process->held = 0;
     
     process->linker.bkpt = 0;
     
@@ -45,6 +54,10 @@ void process_free(process_t * process) {
     
     segment_reset(process);
     injection_reset(process);
+    procfs_mem_close(process);
+    
+    /* Trampolines and injections unregister themselves. */
+    assert(tree_empty(&process->artificial));
     
     debug("Freed process %s.", str_process(process));
     
@@ -57,15 +70,38 @@ void process_continue(process_t * process) {
     void callback(thread_t * thread) {
         thread_continue(thread, 0);
     }
+    
+    if (process->held) {
+        /* The process will be continued when the last hold is released. */
+        debug("Not continuing %s, it is held.", str_process(process));
+        return;
+    }
+    
     thread_iter(process, callback);
 }
 
 void process_stop(process_t * process) {
     while (!process_is_stopped(process)) {
-        thread_iter(process, thread_stop);
+        /* Request all threads to stop first, so they stop concurrently, and collect the stops afterwards. */
+        thread_iter(process, thread_stop_request);
+        thread_iter(process, thread_stop_wait);
     }
 }
 
+/* Stop the process and keep it stopped until process_unhold is called.  While the process is held, process_continue
+ * does nothing, so the process is not resumed by other requests (e.g. when tracing is started). */
+void process_hold(process_t * process) {
+    process_stop(process);
+    ++process->held;
+}
+
+/* Release a hold of the process.  After the last hold is released, the process is continued if tracing is enabled. */
+void process_unhold(process_t * process) {
+    assert(process->held);
+    if (!--process->held && state_tracing())
+        process_continue(process);
+}
+
 /**********************************************************************************************************************/
 
 void process_continue_all() {
@@ -213,6 +249,7 @@ process_t * process_attach(pid_t pid) {
     
     process = process_create(pid);
     process->spawned = false;
+    process->seized = ptrace_seize_mode;
     
     do {
         void callback(pid_t thread_pid) {
@@ -273,6 +310,7 @@ process_t * process_forked(process_t * parent, pid_t child_pid) {
     process_t * child = process_create(child_pid);
     
     child->spawned = parent->spawned;
+    child->seized = parent->seized;     /* children of seized processes are seized automatically */
     
     /* First clone injection information, because segment information may reference injections. */
     injection_fork(child, parent);
@@ -312,6 +350,28 @@ void process_attach_injectable(process_t * process, const injectable_t * injecta
     }
 }
 
+void process_reinstall_injectable(process_t * process, const injectable_t * injectable) {
+    thread_t * thread = thread_any_stopped(process);
+    if (thread) {
+        segment_reinstall_injectable(thread, injectable);
+        thread_put(thread);
+    } else {
+        /* the process died -- nothing to do */
+    }
+}
+
+bool process_toggle_injectable(process_t * process, const injectable_t * injectable) {
+    bool ret = true;
+    thread_t * thread = thread_any_stopped(process);
+    if (thread) {
+        ret = segment_toggle_injectable(thread, injectable);
+        thread_put(thread);
+    } else {
+        /* the process died -- nothing to do */
+    }
+    return ret;
+}
+
 /**********************************************************************************************************************/
 
 static void process_find_unstable(process_t * process, tree_t * unstable) {
@@ -325,12 +385,95 @@ static void process_find_unstable(process_t * process, tree_t * unstable) {
     thread_iter(process, callback);
 }
 
+/* Maximum number of instructions single-stepped to get a thread out of the artificial regions. */
+#define STABILIZE_MAX_STEPS     256
+
+/* Timeouts (in milliseconds) of waiting for a single step and of waiting for threads in the fallback mode.  Timeouts
+ * only guard against threads blocked in system calls, we don't give up on such threads. */
+#define STABILIZE_STEP_TIMEOUT  10
+#define STABILIZE_WAIT_TIMEOUT  100
+
+/* Return true if the thread is stopped in an exclusive load/store loop of a trampoline prologue. */
+static bool process_stabilize_exclusive(thread_t * thread) {
+    pt_regs regs;
+    insn_t insn;
+    
+    if (!thread_get_regs(thread, &regs))
+        return false;
+        
+    if (mem_read(thread, arch_get_pc(&regs), sizeof(insn_t), &insn) != sizeof(insn_t))
+        return false;
+        
+    return prologue_is_exclusive(insn);
+}
+
+/* Single-step an unstable thread until it leaves the artificial regions.  Most unstable threads are just a few
+ * instructions away from the end of a trampoline.  Threads in exclusive loops are left to the fallback, because the
+ * loops never complete when single-stepped.  Return true if the thread is stable (or dead). */
+static bool process_stabilize_step(thread_t * thread) {
+    for (int steps = 0; steps < STABILIZE_MAX_STEPS; ++steps) {
+        if (process_stabilize_exclusive(thread)) {
+            debug("Thread %s is in an exclusive loop, not single-stepping it.", str_thread(thread));
+            return false;
+        }
+        
+        if (!thread_step(thread, STABILIZE_STEP_TIMEOUT))
+            return thread->state.dead;
+        if (thread_is_stable(thread))
+            return true;
+    }
+    
+    verbose("Thread %s is still unstable after %d steps.", str_thread(thread), STABILIZE_MAX_STEPS);
+    return false;
+}
+
+/* Stabilize the remaining threads by letting them run with all natural segments execution-protected, until they
+ * return to natural code and fault. */
+static void process_stabilize_protected(process_t * process, tree_t * unstable) {
+    verbose("Stabilizing process %s with execution-protected segments.", str_process(process));
+    
+    segment_set_exacutable_all(process, false);
+    
+    int still_running;
+    do {
+        still_running = 0;
+        TREE_ITER(unstable, node) {
+            thread_t * thread = node->val;
+            
+            if (thread->state.running) {
+                /* Thread is running, try to wait upon it. */
+                thread_wait(thread, true);
+                if (thread->state.signo == SIGSEGV)
+                    thread->state.signo = 0;
+            }
+            
+            if (!thread->state.running && !thread_is_stable(thread)) {
+                /* Stopped elsewhere (e.g. after a single step), let it run. */
+                thread_continue(thread, 0);
+            }
+            
+            if (thread->state.running) {
+                /* Still running? */
+                ++still_running;
+            }
+        }
+        
+        if (still_running)
+            wait_any(STABILIZE_WAIT_TIMEOUT);
+            
+    } while (still_running > 0);
+    
+    /* All threads are now stable.  Revert protection flags. */
+    segment_set_exacutable_all(process, true);
+}
+
 /* Stabilize a stopped process. */
 void process_stabilize(process_t * process) {
     assert(process_is_stopped(process));
     assert(!process->stabilizing);
     
     tree_t unstable = NULL;
+    bool stable = true;
     
     process_find_unstable(process, &unstable);
     
@@ -343,39 +486,17 @@ void process_stabilize(process_t * process) {
             tree_size(&unstable),
             tree_size(&unstable) == 1 ? "" : "s");
             
-    /* Make all natural segments execution-protected. */
-    segment_set_exacutable_all(process, false);
-    
     process->stabilizing = true;
     
-    /* Continue the unstable threads. */
     TREE_ITER(&unstable, node) {
         thread_t * thread = node->val;
-        thread_continue(thread, 0);
+        stable = process_stabilize_step(thread) && stable;
     }
     
-    int still_running;
-    do {
-        /* Relinquish the CPU to raise the chance of a context switch to the traced processes. */
-        sched_yield();
-        
-        still_running = 0;
-        TREE_ITER(&unstable, node) {
-            thread_t * thread = node->val;
-            
-            if (thread->state.running) {
-                /* Thread is running, try to wait upon it. */
-                thread_wait(thread, true);
-                if (thread->state.signo == SIGSEGV)
-                    thread->state.signo = 0;
-            }
-            
-            if (thread->state.running) {
-                /* Still running? */
-                ++still_running;
-            }
-        }
-    } while (still_running > 0);
+    if (!stable) {
+        /* Single-stepping is not supported or some threads take long to leave the artificial regions. */
+        process_stabilize_protected(process, &unstable);
+    }
     
     /* Release the threads and the tree. */
     thread_t * thread;
@@ -385,11 +506,7 @@ void process_stabilize(process_t * process) {
     process->stabilizing = false;
     verbose("Stabilization of process %s completed.", str_process(process));
     
-    /* All threads are now stable.  Revert protection flags. */
-    segment_set_exacutable_all(process, true);
-    
     process_find_unstable(process, &unstable);
     assert(tree_empty(&unstable));
     
 }
-
@@ -16,6 +16,11 @@ typedef struct process_t {
     tree_t segments;
     tree_t injections;  /* (injectable_t *) -> (address_t) */
     tree_t jumps;
+    tree_t artificial;  /* (address_t) -> (artificial_t *), see artificial.h */
+    tree_t arenas;      /* (address_t) -> (arena_t *), see tracepoint/arena.c */
+    
+    /* Tracepoint slot area or NULL, see tracepoint/slot.c */
+    struct slot_area_t * slots;
     
     /* Address of linker breakpoint (if installed). */
     struct {
@@ -26,10 +31,16 @@ typedef struct process_t {
     
     refcnt_t references;
     
+    /* Cached /proc/.../mem file descriptor or -1 (see procfs_mem_close). */
+    int memfd;
+    
     bool mode32;        /* 32-bit execution mode? */
 
     bool stabilizing;   /* are we currently stabilizing threads of the process? */
     bool spawned;       /* was the process spawned by us? */
+    bool seized;        /* were the threads attached with PTRACE_SEIZE? */
+    
+    unsigned int held;  /* number of holds keeping the process stopped, see process_hold */
     
 } process_t;
 
@@ -46,6 +57,9 @@ void process_cleanup();
 void process_continue(process_t * process);
 void process_stop(process_t * process);
 
+void process_hold(process_t * process);
+void process_unhold(process_t * process);
+
 void process_continue_all();
 void process_stop_all();
 
@@ -71,5 +85,7 @@ void process_stabilize(process_t * process);
 
 void process_attach_injectable(process_t * process, const injectable_t * injectable);
 void process_detach_injectable(process_t * process, const injectable_t * injectable);
+void process_reinstall_injectable(process_t * process, const injectable_t * injectable);
+bool process_toggle_injectable(process_t * process, const injectable_t * injectable);
 
 #endif
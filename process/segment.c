@@ -2,6 +2,7 @@
 
 #include "segment.h"
 #include "process.h"
+#include "artificial.h"
 #include "thread.h"
 #include "list.h"
 
@@ -11,6 +12,9 @@
 #include "injection/inject.h"
 #include "tracepoint/patch.h"
 #include "tracepoint/tracepoint.h"
+#include "tracepoint/arena.h"
+#include "tracepoint/slot.h"
+#include "communication/event.h"
 
 static void segment_release_injection(segment_t * segment) {
     assert(tree_empty(&segment->tracepoints));
@@ -23,6 +27,8 @@ static void segment_release_injection(segment_t * segment) {
 
 static void segment_free(segment_t * segment) {
     assert(tree_empty(&segment->tracepoints));
+    assert(tree_empty(&segment->trampoline_tracepoints));
+    assert(tree_empty(&segment->veneers));
     assert(!segment->trampolines);
     tree_remove(&segment->process->segments, segment->start);
     segment_release_injection(segment);
@@ -41,10 +47,11 @@ static segment_t * segment_clone(process_t * process, const segment_t * segment)
     clone->state = SEGMENT_STATE_NEW;
     
     clone->tracepoints = NULL;
+    clone->trampoline_tracepoints = NULL;
+    clone->veneers = NULL;
     clone->injection = NULL;
     clone->trampolines = 0;
     clone->trampolines_size = 0;
-    clone->trampoline_stolen = false;
     
     tree_insert(&process->segments, clone->start, clone);
     return clone;
@@ -283,6 +290,9 @@ void segment_rescan(thread_t * thread) {
             switch (segment->state) {
                 case SEGMENT_STATE_NEW:
                     //debug("Segment created in process %d: %s", thread->process->pid, str_segment(segment));
+                    if (segment->filename)
+                        event_post(EVENT_SEGMENT, thread->process->pid, thread->pid, segment->start,
+                                   segment->filename);
                     injections_init(thread, segment);
                     tracepoints_init(thread, segment);
                     segment->state = SEGMENT_STATE_OLD;
@@ -310,6 +320,8 @@ void segment_rescan(thread_t * thread) {
 /* Clone all memory information of process src to process dst. This function
  * can only be called after src has forked and created dst. */
 void segment_fork(process_t * child, process_t * parent) {
+    arenas_fork(child, parent);
+    slots_fork(child, parent);
     TREE_ITER(&parent->segments, node) {
         segment_t * segment = node->val;
         segment_t * clone = segment_clone(child, segment);
@@ -324,6 +336,8 @@ void segment_reset(process_t * process) {
         tracepoints_reset(segment);
         segment_free(segment);
     }
+    arenas_reset(process);
+    slots_reset(process);
 }
 
 void segment_detach(thread_t * thread) {
@@ -332,6 +346,8 @@ void segment_detach(thread_t * thread) {
         tracepoints_detach(thread, segment);
         segment_free(segment);
     }
+    arenas_detach(thread);
+    slots_detach(thread);
 }
 
 /* Remove references to the injection, which matches the given injectable.  This includes removing installed tracepoints
@@ -368,19 +384,40 @@ void segment_attach_injectable(thread_t * thread, const injectable_t * injectabl
     }
 }
 
-/* Return segment with a trampoline segment containing the given address. */
-const segment_t * segment_get_by_trampoline(const process_t * process, address_t address) {
-    TREE_ITER(&process->segments, node) {
-        const segment_t * segment = node->val;
-        if (segment->trampolines) {
-            /* Segment has trampolines -- get address range. */
-            address_t low = segment->trampolines;
-            address_t high = low + segment->trampolines_size;
-            if ((low <= address) && (address < high))
-                return segment;
+/* Reinstall tracepoints of the given injectable in the thread's process, e.g. after their options have changed. */
+void segment_reinstall_injectable(thread_t * thread, const injectable_t * injectable) {
+    TREE_ITER(&thread->process->segments, node) {
+        segment_t * segment = node->val;
+        if (!segment->injection || (segment->injection->injectable != injectable)) {
+            /* Segment has a different injectable assigned. */
+            continue;
         }
+        tracepoints_detach(thread, segment);
+        tracepoints_init(thread, segment);
     }
-    return NULL;
+}
+
+/* Enable or disable tracepoints of the given injectable in the thread's process according to their options.  Return
+ * false if tracepoints of some segment could not be toggled. */
+bool segment_toggle_injectable(thread_t * thread, const injectable_t * injectable) {
+    bool ret = true;
+    TREE_ITER(&thread->process->segments, node) {
+        segment_t * segment = node->val;
+        if (!segment->injection || (segment->injection->injectable != injectable)) {
+            /* Segment has a different injectable assigned. */
+            continue;
+        }
+        ret = tracepoints_toggle(thread, segment) && ret;
+    }
+    return ret;
+}
+
+/* Return segment with a trampoline segment containing the given address. */
+const segment_t * segment_get_by_trampoline(const process_t * process, address_t address) {
+    const artificial_t * artificial = artificial_get(process, address);
+    if (!artificial)
+        return NULL;
+    return artificial->arena ? arena_get_segment(artificial->arena, address) : artificial->segment;
 }
 
 /**********************************************************************************************************************/
@@ -394,7 +431,8 @@ bool address_is_injection(const process_t * process, address_t address) {
 }
 
 bool address_is_artificial(const process_t * process, address_t address) {
-    return address_is_injection(process, address) || address_is_trampoline(process, address);
+    /* Both trampolines and injections are kept in the same index. */
+    return artificial_get(process, address) != NULL;
 }
 
 /**********************************************************************************************************************/
@@ -37,10 +37,15 @@ typedef struct segment_t {
     /* tree mapping addresses to tracepoints */
     tree_t tracepoints;
     
-    /* address of the trampoline segment */
+    /* address of the trampolines (allocated from an arena, see tracepoint/arena.c) */
     address_t trampolines;
     size_t trampolines_size;
-    bool trampoline_stolen;
+    
+    /* tree mapping trampoline addresses to tracepoints */
+    tree_t trampoline_tracepoints;
+    
+    /* tree mapping addresses of veneer pages to veneer_page_t structures (see tracepoint/veneer.c) */
+    tree_t veneers;
     
 } segment_t;
 
@@ -84,6 +89,8 @@ bool address_is_artificial(const process_t * process, address_t address);
 void segment_attach_injectable(struct thread_t * thread, const struct injectable_t * injectable);
 struct injection_t * segment_detach_injectable(struct thread_t * thread,
         const struct injectable_t * injectable);
+void segment_reinstall_injectable(struct thread_t * thread, const struct injectable_t * injectable);
+bool segment_toggle_injectable(struct thread_t * thread, const struct injectable_t * injectable);
 
 bool segment_set_exacutable_all(process_t * process, bool executable);
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <linux/elf.h>
@@ -13,15 +14,19 @@
 #include "spawn.h"
 
 #include "procutil/tgkill.h"
+#include "procutil/wait.h"
 
 #include "tree.h"
 #include "segment.h"
 #include "linker.h"
 #include "procutil/procfs.h"
 #include "injection/injection.h"
+#include "communication/event.h"
 
 #define ADBI_PTRACE_OPTINS (PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC)
 
+latency_t thread_latency;
+
 static void thread_init_options(thread_t * thread) {
     if (unlikely(ptrace(PTRACE_SETOPTIONS, thread->pid, NULL, (void *) ADBI_PTRACE_OPTINS) == -1))
         adbi_bug("Error setting ptrace options for %d: %s", thread->pid, strerror(errno));
@@ -66,8 +71,14 @@ thread_t * thread_create(process_t * process, pid_t pid) {
     thread->state.stopme = false;
     thread->state.slavemode = false;
     thread->state.dead = false;
+    thread->state.groupstop = false;
+    thread->state.stepping = false;
+    
+    thread->regs.valid = false;
+    thread->regs.dirty = false;
     
     thread->notified = true;
+    thread->stopped = 0;
 
     thread->state.signo = 0;
     
@@ -96,7 +107,19 @@ void thread_free(thread_t * thread) {
 }
 
 thread_t * thread_attach(process_t * process, pid_t tid) {
-    if (!ptrace_attach(process->pid, tid))
+    bool groupstop = false;
+    bool attached;
+    
+    if (process->seized) {
+        attached = ptrace_seize(process->pid, tid, &groupstop);
+        /* ptrace_seize falls back to ptrace_attach on old kernels, this happens on the very first thread. */
+        assert(ptrace_seize_mode || tree_empty(&process->threads));
+        process->seized = ptrace_seize_mode;
+    } else {
+        attached = ptrace_attach(process->pid, tid);
+    }
+    
+    if (!attached)
         return NULL;
         
     /* attached */
@@ -108,13 +131,19 @@ thread_t * thread_attach(process_t * process, pid_t tid) {
         }
         return NULL;
     }
-    return thread_create(process, tid);
+    
+    thread_t * thread = thread_create(process, tid);
+    thread->state.groupstop = groupstop;
+    return thread;
 }
 
 /* Detach the given thread. The thread must be stopped. The pointer becomes invalid after this call. */
 void thread_detach(thread_t * thread) {
     assert(!thread->state.running);
     
+    if (unlikely(!thread_flush_regs(thread)))
+        return;
+        
     if (likely(ptrace(PTRACE_DETACH, thread->pid, 0, NULL) != -1)) {
         verbose("Detached %s.", str_thread(thread));
         thread_del(thread);
@@ -140,11 +169,21 @@ void thread_kill(thread_t * thread) {
 }
 
 void thread_exit(thread_t * thread) {
+    process_t * process = thread->process;
+    
     if (spawn_is_spawned(thread->pid))
         spawn_died(thread->pid);
     thread->state.running = false;
     thread->state.dead = true;
     thread_del(thread);
+    
+    /* The caller still holds a reference to the thread, so the process is still valid. */
+    event_post(EVENT_THREAD_EXIT, process->pid, thread->pid, 0, NULL);
+    if (tree_empty(&process->threads)) {
+        /* The address space is gone, there's no need to keep the memory file open until the process is freed. */
+        procfs_mem_close(process);
+        event_post(EVENT_EXIT, process->pid, thread->pid, 0, NULL);
+    }
 }
 
 /* Set ptrace options of the given process and enable tracing of clone, fork and exec calls. */
@@ -155,6 +194,9 @@ void thread_exec(thread_t * thread) {
     
     thread_init_options(thread);
     
+    /* The cached memory file refers to the old address space. */
+    procfs_mem_close(process);
+    
     /* Clear all threads except for the calling thread */
     {
         void callback(thread_t * other) {
@@ -184,6 +226,9 @@ void thread_exec(thread_t * thread) {
     /* ...so the linker breakpoint may need to be reinserted. */
     linker_reset(thread);
     
+    if (event_wanted(EVENT_EXEC))
+        event_post(EVENT_EXEC, process->pid, thread->pid, 0, procfs_get_exe(process->pid, thread->pid));
+    
     thread_continue_or_stop(thread, 0);
 }
 
@@ -199,6 +244,9 @@ void thread_continue(thread_t * thread, int signo) {
         thread->state.setoptions = false;
     }
 
+    if (unlikely(!thread_flush_regs(thread)))
+        return;
+        
     if (likely(!signo)) {
         signo = thread->state.signo;
         thread->state.signo = 0;
@@ -210,14 +258,61 @@ void thread_continue(thread_t * thread, int signo) {
         //debug("Resuming %s.", str_thread(thread));
     }
     
-    if (likely(ptrace(PTRACE_CONT, thread->pid, 0, (void *)(intptr_t) signo)) != -1) {
+    /* A thread in group-stop is restarted with PTRACE_LISTEN, so it stays stopped until it receives SIGCONT, unless
+     * we need it to run (to deliver a signal or to do a remote call). */
+    int request = (thread->state.groupstop && !signo && !thread->state.slavemode) ? PTRACE_LISTEN : PTRACE_CONT;
+    
+    if (likely(ptrace(request, thread->pid, 0, (void *)(intptr_t) signo)) != -1) {
         thread->state.running = true;
+        thread->state.stepping = false;
+        if (thread->stopped) {
+            latency_record(&thread_latency, latency_clock() - thread->stopped);
+            thread->stopped = 0;
+        }
     } else {
         thread_handle_ptrace_error(thread, "continuing", errno);
     }
     
 }
 
+/* Execute a single instruction of the stopped thread and wait up to timeout milliseconds until it stops again.  Return
+ * true if the thread is stopped afterwards.  If the thread received a signal instead, the status is handled as usual.
+ * If the thread didn't stop in time (e.g. it's blocked in a system call), it keeps running; the step completion is
+ * recognized later by thread_wait.  Return false if single-stepping is not supported. */
+bool thread_step(thread_t * thread, int timeout) {
+    assert(!thread->state.running);
+    
+    if (unlikely(thread->state.dead || !thread_flush_regs(thread)))
+        return false;
+        
+    if (ptrace(PTRACE_SINGLESTEP, thread->pid, 0, 0) == -1) {
+        if (errno == ESRCH)
+            thread_handle_ptrace_error(thread, "single-stepping", errno);
+        else
+            debug("Error single-stepping %s: %s.", str_thread(thread), strerror(errno));
+        return false;
+    }
+    
+    thread->state.running = true;
+    thread->state.stepping = true;
+    
+    uint64_t deadline = latency_clock() + (uint64_t) timeout * 1000;
+    
+    while (1) {
+        thread_wait(thread, true);
+        if (!thread->state.running || !thread->state.stepping)
+            break;
+            
+        uint64_t now = latency_clock();
+        if ((now >= deadline) || !wait_any((deadline - now + 999) / 1000)) {
+            debug("Thread %s did not complete a single step in %d ms.", str_thread(thread), timeout);
+            break;
+        }
+    }
+    
+    return !thread->state.running && !thread->state.dead;
+}
+
 void thread_continue_or_stop(thread_t * thread, int signo) {
 
     if (unlikely(thread->state.dead || thread->state.running))
@@ -228,7 +323,9 @@ void thread_continue_or_stop(thread_t * thread, int signo) {
         if (thread->state.slavemode) {
             thread->state.signo = signo;
         } else {
-            thread->state.signo = signo == SIGSTOP ? 0 : signo;
+            /* Drop the SIGSTOP sent by thread_stop.  Seized threads are interrupted without a signal, so a SIGSTOP
+             * comes from someone else and must be delivered. */
+            thread->state.signo = ((signo == SIGSTOP) && !thread->process->seized) ? 0 : signo;
         }
         if (thread->state.stopme)
             thread->state.stopme = false;
@@ -242,42 +339,92 @@ void thread_continue_or_stop(thread_t * thread, int signo) {
     
 }
 
-/* Stop the given thread.  This has no effect if the thread is already stopped or dead.  Moreover, the thread might die
- * during stopping (e.g. when it crashes before SIGSTOP is delivered). */
-void thread_stop(thread_t * thread) {
-    if (thread->state.dead || !thread->state.running)
+/* Request the given thread to stop, without waiting for it.  Seized threads are interrupted with PTRACE_INTERRUPT,
+ * others get a SIGSTOP.  This has no effect if the thread is already stopped, dead or requested to stop. */
+void thread_stop_request(thread_t * thread) {
+    if (thread->state.dead || !thread->state.running || thread->state.stopme)
         return;
         
     thread->state.stopme = true;
-    thread_signal(thread, SIGSTOP);
+    
+    if (thread->process->seized) {
+        debug("Interrupting %s.", str_thread(thread));
+        if (ptrace(PTRACE_INTERRUPT, thread->pid, 0, 0) == -1)
+            thread_handle_ptrace_error(thread, "interrupting", errno);
+    } else {
+        thread_signal(thread, SIGSTOP);
+    }
+}
+
+/* Wait until a thread requested to stop is stopped.  The thread might die instead (e.g. when it crashes before the
+ * stop request is delivered). */
+void thread_stop_wait(thread_t * thread) {
+    if (thread->state.dead || !thread->state.running)
+        return;
+        
+    /* The thread may have been created after the stop requests were sent. */
+    thread_stop_request(thread);
     
     thread_wait(thread, false);
     assert(!thread->state.running);
-    
 }
 
+/* Stop the given thread.  This has no effect if the thread is already stopped or dead. */
+void thread_stop(thread_t * thread) {
+    thread_stop_request(thread);
+    thread_stop_wait(thread);
+}
 
+
+/* Read registers of the stopped thread.  Registers are read from the thread only once per stop, further calls return
+ * the cached values (including changes made by thread_set_regs).  Return false if the thread died. */
 bool thread_get_regs(thread_t * thread, pt_regs * regs) {
     assert(!thread->state.running);
+    
+    if (!thread->regs.valid) {
 #ifndef PTRACE_GETREGS
-    struct iovec iov = { regs, sizeof(*regs) };
-    if (unlikely(ptrace(PTRACE_GETREGSET, thread->pid, NT_PRSTATUS, &iov))) {
+        struct iovec iov = { &thread->regs.values, sizeof(thread->regs.values) };
+        if (unlikely(ptrace(PTRACE_GETREGSET, thread->pid, NT_PRSTATUS, &iov))) {
 #else
-    if (unlikely(ptrace(PTRACE_GETREGS, thread->pid, NULL, regs))) {
+        if (unlikely(ptrace(PTRACE_GETREGS, thread->pid, NULL, &thread->regs.values))) {
 #endif
-        thread_handle_ptrace_error(thread, "reading registers of", errno);
-        return false;
+            thread_handle_ptrace_error(thread, "reading registers of", errno);
+            return false;
+        }
+        thread->regs.valid = true;
     }
+    
+    *regs = thread->regs.values;
     return true;
 }
 
+/* Change registers of the stopped thread.  The registers are only cached, they are written to the thread when it's
+ * continued or detached (see thread_flush_regs). */
 bool thread_set_regs(thread_t * thread, pt_regs * regs) {
     assert(!thread->state.running);
+    
+    thread->regs.values = *regs;
+    thread->regs.valid = true;
+    thread->regs.dirty = true;
+    return true;
+}
+
+/* Write changed registers to the thread and drop the cache.  This must be done before the thread leaves the stop.
+ * Return false if the thread died. */
+bool thread_flush_regs(thread_t * thread) {
+    bool dirty = thread->regs.dirty;
+    
+    thread->regs.valid = false;
+    thread->regs.dirty = false;
+    
+    if (likely(!dirty) || thread->state.dead)
+        return true;
+        
 #ifndef PTRACE_SETREGS
-    struct iovec iov = { regs, sizeof(*regs) };
+    struct iovec iov = { &thread->regs.values, sizeof(thread->regs.values) };
     if (unlikely(ptrace(PTRACE_SETREGSET, thread->pid, NT_PRSTATUS, &iov))) {
 #else
-    if (unlikely(ptrace(PTRACE_SETREGS, thread->pid, NULL, regs))) {
+    if (unlikely(ptrace(PTRACE_SETREGS, thread->pid, NULL, &thread->regs.values))) {
 #endif
         thread_handle_ptrace_error(thread, "setting registers of", errno);
         return false;
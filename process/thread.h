@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include "tree.h"
 #include "procutil/ptrace.h"
+#include "util/latency.h"
 
 struct process_t;
 typedef struct process_t process_t;
@@ -20,14 +21,28 @@ typedef struct thread_t {
         int signo;          /* signal to be deliver on next continue */
         bool setoptions;    /* do we need to set ptrace options? */
         bool dead;          /* is the thread dead? */
+        bool groupstop;     /* is the thread in group-stop? (seized threads only, see thread_continue) */
+        bool stepping;      /* is the thread single-stepping? (see thread_step) */
     } state;
 
+    /* Registers cached while the thread is stopped (see thread_get_regs). */
+    struct {
+        pt_regs values;
+        bool valid;         /* were the registers read since the last stop? */
+        bool dirty;         /* were the registers changed, but not written to the thread yet? */
+    } regs;
+
     bool notified;      /* was new thread handlers triggered? */
     
+    uint64_t stopped;   /* time when the stop was collected by wait_main (see thread_latency), 0 if not measured */
+    
     refcnt_t references;
     
 } thread_t;
 
+/* Time between collecting a stop of a thread in wait_main and resuming it. */
+extern latency_t thread_latency;
+
 bool thread_is_mode32(thread_t * thread);
 
 thread_t * thread_create(process_t * process, pid_t pid);
@@ -35,7 +50,10 @@ void thread_free(thread_t * thread);
 
 void thread_continue(thread_t * thread, int signo);
 void thread_continue_or_stop(thread_t * thread, int signo);
+bool thread_step(thread_t * thread, int timeout);
 void thread_stop(thread_t * thread);
+void thread_stop_request(thread_t * thread);
+void thread_stop_wait(thread_t * thread);
 
 thread_t * thread_attach(process_t * process, pid_t pid);
 void thread_detach(thread_t * thread);
@@ -43,10 +61,11 @@ void thread_kill(thread_t * thread);
 
 void thread_exec(thread_t * thread);
 void thread_exit(thread_t * thread);
-bool thread_trap(thread_t * thread);
+bool thread_trap(thread_t * thread, bool jump_only);
 
 bool thread_get_regs(thread_t * thread, pt_regs * regs);
 bool thread_set_regs(thread_t * thread, pt_regs * regs);
+bool thread_flush_regs(thread_t * thread);
 
 void thread_wait(thread_t * thread, bool nohang);
 
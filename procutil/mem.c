@@ -9,6 +9,17 @@
 #include "mem.h"
 
 #include <sys/param.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Maximum number of remote iovecs passed to a single process_vm_readv or process_vm_writev call. */
+#define MEM_IOV_MAX 256
+
+/* Amount of data compared at once when verifying writes. */
+#define MEM_VERIFY_CHUNK 4096
 
 /* Mask a value into an word-aligned memory cell of the given process. The
  * function reads the original data at the given address and replaces the
@@ -113,10 +124,10 @@ out:
  * match, false on error or missmatch. */
 static bool mem_verify(thread_t * thread, address_t address, size_t size, const void * data) {
 
-    char contents[32];
+    char contents[MEM_VERIFY_CHUNK];
 
     while (size) {
-        size_t s = MIN(32, size);
+        size_t s = MIN(MEM_VERIFY_CHUNK, size);
         if (mem_read(thread, address, s, contents) != s)
             return false;
 
@@ -131,14 +142,118 @@ static bool mem_verify(thread_t * thread, address_t address, size_t size, const
     return true;
 }
 
+/* Copy bytes to inferior process using ptrace, one (masked) word at a time.  This is slow, so it's used only if the
+ * other methods fail.  The written data is verified.
+ *
+ * Returns amount of bytes written.
+ */
+static size_t mem_write_words(thread_t * thread, address_t address, size_t size, const void * data) {
+    size_t written;
+    
+    /* Aligned start address. */
+    address_t first_word_address = address & ~0x03;
+    
+    /* End address. */
+    address_t end = address + size;
+    
+    /* Start and end offsets from aligned start. */
+    address_t start_offset  = address - first_word_address;
+    address_t end_offset    = end - first_word_address;
+    
+    /* Convert to char ptr for pointer arithmetic. */
+    char * data_char = (char *) data;
+    /* Shift the source pointer as well. */
+    data_char -= start_offset;
+    
+    written = mem_write_shift(thread, first_word_address, data_char, start_offset, end_offset);
+    
+    /* Verify written data. */
+    assert(mem_verify(thread, address, written, data) || thread->state.dead);
+    
+    return written;
+}
+
+/* Transfer count bytes between the local buffer and memory of the given process using process_vm_readv or
+ * process_vm_writev.  The remote range is split at page boundaries, so if the range crosses into an inaccessible page,
+ * all data up to that page is still transferred.  Large transfers require only a few system calls.
+ *
+ * Returns amount of bytes transferred.  Sets *nosys if the system call is not available.
+ */
+static size_t mem_vm_transfer(process_t * process, address_t address, size_t count, void * data, bool write,
+                              bool * nosys) {
+    static size_t page_size = 0;
+    
+    size_t done = 0;
+    
+    if (unlikely(!page_size))
+        page_size = sysconf(_SC_PAGE_SIZE);
+        
+    while (done < count) {
+        struct iovec local;
+        struct iovec remote[MEM_IOV_MAX];
+        unsigned int iovcnt = 0;
+        address_t next = address + done;
+        size_t batch = 0;
+        
+        while ((iovcnt < MEM_IOV_MAX) && (done + batch < count)) {
+            size_t size = MIN(count - done - batch, page_size - (next & (page_size - 1)));
+            remote[iovcnt].iov_base = (void *) next;
+            remote[iovcnt].iov_len = size;
+            ++iovcnt;
+            next += size;
+            batch += size;
+        }
+        
+        local.iov_base = (char *) data + done;
+        local.iov_len = batch;
+        
+        ssize_t res = syscall(write ? SYS_process_vm_writev : SYS_process_vm_readv, process->pid, &local, 1,
+                              remote, iovcnt, 0);
+                              
+        if (res < 0) {
+            if (errno == ENOSYS) {
+                *nosys = true;
+            } else {
+                debug("Error %s %zu bytes %s %s at %p: %s.", write ? "writing" : "reading", batch,
+                      write ? "to" : "from", str_process(process), (void *) (address + done), strerror(errno));
+            }
+            return done;
+        }
+        
+        done += res;
+        
+        if ((size_t) res < batch) {
+            /* Partial transfer, the next page is not accessible. */
+            return done;
+        }
+    }
+    
+    return done;
+}
+
+/* Return true if the given range can be written using process_vm_writev.  This is the case only for known writable
+ * data segments.  process_vm_writev fails on read-only pages and, unlike writes through ptrace or /proc/.../mem, it
+ * doesn't keep the instruction cache coherent, so it must not be used for code. */
+static bool mem_write_vm_allowed(process_t * process, address_t address, size_t size) {
+    const segment_t * segment = segment_get(process, address);
+    
+    return segment && segment_is_writeable(segment) && !segment_is_executable(segment) &&
+           (address + size <= segment->end);
+}
+
 /* High level inferior memory access function. Copies size bytes starting at
  * data to the given process memory space. The function has no restrictions on
  * address or size alignment.
  *
+ * The data is written in bulk: using process_vm_writev for writable data and through /proc/.../mem otherwise (this
+ * works for read-only code as well).  Writing word by word using ptrace is used only as a fallback.
+ *
  * Returns amount of bytes copied.
  */
 size_t mem_write(thread_t * thread, address_t address, size_t size, void * data) {
 
+    static bool use_vm_writev = true;
+    
     size_t written = 0;
     
     assert(thread);
@@ -146,29 +261,25 @@ size_t mem_write(thread_t * thread, address_t address, size_t size, void * data)
     if (unlikely(thread->state.dead))
         return 0;
         
-    /* The other functions assume that at least 1 byte is written. */
-    
-    if (likely(size)) {
-    
-        /* Aligned start address. */
-        address_t first_word_address = address & ~0x03;
-        
-        /* End address. */
-        address_t end = address + size;
-        
-        /* Start and end offsets from aligned start. */
-        address_t start_offset  = address - first_word_address;
-        address_t end_offset    = end - first_word_address;
-        
-        /* Convert to char ptr for pointer arithmetic. */
-        char * data_char = (char *) data;
-        /* Shift the source pointer as well. */
-        data_char -= start_offset;
+    if (unlikely(!size))
+        return 0;
         
-        written = mem_write_shift(thread, first_word_address, data_char, start_offset, end_offset);
+    if (likely(use_vm_writev) && mem_write_vm_allowed(thread->process, address, size)) {
+        bool nosys = false;
+        written = mem_vm_transfer(thread->process, address, size, data, true, &nosys);
+        if (nosys) {
+            warning("The process_vm_writev system call is not available, falling back to procfs.");
+            use_vm_writev = false;
+        }
+    }
+    
+    if (written < size)
+        written += procfs_mem_write(thread, address + written, size - written, (char *) data + written);
         
-        /* Verify written data. */
-        assert(mem_verify(thread, address, written, data) || thread->state.dead);
+    if (written < size) {
+        debug("Bulk write of %zu bytes to %s at %p failed, using ptrace.", size - written, str_thread(thread),
+              (void *) (address + written));
+        written += mem_write_words(thread, address + written, size - written, (char *) data + written);
     }
     
     if (written < size)
@@ -197,3 +308,54 @@ size_t mem_read(thread_t * thread, address_t address, size_t count, void * data)
         
     return read;
 }
+
+/* Read memory of a process, which does not need to be stopped.  Copies count bytes starting at address in the given
+ * process memory space to data.  The function uses process_vm_readv, so large reads require only a few system calls.
+ * The remote range is split at page boundaries, so if the range crosses into an unmapped page, all data up to that
+ * page is still copied.  On kernels without process_vm_readv, the function falls back to /proc/.../mem.
+ *
+ * Returns amount of bytes copied.
+ */
+size_t mem_read_process(process_t * process, address_t address, size_t count, void * data) {
+    static bool use_vm_readv = true;
+    
+    size_t done = 0;
+    
+    if (likely(use_vm_readv)) {
+        bool nosys = false;
+        done = mem_vm_transfer(process, address, count, data, false, &nosys);
+        if (nosys) {
+            warning("The process_vm_readv system call is not available, falling back to procfs.");
+            use_vm_readv = false;
+        } else {
+            return done;
+        }
+    }
+    
+    return done + procfs_process_mem_read(process, address + done, count - done, (char *) data + done);
+}
+
+/* Write memory of a process, which does not need to be stopped.  Copies count bytes starting at data to the given
+ * process memory space.  The function uses process_vm_writev (falling back to /proc/.../mem), so it must be used only
+ * for writable data mappings, never for code.
+ *
+ * Returns amount of bytes copied.
+ */
+size_t mem_write_process(process_t * process, address_t address, size_t count, void * data) {
+    static bool use_vm_writev = true;
+    
+    size_t done = 0;
+    
+    if (likely(use_vm_writev)) {
+        bool nosys = false;
+        done = mem_vm_transfer(process, address, count, data, true, &nosys);
+        if (nosys) {
+            warning("The process_vm_writev system call is not available, falling back to procfs.");
+            use_vm_writev = false;
+        } else {
+            return done;
+        }
+    }
+    
+    return done + procfs_process_mem_write(process, address + done, count - done, (char *) data + done);
+}
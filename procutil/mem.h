@@ -4,8 +4,11 @@
 #include <sys/types.h>  /* for size_t */
 
 typedef struct thread_t thread_t;
+typedef struct process_t process_t;
 
 size_t mem_write(thread_t * thread, address_t address, size_t size, void * data);
 size_t mem_read(thread_t * thread, address_t address, size_t count, void * data);
+size_t mem_read_process(process_t * process, address_t address, size_t count, void * data);
+size_t mem_write_process(process_t * process, address_t address, size_t count, void * data);
 
 #endif
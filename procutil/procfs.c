@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "process/process.h"
 #include "process/thread.h"
@@ -261,35 +262,114 @@ bool procfs_address_executable(const thread_t * thread, address_t address) {
 
 /**********************************************************************************************************************/
 
-/* Read at most size bytes from the memory of the given thread using the /proc/.../mem entry starting at the given
- * address.  Write results to out. Out must be large enough to hold size bytes. Return bytes written (which is size
- * or less). */
-size_t procfs_mem_read(thread_t * thread, address_t offset, size_t size, void * out) {
+/* Memory of traced processes is accessed through /proc/.../mem.  The file is opened once per process and the
+ * descriptor is kept in process->memfd, so that each access costs a single pread64 or pwrite64 call.  The descriptor
+ * refers to the address space of the process at the time of opening, so it must be closed on exec (see
+ * procfs_mem_close).  It stays valid as long as any thread of the process is alive. */
 
+/* Return the cached /proc/.../mem descriptor of the process of the given thread.  Open it if necessary.  Return -1 on
+ * error. */
+static int procfs_mem_fd(const thread_t * thread) {
+    process_t * process = thread->process;
+    
+    if (likely(process->memfd >= 0))
+        return process->memfd;
+        
     const char * path = procfs_thread_get_path(thread, "mem");
-    int fd = -1;
-    ssize_t count = 0;
     
-    if ((fd = open64(path, O_RDONLY)) == -1) {
-        error("Error opening %s.", path);
-        goto out;
+    /* Writing requires a kernel which allows writes to /proc/.../mem of traced processes.  If it doesn't, the file is
+     * still useful for reading. */
+    process->memfd = open64(path, O_RDWR | O_CLOEXEC);
+    if (process->memfd < 0)
+        process->memfd = open64(path, O_RDONLY | O_CLOEXEC);
+        
+    if (process->memfd < 0)
+        error("Error opening %s: %s.", path, strerror(errno));
+        
+    return process->memfd;
+}
+
+/* Close the cached /proc/.../mem descriptor of the process (if open).  This must be called when the process execs. */
+void procfs_mem_close(process_t * process) {
+    if (process->memfd >= 0) {
+        close(process->memfd);
+        process->memfd = -1;
     }
+}
+
+/* Transfer size bytes between the memory of the given thread's process at the given address and the buffer.  Return
+ * bytes transferred (which is size or less).  If quiet is set, short transfers are not reported as errors. */
+static size_t procfs_mem_rw(const thread_t * thread, address_t offset, size_t size, void * buf, bool write,
+                            bool quiet) {
+    size_t done = 0;
+    bool retried = false;
     
-    if (lseek64(fd, (off64_t) offset, SEEK_SET) == -1) {
-        error("Error seeking through %s.", path);
-        goto out;
+    while (done < size) {
+        int fd = procfs_mem_fd(thread);
+        ssize_t count;
+        
+        if (fd < 0)
+            break;
+            
+        if (write)
+            count = pwrite64(fd, (char *) buf + done, size - done, (off64_t)(offset + done));
+        else
+            count = pread64(fd, (char *) buf + done, size - done, (off64_t)(offset + done));
+            
+        if (count > 0) {
+            done += count;
+            continue;
+        }
+        
+        if ((count < 0) && (errno == EINTR))
+            continue;
+            
+        if ((count < 0) && !done && !retried && (errno != EIO) && (errno != EFAULT)) {
+            /* The descriptor may be stale (e.g. on older kernels, which bind it to the thread that opened it and
+             * that thread is gone).  Reopen and retry once. */
+            procfs_mem_close(thread->process);
+            retried = true;
+            continue;
+        }
+        
+        if (!quiet)
+            error("Error %s %zu bytes %s memory of %s at %lx: %s", write ? "writing" : "reading", size - done,
+                  write ? "to" : "from", str_thread(thread), offset + done, count ? strerror(errno) : "end of file");
+        break;
     }
     
-    count = read(fd, out, size);
-    
-    if (count != (ssize_t) size)
-        error("Error reading %zu bytes from %s at %lx: %s", size, path, offset, strerror(errno));
+    return done;
+}
 
-out:
-    if (fd >= 0)
-        close(fd);
-    if (count >= 0)
-        return (size_t) count;
-    else
+/* Read at most size bytes from the memory of the given thread using the /proc/.../mem entry starting at the given
+ * address.  Write results to out. Out must be large enough to hold size bytes. Return bytes written (which is size
+ * or less). */
+size_t procfs_mem_read(thread_t * thread, address_t offset, size_t size, void * out) {
+    return procfs_mem_rw(thread, offset, size, out, false, false);
+}
+
+/* Write at most size bytes to the memory of the given thread using the /proc/.../mem entry starting at the given
+ * address.  Unlike process_vm_writev, this works also for read-only mappings (e.g. code).  Return bytes written
+ * (which is size or less). */
+size_t procfs_mem_write(thread_t * thread, address_t offset, size_t size, const void * data) {
+    return procfs_mem_rw(thread, offset, size, (void *) data, true, true);
+}
+
+/* Read at most size bytes from the memory of the given process, like procfs_mem_read.  The process does not need to be
+ * stopped and short reads (e.g. at the end of a mapping) are not reported as errors. */
+size_t procfs_process_mem_read(process_t * process, address_t offset, size_t size, void * out) {
+    /* Any thread will do, they all share the address space. */
+    if (tree_empty(&process->threads))
         return 0;
+        
+    return procfs_mem_rw(tree_get_any_val(&process->threads), offset, size, out, false, true);
+}
+
+/* Write at most size bytes to the memory of the given process, like procfs_mem_write.  The process does not need to be
+ * stopped. */
+size_t procfs_process_mem_write(process_t * process, address_t offset, size_t size, const void * data) {
+    if (tree_empty(&process->threads))
+        return 0;
+        
+    return procfs_mem_rw(tree_get_any_val(&process->threads), offset, size, (void *) data, true, true);
 }
@@ -5,6 +5,7 @@
 
 typedef struct segment_t segment_t;
 typedef struct thread_t thread_t;
+typedef struct process_t process_t;
 
 pid_t procfs_get_tgid(pid_t pid);
 pid_t procfs_get_ppid(pid_t pid);
@@ -17,6 +18,10 @@ char procfs_pid_state(pid_t pid, pid_t tid);
 bool procfs_iter_segments(const thread_t * thread, void (fn)(const segment_t * segment));
 
 size_t procfs_mem_read(thread_t * thread, address_t offset, size_t size, void * out);
+size_t procfs_mem_write(thread_t * thread, address_t offset, size_t size, const void * data);
+size_t procfs_process_mem_read(process_t * process, address_t offset, size_t size, void * out);
+size_t procfs_process_mem_write(process_t * process, address_t offset, size_t size, const void * data);
+void procfs_mem_close(process_t * process);
 
 bool procfs_address_executable(const thread_t * thread, address_t address);
 
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
@@ -11,6 +12,10 @@
 
 #include "tgkill.h"
 
+/* Attach with PTRACE_SEIZE instead of PTRACE_ATTACH.  Threads of seized processes are stopped with PTRACE_INTERRUPT
+ * instead of SIGSTOP and group-stops are reported as such (see thread_handle_event_stop). */
+bool ptrace_seize_mode = true;
+
 /* Send a signal to a process. Send the signal without using ptrace. Return
  * non-zero on success. */
 bool ptrace_signal(pid_t pid, pid_t tid, int signo) {
@@ -125,6 +130,73 @@ bool ptrace_attach(pid_t tgid, pid_t pid) {
     adbi_bug_unrechable();
 }
 
+/* Seize a process (a single LWP) and interrupt it.  Block until it stops.  Unlike ptrace_attach, this does not send any
+ * signal, so a thread in group-stop stays in group-stop, which is reported in *groupstop.  Return true if the process
+ * is attached, false if not.  If the kernel doesn't support PTRACE_SEIZE, ptrace_seize_mode is cleared and the thread
+ * is attached with ptrace_attach. */
+bool ptrace_seize(pid_t tgid, pid_t pid, bool * groupstop) {
+
+    info("Seizing process %d...", pid);
+    
+    *groupstop = false;
+    
+    if (ptrace(PTRACE_SEIZE, pid, NULL, NULL) != 0) {
+        if (errno == ESRCH)
+            /* The process does not exist (anymore). */
+            return false;
+            
+        if (errno == EIO) {
+            /* Kernels older than 3.4 don't know the request. */
+            warning("PTRACE_SEIZE is not supported, falling back to PTRACE_ATTACH.");
+            ptrace_seize_mode = false;
+            return ptrace_attach(tgid, pid);
+        }
+        
+        adbi_bug("Error seizing process %d: %s.", pid, strerror(errno));
+    }
+    
+    if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) != 0) {
+        if (errno == ESRCH)
+            return false;
+        adbi_bug("Error interrupting process %d: %s.", pid, strerror(errno));
+    }
+    
+    while (1) {
+        int status;
+        pid_t res = waitpid(pid, &status, __WALL);
+        
+        if (res != pid) {
+            if (res < 0) {
+                adbi_bug("The waitpid function failed: %s.", strerror(errno));
+            } else {
+                adbi_bug("The waitpid function returned %d, but %d was expected.", res, pid);
+            }
+        }
+        
+        if (WIFSTOPPED(status)) {
+            int signo = WSTOPSIG(status);
+            
+            if ((status >> 16) == PTRACE_EVENT_STOP) {
+                /* Interrupted (SIGTRAP) or in group-stop (the stop signal). */
+                *groupstop = signo != SIGTRAP;
+                return true;
+            }
+            
+            /* A signal arrived before the interrupt.  Deliver it, the interrupt is still pending. */
+            verbose("Process %d received signal %s while seizing.", pid, strsignal(signo));
+            ptrace(PTRACE_CONT, pid, NULL, (void *)(intptr_t) signo);
+        } else if (WIFSIGNALED(status)) {
+            warning("Process %d was terminated by signal %s while seizing.", pid, strsignal(WTERMSIG(status)));
+            return false;
+        } else if (WIFEXITED(status)) {
+            warning("Process %d exited with status %d while seizing.", pid, WEXITSTATUS(status));
+            return false;
+        }
+    }
+    
+    adbi_bug_unrechable();
+}
+
 
 
 
@@ -226,3 +298,14 @@ pid_t ptrace_get_child_pid(pid_t pid) {
         adbi_bug("Error reading child PID of process %d: %s", pid, strerror(errno));
     return result;
 }
+
+/* Return true if the SIGTRAP the thread is stopped with was caused by a completed single step (and not e.g. by a
+ * breakpoint instruction executed during the step). */
+bool ptrace_is_step_trap(pid_t pid) {
+    siginfo_t info;
+    if (ptrace(PTRACE_GETSIGINFO, pid, NULL, &info) == -1) {
+        debug("Error reading signal information of thread %d: %s", pid, strerror(errno));
+        return false;
+    }
+    return (info.si_signo == SIGTRAP) && ((info.si_code == TRAP_TRACE) || (info.si_code == TRAP_HWBKPT));
+}
@@ -6,11 +6,33 @@
 
 #include "process/process.h"
 
+/* Older C libraries lack the requests for seized tracees. */
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE        0x4206
+#define PTRACE_INTERRUPT    0x4207
+#define PTRACE_LISTEN       0x4208
+#endif
+
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP   128
+#endif
+
+#ifndef TRAP_TRACE
+#define TRAP_TRACE          2
+#endif
+
+#ifndef TRAP_HWBKPT
+#define TRAP_HWBKPT         4
+#endif
+
 #define is_word_aligned(addr) (((addr) & 0x03) == 0)
 
 bool ptrace_signal(pid_t pid, pid_t tid, int signo);
 
+extern bool ptrace_seize_mode;
+
 bool ptrace_attach(pid_t pid, pid_t tid);
+bool ptrace_seize(pid_t pid, pid_t tid, bool * groupstop);
 bool ptrace_detach(pid_t pid);
 
 int ptrace_stop(pid_t pid);
@@ -22,5 +44,6 @@ bool ptrace_mem_read(pid_t pid, address_t address, unsigned long * __restrict da
 
 void ptrace_set_options(pid_t pid);
 pid_t ptrace_get_child_pid(pid_t pid);
+bool ptrace_is_step_trap(pid_t pid);
 
 #endif
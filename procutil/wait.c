@@ -1,6 +1,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/ptrace.h>
 #include <unistd.h>
 
@@ -8,7 +13,10 @@
 
 #include "injection/inject.h"
 
-#include "util/signal.h"
+#include "util/eventloop.h"
+#include "util/latency.h"
+
+#include "communication/event.h"
 
 #include "process/process.h"
 #include "process/thread.h"
@@ -22,6 +30,35 @@
 #include "ptrace.h"
 #include "wait.h"
 
+/* Maximum number of statuses collected by a single wait_main call. */
+#define WAIT_BATCH_MAX 1024
+
+/* Status collected, but not handled yet. */
+typedef struct wait_status_t {
+    pid_t pid;
+    int status;
+    uint64_t time;                  /* when the status was collected */
+    unsigned int rank;              /* number of statuses of the same process handled before this one */
+    unsigned long seq;              /* number of statuses collected before this one */
+    bool handled;
+    struct wait_status_t * next;    /* next status of the same thread (e.g. exit after a stop) */
+} wait_status_t;
+
+/* First unhandled status of each thread, indexed by pid. */
+static tree_t wait_queued = NULL;
+
+/* Statuses collected by wait_serve, indexed by sequence number.  They are handled by the next wait_main call. */
+static tree_t wait_deferred = NULL;
+
+static unsigned long wait_seq = 0;
+
+/* SIGCHLD signalfd. */
+static int wait_fd = -1;
+
+/* Set if there may be statuses to collect.  Initially set, so statuses of children created before wait_init are not
+ * missed. */
+static bool wait_pending_flag = true;
+
 static thread_t * thread_clone_create_child(pid_t child_pid) {
     thread_t * child_thread;
     pid_t child_tgid = procfs_get_tgid(child_pid);
@@ -34,10 +71,12 @@ static thread_t * thread_clone_create_child(pid_t child_pid) {
         parent_process = process_get(child_ppid);
         info("New process %d (spawned by %s).", child_pid, str_process(parent_process));
         child_process = process_forked(parent_process, child_pid);
+        event_post(EVENT_PROCESS, child_pid, child_pid, child_ppid, NULL);
     } else {
         /* A new thread in an existing process was created. */
         child_process = process_dup(parent_process);
         info("New thread %d:%d.", child_process->pid, child_pid);
+        event_post(EVENT_THREAD, child_process->pid, child_pid, 0, NULL);
     }
     
     child_thread = thread_create(child_process, child_pid);
@@ -78,17 +117,51 @@ static void thread_handle_clone_parent(thread_t * parent_thread, pid_t child_pid
     thread_put(child_thread);
 }
 
+/* Seized threads report interrupts (see thread_stop_request), the initial stop of new threads and group-stops as
+ * PTRACE_EVENT_STOP.  Group-stops report the stop signal, all others SIGTRAP. */
+static void thread_handle_event_stop(thread_t * thread, int signo) {
+    bool groupstop = signo != SIGTRAP;
+    
+    if (groupstop && !thread->state.groupstop)
+        verbose("Thread %s entered group-stop (%s).", str_thread(thread), str_signal(signo));
+    thread->state.groupstop = groupstop;
+    
+    if (unlikely(thread->state.slavemode)) {
+        /* A late interrupt or a group-stop during a remote call.  Let the call finish, the thread goes back to
+         * group-stop when it's continued afterwards. */
+        debug("Ignoring stop of %s during remote call.", str_thread(thread));
+        thread_continue(thread, 0);
+        return;
+    }
+    
+    thread_continue_or_stop(thread, 0);
+}
+
 static void thread_handle_status(thread_t * thread, int status) {
 
     assert(thread->references >= 1);    /* list + current lock */
     assert((thread->references >= 2) || (thread->state.dead));  /* list + current lock */
     
+    bool stepping = thread->state.stepping;
+    
     thread->state.running = false;
+    thread->state.stepping = false;
     
     if (likely(WIFSTOPPED(status))) {
         /* The process was stopped by a signal. */
         int signo = WSTOPSIG(status);
         
+        if (unlikely((status >> 16) == PTRACE_EVENT_STOP)) {
+            thread_handle_event_stop(thread, signo);
+            return;
+        }
+        
+        if (unlikely(stepping) && (signo == SIGTRAP) && !(status >> 16) && ptrace_is_step_trap(thread->pid)) {
+            /* Single step completed (see thread_step), leave the thread stopped.  Other traps (e.g. a breakpoint hit
+             * by the stepped instruction) are handled normally below. */
+            return;
+        }
+        
         if ((signo == SIGTRAP) && ((status >> 16) & 0xf)) {
             /* We catched a fork, vfork, clone or execve. */
             
@@ -107,12 +180,12 @@ static void thread_handle_status(thread_t * thread, int status) {
         }
         
         if (likely(!thread->state.slavemode && ((signo == SIGILL) || (signo == SIGTRAP) || (signo == SIGBUS)))) {
-            if (thread_trap(thread))
+            if (thread_trap(thread, false))
                 return;
         }
 
-        if (thread->process->stabilizing && (signo == SIGSEGV)) {
-            /* Process is stabilizing. */
+        if (thread->process->stabilizing && (signo == SIGSEGV) && !thread->state.slavemode) {
+            /* Process is stabilizing.  Remote calls end with a SIGSEGV too, but those are handled by fncall. */
             pt_regs regs;
             
             if (!thread_get_regs(thread, &regs)) {
@@ -189,15 +262,147 @@ static void thread_handle_status_unknown(pid_t pid, int status) {
     /* We received an event from an untraced process. This means that Linux automatically attached us to the process,
      * because it was spawned by one of our traced processes. We should receive an event from the parent shortly, but
      * we'll find the thread's creator anyway. */
-    if (WIFSTOPPED(status) && (WSTOPSIG(status) == SIGSTOP)) {
+    if (WIFSTOPPED(status) && ((WSTOPSIG(status) == SIGSTOP) || ((status >> 16) == PTRACE_EVENT_STOP))) {
         thread_handle_clone_child(pid);
     }
     
 }
 
+/* Queue a collected status.  It's handled by wait_main or by thread_wait, whichever comes first. */
+static wait_status_t * wait_collect(pid_t pid, int status) {
+    wait_status_t * entry = adbi_malloc(sizeof(wait_status_t));
+    
+    entry->pid = pid;
+    entry->status = status;
+    entry->time = latency_clock();
+    entry->rank = 0;
+    entry->seq = wait_seq++;
+    entry->handled = false;
+    entry->next = NULL;
+    
+    wait_status_t * queued = tree_get(&wait_queued, pid);
+    if (queued) {
+        while (queued->next)
+            queued = queued->next;
+        queued->next = entry;
+    } else {
+        tree_insert(&wait_queued, pid, entry);
+    }
+    
+    return entry;
+}
+
+/* Remove the status from the queue of its thread. */
+static void wait_dequeue(wait_status_t * entry) {
+    assert(!entry->handled);
+    assert(tree_get(&wait_queued, entry->pid) == entry);
+    
+    entry->handled = true;
+    if (entry->next)
+        tree_update(&wait_queued, entry->pid, entry->next);
+    else
+        tree_remove(&wait_queued, entry->pid);
+}
+
+/* Handle a status of a thread, which hit a tracepoint while we're waiting for a remote call in another process.  Return
+ * false if the status is not a tracepoint hit or if handling it might need remote calls or interfere with an operation
+ * in progress. */
+static bool wait_handle_jump(thread_t * thread, int status) {
+    bool handled;
+    
+    if (!WIFSTOPPED(status) || (status >> 16))
+        return false;
+        
+    switch (WSTOPSIG(status)) {
+        case SIGILL:
+        case SIGTRAP:
+        case SIGBUS:
+            break;
+        default:
+            return false;
+    }
+    
+    if (thread->state.dead || !thread->state.running || thread->state.slavemode || thread->state.stopme ||
+            !thread->notified || thread->process->stabilizing)
+        return false;
+        
+    thread->state.running = false;
+    thread->stopped = latency_clock();
+    handled = thread_trap(thread, true);
+    thread->stopped = 0;
+    
+    if (!handled) {
+        /* The status is deferred, until it's handled the thread is considered running (so thread_stop and
+         * thread_wait pick up the status). */
+        thread->state.running = true;
+    }
+    
+    return handled;
+}
+
+/* Wait for a thread running a remote call (see fncall.c).  Remote calls may take long (e.g. loading a library), so
+ * meanwhile tracepoint hits in other processes are handled right away.  Other statuses are deferred to wait_main,
+ * because handling them may require remote calls or change state the caller depends on. */
+static void wait_serve(thread_t * thread) {
+    while (1) {
+        int status;
+        int res = waitpid(-1, &status, WUNTRACED | __WALL);
+        
+        if (unlikely(res == -1)) {
+            debug("Wait on %s failed.", str_thread(thread));
+            assert(errno == ECHILD);
+            thread_exit(thread);
+            return;
+        }
+        
+        if (res == thread->pid) {
+            thread_handle_status(thread, status);
+            if (thread->state.running) {
+                /* The stop was ignored (see thread_handle_event_stop), keep waiting. */
+                continue;
+            }
+            return;
+        }
+        
+        thread_t * other = thread_get(res);
+        bool handled = other && (other->process != thread->process) && wait_handle_jump(other, status);
+        
+        if (other)
+            thread_put(other);
+            
+        if (!handled) {
+            wait_status_t * entry = wait_collect(res, status);
+            tree_insert(&wait_deferred, entry->seq, entry);
+            wait_pending_flag = true;
+        }
+    }
+}
+
 void thread_wait(thread_t * thread, bool nohang) {
     if (unlikely(thread->state.dead))
         return;
+        
+    wait_status_t * queued = tree_get(&wait_queued, thread->pid);
+    if (queued) {
+        /* The status was collected already, but it's not handled yet (e.g. we're stopping all threads of the process
+         * while handling a status of another thread).  Waiting on the thread would block forever. */
+        int status = queued->status;
+        
+        wait_dequeue(queued);
+        if (tree_discard(&wait_deferred, queued->seq))
+            free(queued);
+            
+        thread_handle_status(thread, status);
+        
+        if (nohang || !thread->state.slavemode || !thread->state.running)
+            return;
+    }
+    
+    if (!nohang && thread->state.slavemode) {
+        wait_serve(thread);
+        return;
+    }
+    
     int status;
     int res = waitpid(thread->pid, &status, WUNTRACED | __WALL | (nohang ? WNOHANG : 0));
     
@@ -219,30 +424,178 @@ void thread_wait(thread_t * thread, bool nohang) {
     thread_handle_status(thread, status);
 }
 
+static void wait_dispatch(wait_status_t * entry) {
+    thread_t * thread = thread_get(entry->pid);
+    
+    wait_dequeue(entry);
+    
+    if (likely(thread)) {
+        debug("Waited returned %s.", str_thread(thread));
+        
+        /* Measure the time until the thread is resumed, unless the thread stays stopped. */
+        thread->stopped = entry->time;
+        thread_handle_status(thread, entry->status);
+        thread->stopped = 0;
+        
+        thread_put(thread);
+    } else {
+        debug("Waited returned unknown PID %d.", entry->pid);
+        thread_handle_status_unknown(entry->pid, entry->status);
+    }
+}
+
+static int wait_status_compare(const void * a, const void * b) {
+    const wait_status_t * x = *(const wait_status_t * const *) a;
+    const wait_status_t * y = *(const wait_status_t * const *) b;
+    
+    if (x->rank != y->rank)
+        return x->rank < y->rank ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/* Collect all pending statuses first and handle them afterwards, taking one status of each process in turn.  This way
+ * a process with many stopped threads (e.g. hitting a breakpoint at once) doesn't delay the others, and the time
+ * between collecting and handling a status doesn't depend on the order returned by waitpid. */
 void wait_main() {
 
-    int count = 128;
+    wait_status_t ** order = NULL;
+    size_t count = 0;
+    size_t allocated = 0;
+    unsigned int collected = 0;
+    tree_t ranks = NULL;
+    
+    void add(wait_status_t * entry) {
+        if (count == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            order = adbi_realloc(order, allocated * sizeof(*order));
+        }
+        order[count++] = entry;
+    }
     
-    while (count--) {
+    wait_pending_flag = false;
+    
+    /* Statuses collected while waiting for remote calls come first. */
+    while (!tree_empty(&wait_deferred))
+        add(tree_pop(&wait_deferred));
+        
+    while (collected < WAIT_BATCH_MAX) {
         int status;
         int res = waitpid(-1, &status, WNOHANG | WUNTRACED | __WALL);
         
-        if (res > 0) {
-            thread_t * thread = thread_get(res);
-            
-            if (likely(thread)) {
-                debug("Waited returned %s.", str_thread(thread));
-                thread_handle_status(thread, status);
-                thread_put(thread);
-            } else {
-                debug("Waited returned unknown PID %d.", res);
-                thread_handle_status_unknown(res, status);
-            }
-        } else {
-            /* handled all pending child signals */
-            signal_child = 0;
+        if (res <= 0) {
+            /* collected all pending statuses */
             break;
         }
+        
+        add(wait_collect(res, status));
+        ++collected;
+    }
+    
+    if (collected == WAIT_BATCH_MAX) {
+        /* There may be more statuses, collect them in the next iteration. */
+        wait_pending_flag = true;
     }
     
+    /* Rank the statuses of each process in the order they were collected.  Statuses of untraced processes are ranked
+     * by their pid. */
+    qsort(order, count, sizeof(order[0]), wait_status_compare);
+    for (size_t i = 0; i < count; ++i) {
+        thread_t * thread = thread_get(order[i]->pid);
+        pid_t tgid = thread ? thread->process->pid : order[i]->pid;
+        
+        if (thread)
+            thread_put(thread);
+            
+        order[i]->rank = (intptr_t) tree_get(&ranks, tgid);
+        if (order[i]->rank)
+            tree_update(&ranks, tgid, (void *)(intptr_t)(order[i]->rank + 1));
+        else
+            tree_insert(&ranks, tgid, (void *)(intptr_t) 1);
+    }
+    
+    while (!tree_empty(&ranks))
+        tree_pop(&ranks);
+        
+    qsort(order, count, sizeof(order[0]), wait_status_compare);
+    
+    for (size_t i = 0; i < count; ++i) {
+        /* Statuses may be handled out of order by thread_wait. */
+        if (!order[i]->handled)
+            wait_dispatch(order[i]);
+    }
+    
+    for (size_t i = 0; i < count; ++i)
+        free(order[i]);
+    free(order);
+    
+    /* Statuses collected while handling this batch are deferred. */
+    assert(tree_empty(&wait_queued) || !tree_empty(&wait_deferred));
+}
+
+/* Return true if there may be statuses to collect by wait_main. */
+bool wait_pending() {
+    return wait_pending_flag;
+}
+
+static void wait_signalfd_drain(int fd) {
+    struct signalfd_siginfo info[16];
+    
+    /* SIGCHLD is not queued, a single signal may stand for many statuses, so we don't care about the details. */
+    while (read(fd, info, sizeof(info)) > 0)
+        ;
+        
+    wait_pending_flag = true;
+}
+
+static void wait_signalfd_callback(int fd, uint32_t events, void * data) {
+    UNUSED(events);
+    UNUSED(data);
+    wait_signalfd_drain(fd);
+}
+
+/* Block until any child changes state or until the timeout (in milliseconds) expires.  The status is not collected,
+ * callers wait on the threads they're interested in (e.g. with thread_wait in non-blocking mode) before calling this
+ * function again.  Return false on timeout. */
+bool wait_any(int timeout) {
+    struct pollfd pfd;
+    
+    pfd.fd = wait_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    
+    if (poll(&pfd, 1, timeout) <= 0)
+        return false;
+        
+    wait_signalfd_drain(wait_fd);
+    return true;
+}
+
+/* Start monitoring SIGCHLD with a signalfd in the event loop.  SIGCHLD must be blocked already (see signal_init). */
+bool wait_init() {
+    sigset_t mask;
+    
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    
+    wait_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (wait_fd < 0) {
+        fatal("Error creating signalfd: %s.", strerror(errno));
+        return false;
+    }
+    
+    if (!eventloop_add(wait_fd, EPOLLIN, wait_signalfd_callback, NULL)) {
+        close(wait_fd);
+        wait_fd = -1;
+        return false;
+    }
+    
+    return true;
+}
+
+void wait_cleanup() {
+    if (wait_fd >= 0) {
+        eventloop_remove(wait_fd);
+        close(wait_fd);
+        wait_fd = -1;
+    }
 }
@@ -1,6 +1,11 @@
 #ifndef WAIT_H
 #define WAIT_H
 
+bool wait_init();
+void wait_cleanup();
+
+bool wait_pending();
+bool wait_any(int timeout);
 void wait_main();
 
 #endif
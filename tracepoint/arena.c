@@ -0,0 +1,430 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "process/process.h"
+#include "process/thread.h"
+#include "process/segment.h"
+#include "process/artificial.h"
+
+#include "injection/fncall.h"
+
+#include "arena.h"
+
+/* Trampolines of all segments of a process are allocated from arenas -- regions mapped near clusters of code.  Free
+ * space of each arena is kept in a tree.  Blocks released when a library is unloaded are merged with their neighbours
+ * and reused, so most libraries are instrumented without any remote mmap or munmap call.  Arenas are unmapped only
+ * when detaching. */
+
+/* Minimal size of a new arena. */
+#define ARENA_SIZE          (64 * 1024)
+
+/* Alignment of trampoline blocks. */
+#define ARENA_ALIGN         16
+
+typedef struct arena_block_t {
+    address_t address;
+    size_t size;
+    segment_t * segment;
+} arena_block_t;
+
+struct arena_t {
+    address_t address;
+    size_t size;
+
+    /* was the arena mapped over an unused segment? */
+    bool stolen;
+
+    /* allocated blocks: (address_t) -> (arena_block_t *) */
+    tree_t blocks;
+
+    /* free space: (address_t) -> (size_t) */
+    tree_t free;
+};
+
+static inline size_t arena_align(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static arena_t * arena_create(process_t * process, address_t address, size_t size, bool stolen) {
+    arena_t * arena = adbi_malloc(sizeof(arena_t));
+
+    arena->address = address;
+    arena->size = size;
+    arena->stolen = stolen;
+    arena->blocks = NULL;
+    arena->free = NULL;
+    tree_insert(&arena->free, address, (void *) size);
+
+    tree_insert(&process->arenas, address, arena);
+    artificial_add_arena(process, arena, address, size);
+
+    debug("Created trampoline arena at %p (%zu bytes) in %s.", (void *) address, size, str_process(process));
+    return arena;
+}
+
+static void arena_forget(process_t * process, arena_t * arena) {
+    assert(tree_empty(&arena->blocks));
+    tree_clear(&arena->free);
+    tree_remove(&process->arenas, arena->address);
+    artificial_remove(process, arena->address);
+    free(arena);
+}
+
+/**********************************************************************************************************************/
+
+/* Check if all addresses between low and high can jump to both ends of the given block. */
+static bool arena_reachable(address_t low, address_t high, address_t start, address_t end) {
+    return arch_check_relative_jump(low, start) && arch_check_relative_jump(low, end) &&
+           arch_check_relative_jump(high, start) && arch_check_relative_jump(high, end);
+}
+
+/* Find free space for a block of the given size in the arena.  If reachable is true, the block must be reachable from
+ * all addresses between low and high.  Return the block address or 0. */
+static address_t arena_find(const arena_t * arena, size_t size, bool reachable, address_t low, address_t high) {
+    TREE_ITER(&arena->free, node) {
+        address_t start = node->key;
+        size_t free_size = (size_t) node->val;
+
+        if (free_size < size)
+            continue;
+
+        if (!reachable)
+            return start;
+
+        /* Try both ends of the free space. */
+        if (arena_reachable(low, high, start, start + size))
+            return start;
+
+        address_t last = start + free_size - size;
+        if (arena_reachable(low, high, last, last + size))
+            return last;
+    }
+    return 0;
+}
+
+/* Remove the given block from the free space of the arena. */
+static void arena_take(arena_t * arena, address_t address, size_t size) {
+    node_t * node = tree_get_node_le(&arena->free, address);
+    assert(node);
+
+    address_t start = node->key;
+    size_t free_size = (size_t) node->val;
+    assert(start + free_size >= address + size);
+
+    tree_remove(&arena->free, start);
+    if (address > start)
+        tree_insert(&arena->free, start, (void *) (address - start));
+    if (start + free_size > address + size)
+        tree_insert(&arena->free, address + size, (void *) (start + free_size - address - size));
+}
+
+/* Return the given block to the free space of the arena, merging it with adjacent free space. */
+static void arena_give(arena_t * arena, address_t address, size_t size) {
+    node_t * next = tree_get_node(&arena->free, address + size);
+    if (next) {
+        size_t next_size = (size_t) next->val;
+        tree_remove(&arena->free, address + size);
+        size += next_size;
+    }
+
+    node_t * prev = tree_get_node_le(&arena->free, address);
+    if (prev && (prev->key + (size_t) prev->val == address)) {
+        prev->val = (void *) ((size_t) prev->val + size);
+        return;
+    }
+
+    tree_insert(&arena->free, address, (void *) size);
+}
+
+static void arena_add_block(arena_t * arena, segment_t * segment, address_t address, size_t size) {
+    arena_block_t * block = adbi_malloc(sizeof(arena_block_t));
+    block->address = address;
+    block->size = size;
+    block->segment = segment;
+    tree_insert(&arena->blocks, address, block);
+}
+
+static arena_t * arena_of(const process_t * process, address_t address) {
+    const artificial_t * artificial = artificial_get(process, address);
+    assert(artificial && artificial->arena);
+    return artificial->arena;
+}
+
+/**********************************************************************************************************************/
+
+/* Check if given segment is unused. Unused means that segment is private and is non-readable, non-writable and
+ * non-executable. */
+static inline bool segment_is_unused(segment_t * segment) {
+    return !segment_is_readable(segment) && !segment_is_writeable(segment) &&
+                !segment_is_executable(segment) && !segment_is_shared(segment) &&
+                segment->filename == NULL;
+}
+
+/* Check if the page at the given address is neither a known segment nor an artificial region. */
+static inline bool arena_page_is_free(const process_t * process, address_t address) {
+    return !segment_get(process, address) && !artificial_get(process, address);
+}
+
+static inline bool arena_mmap(thread_t * thread, address_t address, size_t size, address_t * res) {
+    debug("mmaping trampoline arena at 0x%p size 0x%zu", (void *) address, size);
+    return fncall_mmap(thread, res, address, size,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0) && (*res == address);
+}
+
+static bool arena_iter_free_segments_around(segment_t * segment,
+        address_t low, address_t hi, size_t max_size,
+        bool (fn)(address_t start, size_t size, segment_t * segment)) {
+
+    const size_t pgsize = fncall_align_to_page(1); // page size
+    const address_t addr = fncall_align_to_page(low + (hi - low)/2) - pgsize;
+    address_t beoff, aboff;
+    bool res = false;
+
+    beoff = addr - segment->start + pgsize;
+    aboff = segment->end - addr;
+    bool beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
+    bool aboff_is_reachable = arch_check_relative_jump(low, addr + aboff + pgsize);
+    while(beoff_is_reachable || aboff_is_reachable) {
+        while (beoff_is_reachable && ((beoff <= aboff) || !aboff_is_reachable)) {
+            segment_t * seg = segment_get(segment->process, addr - beoff);
+            if (arena_page_is_free(segment->process, addr - beoff)) {
+                /* we found gap between segments */
+                address_t seg_start = addr - beoff;
+                size_t size = pgsize;
+
+                beoff += pgsize;
+                beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
+                while ((size < max_size) &&
+                        beoff_is_reachable &&
+                        arena_page_is_free(segment->process, addr - beoff)) {
+
+                    size += pgsize;
+                    seg_start -= pgsize;
+
+                    beoff += pgsize;
+                    beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
+                }
+
+                res = fn(seg_start, size, NULL);
+
+            } else if (seg) {
+                if (segment_is_unused(seg) && arch_check_relative_jump(hi, seg->start)) {
+                    /* unusable segment, probably gap between elf segments */
+                    res = fn(0, 0, seg);
+                }
+                beoff += (seg->end - seg->start);
+                beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
+            } else {
+                /* artificial region */
+                beoff += pgsize;
+                beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
+            }
+
+            if (res)
+                return true;
+        }
+        while (aboff_is_reachable && ((aboff <= beoff) || !beoff_is_reachable)) {
+            segment_t * seg = segment_get(segment->process, addr + aboff);
+            if (arena_page_is_free(segment->process, addr + aboff)) {
+                /* we found gap between segments */
+                address_t seg_start = addr + aboff;
+                size_t size = pgsize;
+
+                aboff += pgsize;
+                aboff_is_reachable = arch_check_relative_jump(low, addr + aboff + pgsize);
+                while ((size < max_size) &&
+                        aboff_is_reachable &&
+                        arena_page_is_free(segment->process, addr + aboff)) {
+
+                    size += pgsize;
+
+                    aboff += pgsize;
+                    aboff_is_reachable = arch_check_relative_jump(low, addr + aboff + pgsize);
+                }
+
+                res = fn(seg_start, size, NULL);
+            } else if (seg) {
+                if (segment_is_unused(seg) && arch_check_relative_jump(low, seg->end)) {
+                    /* unusable segment, probably gap between elf segments */
+                    res = fn(0, 0, seg);
+                }
+                aboff += (seg->end - seg->start);
+                aboff_is_reachable = arch_check_relative_jump(low, addr + aboff);
+            } else {
+                /* artificial region */
+                aboff += pgsize;
+                aboff_is_reachable = arch_check_relative_jump(low, addr + aboff);
+            }
+
+            if (res)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Map a new arena for at least size bytes of trampolines close to the code between low and high. */
+static arena_t * arena_map_near(thread_t * thread, segment_t * segment, address_t low, address_t high, size_t size) {
+    const size_t wanted = fncall_align_to_page(size);
+    const size_t arena_size = wanted > ARENA_SIZE ? wanted : fncall_align_to_page(ARENA_SIZE);
+    arena_t * arena = NULL;
+
+    bool map(address_t start, size_t gap, segment_t * seg) {
+        address_t result;
+        if (seg) {
+            /* unusable segment, probably gap between elf segments, steal it */
+            size_t seg_size = seg->end - seg->start;
+            if (seg_size < wanted)
+                return false;
+            seg_size = seg_size < arena_size ? seg_size : arena_size;
+            if (arena_mmap(thread, seg->start, seg_size, &result))
+                arena = arena_create(segment->process, result, seg_size, true);
+        } else if (gap >= wanted) {
+            /* we found gap between segments */
+            gap = gap < arena_size ? gap : arena_size;
+            if (arena_mmap(thread, start, gap, &result))
+                arena = arena_create(segment->process, result, gap, false);
+        }
+        return arena != NULL;
+    }
+
+    arena_iter_free_segments_around(segment, low, high, arena_size, map);
+    return arena;
+}
+
+/* Map a new arena for at least size bytes of trampolines anywhere in the address space. */
+static arena_t * arena_map_anywhere(thread_t * thread, process_t * process, size_t size) {
+    const size_t arena_size = size > ARENA_SIZE ? fncall_align_to_page(size) : fncall_align_to_page(ARENA_SIZE);
+    address_t address;
+
+    if (!fncall_allocate(thread, arena_size, &address))
+        return NULL;
+
+    return arena_create(process, address, arena_size, false);
+}
+
+/**********************************************************************************************************************/
+
+/* Allocate trampolines for the given segment, whose tracepoints lie between low and high.  Free space of existing
+ * arenas within relative jump range is used first, then a new arena is mapped near the code.  If that fails, any free
+ * space or a new arena anywhere is used (veneers bridge the distance).  Set segment->trampolines and return true on
+ * success. */
+bool arena_alloc(thread_t * thread, segment_t * segment, address_t low, address_t high) {
+    process_t * process = segment->process;
+    size_t size = arena_align(segment->trampolines_size);
+    arena_t * arena = NULL;
+    address_t address = 0;
+
+    assert(thread->process == process);
+    assert(!segment->trampolines);
+
+    bool find(bool reachable) {
+        TREE_ITER(&process->arenas, node) {
+            address = arena_find(node->val, size, reachable, low, high);
+            if (address) {
+                arena = node->val;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (!find(true)) {
+        arena = arena_map_near(thread, segment, low, high, size);
+        if (arena) {
+            address = arena->address;
+        } else if (!find(false)) {
+            warning("Suitable segment for relative jumps not found.");
+            arena = arena_map_anywhere(thread, process, size);
+            if (!arena)
+                return false;
+            address = arena->address;
+        }
+    }
+
+    arena_take(arena, address, size);
+    arena_add_block(arena, segment, address, size);
+    segment->trampolines = address;
+
+    debug("Allocated %zu bytes of trampolines at %p for %s.", size, (void *) address, str_segment(segment));
+    return true;
+}
+
+/* Release trampolines of the given segment.  The memory stays mapped for reuse. */
+void arena_free(segment_t * segment) {
+    arena_t * arena = arena_of(segment->process, segment->trampolines);
+    arena_block_t * block = tree_get(&arena->blocks, segment->trampolines);
+
+    assert(block && (block->segment == segment));
+
+    tree_remove(&arena->blocks, block->address);
+    arena_give(arena, block->address, block->size);
+    free(block);
+}
+
+/* Register trampolines of a forked segment in the child's copy of the arena.  The space is already taken, because the
+ * free space was cloned from the parent. */
+void arena_fork(segment_t * child, const segment_t * parent) {
+    arena_t * arena = arena_of(child->process, child->trampolines);
+    arena_t * parent_arena = arena_of(parent->process, parent->trampolines);
+    arena_block_t * block = tree_get(&parent_arena->blocks, parent->trampolines);
+
+    assert(block && (block->segment == parent));
+    arena_add_block(arena, child, block->address, block->size);
+}
+
+/* Return the segment owning the trampoline block containing the given address or NULL. */
+segment_t * arena_get_segment(const arena_t * arena, address_t address) {
+    const arena_block_t * block = tree_get_le(&arena->blocks, address);
+    if (block && (address < block->address + block->segment->trampolines_size))
+        return block->segment;
+    return NULL;
+}
+
+/**********************************************************************************************************************/
+
+/* Clone arenas of the parent process.  Blocks are added later, when segments are forked. */
+void arenas_fork(process_t * child, const process_t * parent) {
+    TREE_ITER(&parent->arenas, node) {
+        const arena_t * arena = node->val;
+        arena_t * clone = adbi_malloc(sizeof(arena_t));
+
+        memcpy(clone, arena, sizeof(arena_t));
+        clone->blocks = NULL;
+        clone->free = NULL;
+        TREE_ITER(&arena->free, free_node) {
+            tree_insert(&clone->free, free_node->key, free_node->val);
+        }
+
+        tree_insert(&child->arenas, clone->address, clone);
+        artificial_add_arena(child, clone, clone->address, clone->size);
+    }
+}
+
+/* Forget all arenas without accessing the process memory.  This is used after exec or exit. */
+void arenas_reset(process_t * process) {
+    TREE_ITER_SAFE(&process->arenas, node) {
+        arena_forget(process, node->val);
+    }
+}
+
+/* Unmap all arenas.  All trampolines must be freed already. */
+void arenas_detach(thread_t * thread) {
+    process_t * process = thread->process;
+    TREE_ITER_SAFE(&process->arenas, node) {
+        arena_t * arena = node->val;
+        bool ok;
+
+        if (arena->stolen)
+            ok = fncall_call_mprotect(thread, arena->address, arena->size, PROT_NONE);
+        else
+            ok = fncall_free(thread, arena->address, arena->size);
+
+        if (!ok)
+            error("Error freeing up trampoline arena at %p in %s.", (void *) arena->address, str_process(process));
+
+        arena_forget(process, arena);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include "process/process.h"
+#include "process/thread.h"
+#include "process/segment.h"
+
+typedef struct arena_t arena_t;
+
+bool arena_alloc(thread_t * thread, segment_t * segment, address_t low, address_t high);
+void arena_free(segment_t * segment);
+void arena_fork(segment_t * child, const segment_t * parent);
+
+segment_t * arena_get_segment(const arena_t * arena, address_t address);
+
+void arenas_fork(process_t * child, const process_t * parent);
+void arenas_reset(process_t * process);
+void arenas_detach(thread_t * thread);
+
+#endif
@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "tree.h"
+
+#include "option.h"
+
+/* Tracepoints are defined by injectables, so their options are kept per injectable, indexed by the tracepoint file
+ * address.  Options apply to all processes the injectable is injected into.  Tracepoints without an entry use the
+ * defaults. */
+
+const tracepoint_options_t tracepoint_options_default = {
+    .mode = TRACEPOINT_MODE_HANDLER,
+    .predicate = NULL,
+    .rate = 1,
+    .enabled = true,
+};
+
+/* Return options of the tracepoint at the given file address. */
+const tracepoint_options_t * tracepoint_options_get(const injectable_t * injectable, address_t address) {
+    const tracepoint_options_t * options = tree_get(&injectable->tpoptions, address);
+    return options ? options : &tracepoint_options_default;
+}
+
+/* Return modifiable options of the tracepoint at the given file address. */
+tracepoint_options_t * tracepoint_options_edit(const injectable_t * injectable, address_t address) {
+    /* Options are not a part of the injectable file, so they can be changed even for a const injectable. */
+    tree_t * tree = (tree_t *) &injectable->tpoptions;
+    tracepoint_options_t * options = tree_get(tree, address);
+    
+    if (!options) {
+        options = adbi_malloc(sizeof(tracepoint_options_t));
+        memcpy(options, &tracepoint_options_default, sizeof(tracepoint_options_t));
+        tree_insert(tree, address, options);
+    }
+    return options;
+}
+
+/* Forget options of the tracepoint at the given file address. */
+void tracepoint_options_remove(const injectable_t * injectable, address_t address) {
+    tree_t * tree = (tree_t *) &injectable->tpoptions;
+    tracepoint_options_t * options = tree_get(tree, address);
+    if (options) {
+        tree_remove(tree, address);
+        free(options->predicate);
+        free(options);
+    }
+}
+
+/* Forget options of all tracepoints of the injectable. */
+void tracepoint_options_clear(const injectable_t * injectable) {
+    tree_t * tree = (tree_t *) &injectable->tpoptions;
+    tracepoint_options_t * options;
+    while ((options = tree_pop(tree))) {
+        free(options->predicate);
+        free(options);
+    }
+}
+
+/* Replace the predicate of the tracepoint.  The options take ownership of the new predicate, which may be NULL. */
+void tracepoint_options_set_predicate(tracepoint_options_t * options, predicate_t * predicate) {
+    free(options->predicate);
+    options->predicate = predicate;
+}
+
+const char * str_tracepoint_mode(tracepoint_mode_t mode) {
+    switch (mode) {
+        case TRACEPOINT_MODE_HANDLER:
+            return "handler";
+        case TRACEPOINT_MODE_COUNT:
+            return "count";
+        case TRACEPOINT_MODE_COVER:
+            return "cover";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef OPTION_H_
+#define OPTION_H_
+
+#include "injectable/injectable.h"
+#include "predicate.h"
+
+typedef enum tracepoint_mode_t {
+    /* save the context and call the handler */
+    TRACEPOINT_MODE_HANDLER = 0,
+    
+    /* only count hits in the tracepoint slot */
+    TRACEPOINT_MODE_COUNT,
+    
+    /* mark the first hit in the coverage map, then turn the trampoline into a pass-through */
+    TRACEPOINT_MODE_COVER,
+    
+    TRACEPOINT_MODE_MAX
+} tracepoint_mode_t;
+
+/* Runtime options of a tracepoint defined by an injectable. */
+typedef struct tracepoint_options_t {
+    tracepoint_mode_t mode;
+    
+    /* condition of handler calls (or counting) or NULL */
+    predicate_t * predicate;
+    
+    /* sampling rate -- only every rate-th hit is handled (or counted) */
+    uint32_t rate;
+    
+    /* disabled tracepoints keep their trampolines, but the original instruction is restored */
+    bool enabled;
+} tracepoint_options_t;
+
+extern const tracepoint_options_t tracepoint_options_default;
+
+const tracepoint_options_t * tracepoint_options_get(const injectable_t * injectable, address_t address);
+tracepoint_options_t * tracepoint_options_edit(const injectable_t * injectable, address_t address);
+void tracepoint_options_remove(const injectable_t * injectable, address_t address);
+void tracepoint_options_clear(const injectable_t * injectable);
+
+void tracepoint_options_set_predicate(tracepoint_options_t * options, predicate_t * predicate);
+
+const char * str_tracepoint_mode(tracepoint_mode_t mode);
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "process/process.h"
+#include "process/thread.h"
+#include "procutil/mem.h"
+
+#include "patch.h"
+
+/* Patches are merged into a single run if the gap between them is not larger than this. */
+#define PATCH_BATCH_GAP 4096
+
+/* Maximum size of a single run. */
+#define PATCH_BATCH_RUN_MAX (64 * 1024)
+
+typedef struct patch_entry_t {
+    address_t address;
+    size_t index;           /* order of adding, later patches of the same address win */
+    size_t size;
+    uint8_t bytes[4];
+} patch_entry_t;
+
+void patch_batch_init(patch_batch_t * batch) {
+    batch->entries = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+}
+
+void patch_batch_free(patch_batch_t * batch) {
+    free(batch->entries);
+    patch_batch_init(batch);
+}
+
+/* Add an instruction patch to the batch.  The instruction is written to the process by patch_batch_commit. */
+void patch_batch_insn(patch_batch_t * batch, address_t address, insn_kind_t kind, insn_t insn) {
+    patch_entry_t * entry;
+    
+    assert(arch_check_align(address, kind));
+    
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->entries = adbi_realloc(batch->entries, batch->capacity * sizeof(patch_entry_t));
+    }
+    
+    entry = &batch->entries[batch->count];
+    entry->address = address;
+    entry->index = batch->count;
+    entry->size = patch_encode_insn(kind, insn, entry->bytes);
+    ++batch->count;
+}
+
+void patch_batch_breakpoint(patch_batch_t * batch, address_t address, insn_kind_t kind) {
+    patch_batch_insn(batch, address, kind, get_breakpoint_insn(kind));
+}
+
+void patch_batch_relative_jump(patch_batch_t * batch, address_t insn_address, address_t jump_address,
+                               insn_kind_t kind) {
+    patch_batch_insn(batch, insn_address, kind, arch_get_relative_jump_insn(kind, insn_address, jump_address));
+}
+
+static int patch_entry_compare(const void * a, const void * b) {
+    const patch_entry_t * x = a;
+    const patch_entry_t * y = b;
+    
+    if (x->address != y->address)
+        return (x->address < y->address) ? -1 : 1;
+    return (x->index < y->index) ? -1 : 1;
+}
+
+/* Write patches from first to last (exclusive), which lie in the range from start to end. */
+static bool patch_batch_write_run(thread_t * thread, const patch_entry_t * first, const patch_entry_t * last,
+                                  address_t start, address_t end) {
+    size_t size = end - start;
+    uint8_t * buf = adbi_malloc(size);
+    bool ok = false;
+    
+    if (mem_read(thread, start, size, buf) == size) {
+        for (const patch_entry_t * entry = first; entry < last; ++entry)
+            memcpy(buf + (entry->address - start), entry->bytes, entry->size);
+        ok = (mem_write(thread, start, size, buf) == size);
+    }
+    
+    free(buf);
+    return ok;
+}
+
+/* Write all patches of the batch to the process memory and free the batch.  All threads of the process must be
+ * stopped.  Return false if any of the patches could not be written. */
+bool patch_batch_commit(thread_t * thread, patch_batch_t * batch) {
+    patch_entry_t * entries = batch->entries;
+    size_t count = batch->count;
+    size_t runs = 0;
+    bool ok = true;
+    
+    qsort(entries, count, sizeof(patch_entry_t), patch_entry_compare);
+    
+    for (size_t i = 0; i < count; ) {
+        address_t start = entries[i].address;
+        address_t end = start + entries[i].size;
+        size_t j = i + 1;
+        
+        while ((j < count) && (entries[j].address <= end + PATCH_BATCH_GAP) &&
+                (entries[j].address + entries[j].size - start <= PATCH_BATCH_RUN_MAX)) {
+            if (entries[j].address + entries[j].size > end)
+                end = entries[j].address + entries[j].size;
+            ++j;
+        }
+        
+        if (!patch_batch_write_run(thread, entries + i, entries + j, start, end))
+            ok = false;
+            
+        ++runs;
+        i = j;
+    }
+    
+    debug("Wrote %zu patches in %zu runs to %s.", count, runs, str_thread(thread));
+    
+    patch_batch_free(batch);
+    return ok;
+}
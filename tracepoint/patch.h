@@ -9,4 +9,31 @@ bool patch_read_insn_detect_kind(thread_t * thread, address_t address, insn_t *
 void patch_breakpoint(thread_t * thread, address_t address, insn_kind_t kind);
 void patch_relative_jump(thread_t * thread, address_t insn_address, address_t jump_address, insn_kind_t kind);
 
+/* Store the memory representation of the given instruction in out (at least 4 bytes).  Return its size. */
+size_t patch_encode_insn(insn_kind_t kind, insn_t insn, void * out);
+
+/* Maximum size of a veneer and the required alignment of its address. */
+#define VENEER_SIZE 8
+
+/* Store a veneer, i.e. code which jumps from the given address to dest without touching any register but the PC, in
+ * out (at least VENEER_SIZE bytes).  The veneer is reached by a jump of the given kind.  Return its size or 0 if dest
+ * is out of the veneer's range. */
+size_t patch_encode_veneer(insn_kind_t kind, address_t address, address_t dest, void * out);
+
+/* Patch batch.  Instruction patches are collected locally and written to the process at once by patch_batch_commit.
+ * Patches close to each other are merged into runs, each run is read and written using a single memory access. */
+typedef struct patch_batch_t {
+    struct patch_entry_t * entries;
+    size_t count;
+    size_t capacity;
+} patch_batch_t;
+
+void patch_batch_init(patch_batch_t * batch);
+void patch_batch_free(patch_batch_t * batch);
+void patch_batch_insn(patch_batch_t * batch, address_t address, insn_kind_t kind, insn_t insn);
+void patch_batch_breakpoint(patch_batch_t * batch, address_t address, insn_kind_t kind);
+void patch_batch_relative_jump(patch_batch_t * batch, address_t insn_address, address_t jump_address,
+                               insn_kind_t kind);
+bool patch_batch_commit(thread_t * thread, patch_batch_t * batch);
+
 #endif
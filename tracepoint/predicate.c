@@ -0,0 +1,304 @@
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
+#include "predicate.h"
+#include "prologue.h"
+
+/* Predicates are conditions over registers and memory, which are evaluated by the trampoline prologue before the
+ * handler is called, e.g.
+ *
+ *      x0 == 3 && [x1+8] != 0
+ *
+ * Grammar:
+ *
+ *      predicate   := and ('||' and)*
+ *      and         := cmp ('&&' cmp)*
+ *      cmp         := '(' predicate ')' | operand [op operand]
+ *      op          := '==' | '!=' | '<' | '<=' | '>' | '>='
+ *      operand     := number | register | [width] '[' register [('+' | '-') number] ']'
+ *      width       := 'b' | 'h' | 'w' | 'x'
+ *
+ * Register names are defined by the architecture.  Memory loads are 64 bits wide unless a width is given.  A single
+ * operand is true if it's not zero.  All comparisons are unsigned, constants are truncated to the width of the other
+ * operand.  Memory operands are dereferenced by the traced process itself, so an invalid address crashes it. */
+
+typedef struct parser_t {
+    const char * p;
+    const char * msg;
+    predicate_node_t nodes[PREDICATE_MAX_NODES];
+    unsigned int count;
+    unsigned int depth;     /* parentheses nesting depth, limited to keep the recursion bounded */
+} parser_t;
+
+static int parse_or(parser_t * ps);
+
+static bool parse_fail(parser_t * ps, const char * msg) {
+    if (!ps->msg)
+        ps->msg = msg;
+    return false;
+}
+
+static void parse_skip_space(parser_t * ps) {
+    while (isspace((unsigned char) *ps->p))
+        ++ps->p;
+}
+
+static bool parse_accept(parser_t * ps, const char * token) {
+    size_t length = strlen(token);
+    parse_skip_space(ps);
+    if (strncmp(ps->p, token, length) == 0) {
+        ps->p += length;
+        return true;
+    }
+    return false;
+}
+
+static int parse_add_node(parser_t * ps, const predicate_node_t * node) {
+    if (ps->count == PREDICATE_MAX_NODES) {
+        parse_fail(ps, "predicate too complex");
+        return -1;
+    }
+    ps->nodes[ps->count] = *node;
+    return ps->count++;
+}
+
+static bool parse_number(parser_t * ps, int64_t * value) {
+    bool negative = false;
+    unsigned long long val;
+    char * end;
+
+    parse_skip_space(ps);
+    if (*ps->p == '-') {
+        negative = true;
+        ++ps->p;
+    }
+
+    if (!isdigit((unsigned char) *ps->p))
+        return parse_fail(ps, "number expected");
+
+    errno = 0;
+    val = strtoull(ps->p, &end, 0);
+    if (errno)
+        return parse_fail(ps, "number out of range");
+
+    ps->p = end;
+    *value = negative ? -(int64_t) val : (int64_t) val;
+    return true;
+}
+
+static bool parse_register(parser_t * ps, unsigned int * reg, unsigned int * size) {
+    const char * start;
+
+    parse_skip_space(ps);
+    start = ps->p;
+    while (isalnum((unsigned char) *ps->p))
+        ++ps->p;
+
+    if ((ps->p == start) || !prologue_parse_register(start, ps->p - start, reg, size))
+        return parse_fail(ps, "register expected");
+    return true;
+}
+
+static bool parse_operand(parser_t * ps, predicate_operand_t * operand) {
+    parse_skip_space(ps);
+
+    if (isdigit((unsigned char) *ps->p) || (*ps->p == '-')) {
+        operand->kind = PREDICATE_OPERAND_CONST;
+        operand->reg = 0;
+        operand->size = 0;
+        return parse_number(ps, &operand->value);
+    }
+
+    operand->size = 8;
+    if (ps->p[0] && (ps->p[1] == '[')) {
+        switch (ps->p[0]) {
+            case 'b':
+                operand->size = 1;
+                break;
+            case 'h':
+                operand->size = 2;
+                break;
+            case 'w':
+                operand->size = 4;
+                break;
+            case 'x':
+                operand->size = 8;
+                break;
+            default:
+                return parse_fail(ps, "invalid load width");
+        }
+        ++ps->p;
+    }
+
+    if (parse_accept(ps, "[")) {
+        unsigned int size;
+        operand->kind = PREDICATE_OPERAND_MEM;
+        operand->value = 0;
+        if (!parse_register(ps, &operand->reg, &size))
+            return false;
+        if (parse_accept(ps, "+")) {
+            if (!parse_number(ps, &operand->value))
+                return false;
+        } else if (parse_accept(ps, "-")) {
+            if (!parse_number(ps, &operand->value))
+                return false;
+            operand->value = -operand->value;
+        }
+        if (!parse_accept(ps, "]"))
+            return parse_fail(ps, "']' expected");
+        return true;
+    }
+
+    operand->kind = PREDICATE_OPERAND_REG;
+    operand->value = 0;
+    return parse_register(ps, &operand->reg, &operand->size);
+}
+
+static int parse_cmp(parser_t * ps) {
+    static const struct {
+        const char * token;
+        predicate_op_t op;
+    } ops[] = {
+        /* two character operators first */
+        { "==", PREDICATE_EQ }, { "!=", PREDICATE_NE }, { "<=", PREDICATE_LE }, { ">=", PREDICATE_GE },
+        { "<", PREDICATE_LT }, { ">", PREDICATE_GT },
+    };
+    predicate_node_t node;
+    size_t i;
+
+    if (parse_accept(ps, "(")) {
+        int index;
+        /* A predicate can't have more nested parentheses than nodes, unless they are redundant. */
+        if (ps->depth == PREDICATE_MAX_NODES) {
+            parse_fail(ps, "predicate too complex");
+            return -1;
+        }
+        ++ps->depth;
+        index = parse_or(ps);
+        --ps->depth;
+        if ((index >= 0) && !parse_accept(ps, ")")) {
+            parse_fail(ps, "')' expected");
+            return -1;
+        }
+        return index;
+    }
+
+    node.type = PREDICATE_CMP;
+    node.left = node.right = 0;
+    if (!parse_operand(ps, &node.lhs))
+        return -1;
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if (parse_accept(ps, ops[i].token))
+            break;
+    }
+
+    if (i < sizeof(ops) / sizeof(ops[0])) {
+        node.op = ops[i].op;
+        if (!parse_operand(ps, &node.rhs))
+            return -1;
+    } else {
+        /* A single operand is compared to zero. */
+        node.op = PREDICATE_NE;
+        node.rhs.kind = PREDICATE_OPERAND_CONST;
+        node.rhs.reg = node.rhs.size = 0;
+        node.rhs.value = 0;
+    }
+
+    if (node.lhs.kind == PREDICATE_OPERAND_CONST) {
+        /* Keep constants on the right hand side. */
+        predicate_operand_t tmp = node.lhs;
+
+        if (node.rhs.kind == PREDICATE_OPERAND_CONST) {
+            parse_fail(ps, "comparison of constants");
+            return -1;
+        }
+
+        node.lhs = node.rhs;
+        node.rhs = tmp;
+        switch (node.op) {
+            case PREDICATE_LT:
+                node.op = PREDICATE_GT;
+                break;
+            case PREDICATE_LE:
+                node.op = PREDICATE_GE;
+                break;
+            case PREDICATE_GT:
+                node.op = PREDICATE_LT;
+                break;
+            case PREDICATE_GE:
+                node.op = PREDICATE_LE;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return parse_add_node(ps, &node);
+}
+
+static int parse_binary(parser_t * ps, const char * token, predicate_node_type_t type,
+                        int (*parse_next)(parser_t *)) {
+    int left = parse_next(ps);
+
+    while ((left >= 0) && parse_accept(ps, token)) {
+        predicate_node_t node;
+        int right = parse_next(ps);
+
+        if (right < 0)
+            return -1;
+
+        node.type = type;
+        node.left = left;
+        node.right = right;
+        left = parse_add_node(ps, &node);
+    }
+    return left;
+}
+
+static int parse_and(parser_t * ps) {
+    return parse_binary(ps, "&&", PREDICATE_AND, parse_cmp);
+}
+
+static int parse_or(parser_t * ps) {
+    return parse_binary(ps, "||", PREDICATE_OR, parse_and);
+}
+
+/* Parse the given predicate.  Return the compiled predicate (which must be freed by the caller) or NULL and a reason
+ * in *msg if the predicate is malformed. */
+predicate_t * predicate_parse(const char * text, const char ** msg) {
+    parser_t ps;
+    int root;
+
+    ps.p = text;
+    ps.msg = NULL;
+    ps.count = 0;
+    ps.depth = 0;
+
+    root = parse_or(&ps);
+    parse_skip_space(&ps);
+    if ((root >= 0) && *ps.p)
+        parse_fail(&ps, "unexpected characters");
+
+    if (ps.msg) {
+        if (msg)
+            *msg = ps.msg;
+        return NULL;
+    }
+
+    /* Nodes are added after their operands, so the root node is the last one. */
+    assert((unsigned int) root == ps.count - 1);
+
+    predicate_t * predicate = adbi_malloc(sizeof(predicate_t) + ps.count * sizeof(predicate_node_t));
+    predicate->count = ps.count;
+    memcpy(predicate->nodes, ps.nodes, ps.count * sizeof(predicate_node_t));
+    return predicate;
+}
+
+predicate_t * predicate_dup(const predicate_t * predicate) {
+    size_t size = sizeof(predicate_t) + predicate->count * sizeof(predicate_node_t);
+    predicate_t * copy = adbi_malloc(size);
+    memcpy(copy, predicate, size);
+    return copy;
+}
@@ -0,0 +1,66 @@
+#ifndef PREDICATE_H_
+#define PREDICATE_H_
+
+/* Maximum number of nodes of a predicate. */
+#define PREDICATE_MAX_NODES     31
+
+typedef enum predicate_operand_kind_t {
+    PREDICATE_OPERAND_CONST,
+    PREDICATE_OPERAND_REG,
+    PREDICATE_OPERAND_MEM,
+} predicate_operand_kind_t;
+
+typedef struct predicate_operand_t {
+    predicate_operand_kind_t kind;
+
+    /* register (base register of memory operands), numbered by the architecture */
+    unsigned int reg;
+
+    /* width of the register or the memory load in bytes */
+    unsigned int size;
+
+    /* constant value or memory offset */
+    int64_t value;
+} predicate_operand_t;
+
+typedef enum predicate_op_t {
+    PREDICATE_EQ,
+    PREDICATE_NE,
+    PREDICATE_LT,
+    PREDICATE_LE,
+    PREDICATE_GT,
+    PREDICATE_GE,
+} predicate_op_t;
+
+typedef enum predicate_node_type_t {
+    PREDICATE_AND,
+    PREDICATE_OR,
+    PREDICATE_CMP,
+} predicate_node_type_t;
+
+typedef struct predicate_node_t {
+    predicate_node_type_t type;
+
+    /* PREDICATE_AND and PREDICATE_OR: indices of operand nodes */
+    unsigned int left, right;
+
+    /* PREDICATE_CMP: unsigned comparison */
+    predicate_op_t op;
+    predicate_operand_t lhs, rhs;
+} predicate_node_t;
+
+/* Compiled predicate.  Nodes refer to each other by index, the root node is the last one, so predicates can be copied
+ * as a single block. */
+typedef struct predicate_t {
+    unsigned int count;
+    predicate_node_t nodes[];
+} predicate_t;
+
+predicate_t * predicate_parse(const char * text, const char ** msg);
+predicate_t * predicate_dup(const predicate_t * predicate);
+
+static inline const predicate_node_t * predicate_root(const predicate_t * predicate) {
+    return &predicate->nodes[predicate->count - 1];
+}
+
+#endif
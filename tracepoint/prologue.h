@@ -0,0 +1,27 @@
+#ifndef PROLOGUE_H_
+#define PROLOGUE_H_
+
+#include "tracepoint.h"
+
+/* Maximum size of a trampoline prologue. */
+#define PROLOGUE_MAX_SIZE   1024
+
+/* A prologue is code generated for a single tracepoint and placed right before its template instance in the
+ * trampoline.  It runs first on every hit, evaluates the tracepoint predicate (if any) and either continues to the
+ * template or skips the handler and jumps to the out-of-line part of the template directly.
+ *
+ * Store the prologue of the given tracepoint, placed at the given address, in out (at least PROLOGUE_MAX_SIZE bytes).
+ * Return its size or 0 if the tracepoint needs no prologue or its mode is not supported for the instruction kind.  The
+ * size doesn't depend on the address, so it can be computed before the trampoline is allocated. */
+size_t prologue_encode(const tracepoint_t * tracepoint, address_t address, void * out);
+
+/* Return true if the instruction may be a part of an exclusive load/store loop of a prologue (see a64_count).  Such
+ * loops never complete when single-stepped, because every step exception clears the exclusive monitor, so the store
+ * always fails.  False positives are allowed, the caller must just not single-step the thread. */
+bool prologue_is_exclusive(insn_t insn);
+
+/* Parse a register name used in predicates (see predicate.c).  Return true and store the register number and its
+ * width in bytes if the name is valid. */
+bool prologue_parse_register(const char * name, size_t length, unsigned int * reg, unsigned int * size);
+
+#endif
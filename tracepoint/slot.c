@@ -0,0 +1,298 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "process/process.h"
+#include "process/thread.h"
+#include "process/artificial.h"
+
+#include "injection/fncall.h"
+#include "procutil/mem.h"
+
+#include "slot.h"
+
+/* Tracepoints which keep data in the inferior (e.g. hit counters) get a slot in an area mapped once per process.  The
+ * area is never moved, so trampolines refer to slots by absolute address.  The slots are contiguous, so data of all
+ * tracepoints of a process is collected with a single memory read, even while the process is running.
+ *
+ * The slots are followed by the coverage map, which has a single byte per coverage tracepoint.  The byte is set by the
+ * tracepoint on its first hit. */
+
+/* Size of the slots and of the coverage map. */
+#define SLOT_AREA_SIZE      (64 * 1024)
+#define COVER_MAP_SIZE      (64 * 1024)
+
+/* Number of slots in the area. */
+#define SLOT_COUNT          (SLOT_AREA_SIZE / sizeof(tracepoint_slot_t))
+
+#define SLOT_WORD_BITS      (8 * sizeof(unsigned long))
+
+#define SLOT_BITMAP_WORDS(count)    (((count) + SLOT_WORD_BITS - 1) / SLOT_WORD_BITS)
+
+struct slot_area_t {
+    address_t address;
+    
+    /* all slots (coverage map bytes) ever allocated are below the high mark */
+    size_t slots_high;
+    size_t cover_high;
+    
+    /* allocation bitmaps */
+    unsigned long slots_bitmap[SLOT_BITMAP_WORDS(SLOT_COUNT)];
+    unsigned long cover_bitmap[SLOT_BITMAP_WORDS(COVER_MAP_SIZE)];
+};
+
+static inline bool slot_is_used(const unsigned long * bitmap, size_t index) {
+    return bitmap[index / SLOT_WORD_BITS] & (1ul << (index % SLOT_WORD_BITS));
+}
+
+static inline void slot_set_used(unsigned long * bitmap, size_t index, bool used) {
+    if (used)
+        bitmap[index / SLOT_WORD_BITS] |= 1ul << (index % SLOT_WORD_BITS);
+    else
+        bitmap[index / SLOT_WORD_BITS] &= ~(1ul << (index % SLOT_WORD_BITS));
+}
+
+/* Find a free entry in the bitmap and mark it used.  Return its index or count if all entries are used.  *reused is set
+ * if the entry was used before (entries above the high mark are still zeroed by mmap). */
+static size_t slot_bitmap_alloc(unsigned long * bitmap, size_t count, size_t * high, bool * reused) {
+    for (size_t index = 0; index < count; ++index) {
+        if (bitmap[index / SLOT_WORD_BITS] == ~0ul) {
+            /* Skip the whole word. */
+            index += SLOT_WORD_BITS - 1;
+            continue;
+        }
+        
+        if (slot_is_used(bitmap, index))
+            continue;
+            
+        *reused = index < *high;
+        if (!*reused)
+            *high = index + 1;
+            
+        slot_set_used(bitmap, index, true);
+        return index;
+    }
+    return count;
+}
+
+static slot_area_t * slot_area_create(thread_t * thread) {
+    process_t * process = thread->process;
+    address_t address;
+
+    if (!fncall_mmap(thread, &address, 0, SLOT_AREA_SIZE + COVER_MAP_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+        return NULL;
+
+    if (address & (fncall_align_to_page(1) - 1)) {
+        /* mmap failed. */
+        return NULL;
+    }
+
+    slot_area_t * area = adbi_malloc(sizeof(slot_area_t));
+    memset(area, 0, sizeof(slot_area_t));
+    area->address = address;
+
+    process->slots = area;
+    artificial_add_slots(process, address, SLOT_AREA_SIZE + COVER_MAP_SIZE);
+
+    debug("Mapped tracepoint slot area at %p in %s.", (void *) address, str_process(process));
+    return area;
+}
+
+static void slot_area_forget(process_t * process) {
+    artificial_remove(process, process->slots->address);
+    free(process->slots);
+    process->slots = NULL;
+}
+
+/**********************************************************************************************************************/
+
+/* Return the slot area of the thread's process.  The area is mapped on first use.  Return NULL on error. */
+static slot_area_t * slot_area_get(thread_t * thread) {
+    slot_area_t * area = thread->process->slots;
+    
+    if (!area && !(area = slot_area_create(thread)))
+        error("Error mapping tracepoint slot area in %s.", str_process(thread->process));
+    return area;
+}
+
+/* Allocate a zeroed slot in the thread's process.  Return the runtime address of the slot or 0 on error. */
+address_t slot_alloc(thread_t * thread) {
+    slot_area_t * area = slot_area_get(thread);
+    bool reused;
+    
+    if (!area)
+        return 0;
+        
+    size_t index = slot_bitmap_alloc(area->slots_bitmap, SLOT_COUNT, &area->slots_high, &reused);
+    if (index == SLOT_COUNT) {
+        error("No free tracepoint slots in %s.", str_process(thread->process));
+        return 0;
+    }
+    
+    address_t address = area->address + index * sizeof(tracepoint_slot_t);
+    
+    if (reused) {
+        /* The slot was used before, clear it. */
+        tracepoint_slot_t zero;
+        memset(&zero, 0, sizeof(zero));
+        if (mem_write(thread, address, sizeof(zero), &zero) != sizeof(zero)) {
+            slot_set_used(area->slots_bitmap, index, false);
+            return 0;
+        }
+    }
+    
+    return address;
+}
+
+/* Release the slot at the given address. */
+void slot_free(process_t * process, address_t address) {
+    slot_area_t * area = process->slots;
+    size_t index;
+    
+    assert(area);
+    assert(address >= area->address);
+    
+    index = (address - area->address) / sizeof(tracepoint_slot_t);
+    assert(index < area->slots_high);
+    assert(slot_is_used(area->slots_bitmap, index));
+    
+    slot_set_used(area->slots_bitmap, index, false);
+}
+
+/* Allocate a cleared coverage map byte in the thread's process.  Return its runtime address or 0 on error. */
+address_t cover_alloc(thread_t * thread) {
+    slot_area_t * area = slot_area_get(thread);
+    bool reused;
+    
+    if (!area)
+        return 0;
+        
+    size_t index = slot_bitmap_alloc(area->cover_bitmap, COVER_MAP_SIZE, &area->cover_high, &reused);
+    if (index == COVER_MAP_SIZE) {
+        error("Coverage map of %s is full.", str_process(thread->process));
+        return 0;
+    }
+    
+    address_t address = area->address + SLOT_AREA_SIZE + index;
+    
+    if (reused) {
+        uint8_t zero = 0;
+        if (mem_write(thread, address, sizeof(zero), &zero) != sizeof(zero)) {
+            slot_set_used(area->cover_bitmap, index, false);
+            return 0;
+        }
+    }
+    
+    return address;
+}
+
+/* Release the coverage map byte at the given address. */
+void cover_free(process_t * process, address_t address) {
+    slot_area_t * area = process->slots;
+    size_t index;
+    
+    assert(area);
+    assert(address >= area->address + SLOT_AREA_SIZE);
+    
+    index = address - area->address - SLOT_AREA_SIZE;
+    assert(index < area->cover_high);
+    assert(slot_is_used(area->cover_bitmap, index));
+    
+    slot_set_used(area->cover_bitmap, index, false);
+}
+
+/* Set the sampling rate in the slot at the given address and restart the countdown, so the next hit is sampled.  The
+ * process does not need to be stopped.  Return true on success. */
+bool slot_set_rate(process_t * process, address_t address, uint32_t rate) {
+    uint64_t data[2] = { 0, rate };
+    
+    assert(rate);
+    assert(offsetof(tracepoint_slot_t, rate) == offsetof(tracepoint_slot_t, countdown) + sizeof(uint64_t));
+    
+    address += offsetof(tracepoint_slot_t, countdown);
+    if (mem_write_process(process, address, sizeof(data), data) != sizeof(data)) {
+        error("Error setting sampling rate at %p in %s.", (void *) address, str_process(process));
+        return false;
+    }
+    return true;
+}
+
+/* Read all slots of the process, which does not need to be stopped.  Return an array of slots (which must be freed by
+ * the caller) starting at *base and store its length in *count.  Return NULL if the process has no slots or they
+ * can't be read. */
+tracepoint_slot_t * slots_read(process_t * process, address_t * base, size_t * count) {
+    slot_area_t * area = process->slots;
+
+    *count = 0;
+    if (!area || !area->slots_high)
+        return NULL;
+
+    size_t size = area->slots_high * sizeof(tracepoint_slot_t);
+    tracepoint_slot_t * slots = adbi_malloc(size);
+
+    if (mem_read_process(process, area->address, size, slots) != size) {
+        error("Error reading tracepoint slots of %s.", str_process(process));
+        free(slots);
+        return NULL;
+    }
+
+    *base = area->address;
+    *count = area->slots_high;
+    return slots;
+}
+
+/* Read the coverage map of the process, which does not need to be stopped.  Return an array of bytes (which must be
+ * freed by the caller) starting at *base and store its length in *count.  Return NULL if the process has no coverage
+ * tracepoints or the map can't be read. */
+uint8_t * cover_read(process_t * process, address_t * base, size_t * count) {
+    slot_area_t * area = process->slots;
+    
+    *count = 0;
+    if (!area || !area->cover_high)
+        return NULL;
+        
+    uint8_t * map = adbi_malloc(area->cover_high);
+    
+    if (mem_read_process(process, area->address + SLOT_AREA_SIZE, area->cover_high, map) != area->cover_high) {
+        error("Error reading coverage map of %s.", str_process(process));
+        free(map);
+        return NULL;
+    }
+    
+    *base = area->address + SLOT_AREA_SIZE;
+    *count = area->cover_high;
+    return map;
+}
+
+/**********************************************************************************************************************/
+
+/* Clone the slot area of the parent process.  The memory (and so the slot data) is inherited by the child. */
+void slots_fork(process_t * child, const process_t * parent) {
+    if (!parent->slots)
+        return;
+
+    child->slots = adbi_malloc(sizeof(slot_area_t));
+    memcpy(child->slots, parent->slots, sizeof(slot_area_t));
+    artificial_add_slots(child, child->slots->address, SLOT_AREA_SIZE + COVER_MAP_SIZE);
+}
+
+/* Forget the slot area without accessing the process memory.  This is used after exec or exit. */
+void slots_reset(process_t * process) {
+    if (process->slots)
+        slot_area_forget(process);
+}
+
+/* Unmap the slot area.  All slots must be freed already. */
+void slots_detach(thread_t * thread) {
+    process_t * process = thread->process;
+
+    if (!process->slots)
+        return;
+
+    if (!fncall_free(thread, process->slots->address, SLOT_AREA_SIZE + COVER_MAP_SIZE))
+        error("Error freeing up tracepoint slot area at %p in %s.", (void *) process->slots->address,
+              str_process(process));
+
+    slot_area_forget(process);
+}
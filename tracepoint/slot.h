@@ -0,0 +1,34 @@
+#ifndef SLOT_H_
+#define SLOT_H_
+
+#include "process/process.h"
+#include "process/thread.h"
+
+/* Data of a single tracepoint shared with the inferior.  Trampolines access the fields directly, so the layout must
+ * match the code generated by prologue_encode. */
+typedef struct tracepoint_slot_t {
+    /* number of hits (counting tracepoints only) */
+    uint64_t hits;
+    
+    /* sampling: hits left until the next sample and the sampling rate, which reloads the countdown (must follow it) */
+    uint64_t countdown;
+    uint64_t rate;
+} tracepoint_slot_t;
+
+typedef struct slot_area_t slot_area_t;
+
+address_t slot_alloc(thread_t * thread);
+void slot_free(process_t * process, address_t address);
+bool slot_set_rate(process_t * process, address_t address, uint32_t rate);
+
+tracepoint_slot_t * slots_read(process_t * process, address_t * base, size_t * count);
+
+address_t cover_alloc(thread_t * thread);
+void cover_free(process_t * process, address_t address);
+uint8_t * cover_read(process_t * process, address_t * base, size_t * count);
+
+void slots_fork(process_t * child, const process_t * parent);
+void slots_reset(process_t * process);
+void slots_detach(thread_t * thread);
+
+#endif
@@ -17,6 +17,8 @@ typedef struct template_t {
     template_field_t * fields;
     const char * name;
     offset_t literal_pool;
+    /* start of the out-of-line part, which executes the relocated instruction and returns */
+    offset_t ool;
 } template_t;
 
 extern template_t handler_template_arm;
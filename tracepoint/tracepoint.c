@@ -1,5 +1,3 @@
-#include <sys/mman.h>
-
 #include "process/process.h"
 #include "process/thread.h"
 #include "process/segment.h"
@@ -11,7 +9,12 @@
 #include "template.h"
 #include "patch.h"
 #include "jump.h"
+#include "veneer.h"
+#include "arena.h"
+#include "slot.h"
+#include "prologue.h"
 #include "procutil/mem.h"
+#include "communication/event.h"
 
 static tracepoint_t * tracepoint_create(thread_t * thread, address_t address, address_t handler_address) {
     insn_kind_t kind = arch_detect_kind_from_unaligned_address(thread->process->mode32, address);
@@ -40,33 +43,94 @@ static tracepoint_t * tracepoint_create(thread_t * thread, address_t address, ad
     tracepoint->insn_kind = kind;
     tracepoint->template = template;
     tracepoint->trampoline = 0;
+    tracepoint->mode = TRACEPOINT_MODE_HANDLER;
+    tracepoint->prologue_size = 0;
+    tracepoint->slot = 0;
+    tracepoint->cover = 0;
+    tracepoint->predicate = NULL;
+    tracepoint->sampled = false;
+    tracepoint->entry = 0;
+    tracepoint->enabled = true;
     
     return tracepoint;
 }
 
 static void tracepoint_free(tracepoint_t * tracepoint) {
+    free(tracepoint->predicate);
     free(tracepoint);
 }
 
+/* Set up the trampoline prologue of the tracepoint according to its options.  If the options can't be honoured, the
+ * tracepoint falls back to calling the handler. */
+static void tracepoint_apply_options(thread_t * thread, tracepoint_t * tracepoint,
+                                     const tracepoint_options_t * options) {
+    uint8_t code[PROLOGUE_MAX_SIZE];
+    
+    tracepoint->enabled = options->enabled;
+    tracepoint->mode = options->mode;
+    tracepoint->sampled = options->rate > 1;
+    if (options->predicate)
+        tracepoint->predicate = predicate_dup(options->predicate);
+        
+    if ((tracepoint->mode == TRACEPOINT_MODE_HANDLER) && !tracepoint->predicate && !tracepoint->sampled)
+        return;
+        
+    tracepoint->prologue_size = prologue_encode(tracepoint, 0, code);
+    if (!tracepoint->prologue_size) {
+        warning("Options of tracepoint %s are not supported for its instruction or the predicate is too complex, "
+                "using the handler.", str_tracepoint(tracepoint));
+        goto fallback;
+    }
+    
+    if ((tracepoint->mode == TRACEPOINT_MODE_COUNT) || tracepoint->sampled) {
+        if (!(tracepoint->slot = slot_alloc(thread))) {
+            warning("No slot for tracepoint %s, using the handler.", str_tracepoint(tracepoint));
+            goto fallback;
+        }
+        
+        if (tracepoint->sampled && !slot_set_rate(thread->process, tracepoint->slot, options->rate))
+            goto fallback;
+    }
+    
+    if ((tracepoint->mode == TRACEPOINT_MODE_COVER) && !(tracepoint->cover = cover_alloc(thread))) {
+        warning("No coverage map entry for tracepoint %s, using the handler.", str_tracepoint(tracepoint));
+        goto fallback;
+    }
+    return;
+    
+fallback:
+    if (tracepoint->slot)
+        slot_free(thread->process, tracepoint->slot);
+    tracepoint->slot = 0;
+    tracepoint->mode = TRACEPOINT_MODE_HANDLER;
+    tracepoint->sampled = false;
+    tracepoint->prologue_size = 0;
+    free(tracepoint->predicate);
+    tracepoint->predicate = NULL;
+}
+
+/* Add the patch which makes the program enter the tracepoint's trampoline (a jump or a breakpoint) to the batch. */
+static void tracepoint_patch_entry(patch_batch_t * batch, const tracepoint_t * tracepoint) {
+    if (tracepoint->entry)
+        patch_batch_relative_jump(batch, tracepoint->address, tracepoint->entry, tracepoint->insn_kind);
+    else
+        patch_batch_breakpoint(batch, tracepoint->address, tracepoint->insn_kind);
+}
+
 static tracepoint_t * tracepoint_clone(process_t * process, const tracepoint_t * tracepoint, bool install_jump) {
     tracepoint_t * ret = adbi_malloc(sizeof(tracepoint_t));
     memcpy(ret, tracepoint, sizeof(tracepoint_t));
+    if (tracepoint->predicate)
+        ret->predicate = predicate_dup(tracepoint->predicate);
     if (install_jump)
         jump_install(process, tracepoint->address, tracepoint->trampoline);
     return ret;
 }
 
-static bool trampoline_free(thread_t * thread, segment_t * segment) {
-    if (segment->trampoline_stolen)
-        return fncall_call_mprotect(thread, segment->trampolines, segment->trampolines_size, PROT_NONE);
-
-    return fncall_free(thread, segment->trampolines, segment->trampolines_size);
-}
-
 /* Free tracepoints installed in a single segment.
  *
  * If unpatch is true, revert original instructions in the segment (if any tracepoints were defined).
- * If free_trampolines is true, free up the trampoline segment (if allocated).
+ * If free_trampolines is true, unmap veneer pages of the segment.  Trampolines are always returned to their arena.
  *
  * If any of these flags is true, the given thread is used for memory access.
  *
@@ -82,18 +146,20 @@ static void tracepoints_cleanup(
     
     assert((!thread) || (thread->process == process));
     
-    if (free_trampolines && segment->trampolines) {
-        assert(thread);
-        if (!trampoline_free(thread, segment))
-            error("Error freeing up trampoline segment at %p in %s.",
-                          (void *) segment->trampolines, str_process(thread->process));
-    }
+    assert((!free_trampolines) || thread);
     
-    /* We didn't free the trampolines, but they should be removed already anyway (because of exit or fork).
-     * Forget them. */
+    /* Trampolines are returned to their arena, which is unmapped only on detach. */
+    if (segment->trampolines)
+        arena_free(segment);
+    tree_clear(&segment->trampoline_tracepoints);
+    veneers_cleanup(thread, segment, free_trampolines);
     segment->trampolines = 0;
     segment->trampolines_size = 0;
     
+    /* Original instructions are reverted all at once. */
+    patch_batch_t batch;
+    patch_batch_init(&batch);
+    
     /* Remove tracepoints one by one. */
     tracepoint_t * tracepoint;
     while ((tracepoint = tree_pop(&segment->tracepoints))) {
@@ -109,15 +175,25 @@ static void tracepoints_cleanup(
                 }
             }
             template_iter_return_address(tracepoint->address, tracepoint->insn, tracepoint->insn_kind,
-                    tracepoint->template, tracepoint->trampoline, callback);
+                    tracepoint->template, tracepoint_template_address(tracepoint), callback);
+        }
+        if (tracepoint->slot) {
+            /* The slot area is forgotten after the tracepoints on exec or exit, so this never touches memory. */
+            slot_free(process, tracepoint->slot);
         }
+        if (tracepoint->cover)
+            cover_free(process, tracepoint->cover);
         if (unpatch) {
             /* revert original instruction */
-            patch_insn(thread, tracepoint->address, tracepoint->insn_kind, tracepoint->insn);
+            patch_batch_insn(&batch, tracepoint->address, tracepoint->insn_kind, tracepoint->insn);
         }
         tracepoint_free(tracepoint);
     }
     
+    if (batch.count && !patch_batch_commit(thread, &batch))
+        error("Error reverting original instructions in %s.", str_process(process));
+        
+    patch_batch_free(&batch);
 }
 
 /* Forget installed tracepoints and the trampoline segment without accessing the process memory.
@@ -131,121 +207,90 @@ void tracepoints_detach(thread_t * thread, segment_t * segment) {
     tracepoints_cleanup(thread, segment, true, true);
 }
 
-/* Forget tracepoints and remove trampoline segment.  This function is called when a segment is unloaded (in this case
- * the segment is gone and so are the tracepoints, but the trampoline segment is still there). */
+/* Forget tracepoints and release trampolines.  This function is called when a segment is unloaded (in this case the
+ * segment is gone and so are the tracepoints, but the trampolines are still there and their block can be reused). */
 void tracepoints_gone(thread_t * thread, segment_t * segment) {
     tracepoints_cleanup(thread, segment, false, true);
 }
 
-bool tracepoints_any_defined(const segment_t * segment, const injectable_t * injectable) {
-    assert(strcmp(segment->filename, injectable->injfile->name) == 0);
-    INJECTABLE_ITER_TPOINTS(injectable, tp) {
-        if (segment_fo2addr(segment, tp->address))
-            return true;
+/* Change the sampling rate of the segment's tracepoints defined at the given file address (or of all of them if the
+ * address is 0) without reinstalling them.  The process does not need to be stopped.  Return false if a tracepoint
+ * doesn't sample and must be reinstalled to honour the rate. */
+bool tracepoints_set_rate(segment_t * segment, address_t address, uint32_t rate) {
+    bool ret = true;
+    
+    TREE_ITER(&segment->tracepoints, node) {
+        tracepoint_t * tracepoint = node->val;
+        
+        if (address && (segment_addr2fo(segment, tracepoint->address) != address))
+            continue;
+            
+        if (!tracepoint->sampled) {
+            /* A rate of 1 means no sampling, which is what the tracepoint does already. */
+            ret = ret && (rate == 1);
+            continue;
+        }
+        
+        if (!slot_set_rate(segment->process, tracepoint->slot, rate))
+            ret = false;
     }
-    return false;
-}
-
-/*
- * Check if given segment is unused. Unused means that segment is private and is non-readable,
- * non-writable and non-executable.
- */
-static inline bool segment_is_unused(segment_t * segment) {
-    return !segment_is_readable(segment) && !segment_is_writeable(segment) &&
-                !segment_is_executable(segment) && !segment_is_shared(segment) &&
-                segment->filename == NULL;
-}
-
-static inline bool trampoline_mmap(thread_t * thread, address_t address, size_t size, address_t * res) {
-    debug("mmaping trampoline segment at 0x%p size 0x%zu", (void *) address, size);
-    return fncall_mmap(thread, res, address, size,
-            PROT_READ | PROT_WRITE | PROT_EXEC,
-            MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
-            -1, 0);
+    
+    return ret;
 }
 
-static bool tracepoint_iter_free_segments_around(segment_t * segment,
-        address_t low, address_t hi, size_t max_size,
-        bool (fn)(address_t start, size_t size, segment_t * segment)) {
-
-    const size_t pgsize = fncall_align_to_page(1); // page size
-    const address_t addr = fncall_align_to_page(low + (hi - low)/2) - pgsize;
-    address_t beoff, aboff;
-    bool res = false;
-
-    beoff = addr - segment->start + pgsize;
-    aboff = segment->end - addr;
-    bool beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
-    bool aboff_is_reachable = arch_check_relative_jump(low, addr + aboff + pgsize);
-    while(beoff_is_reachable || aboff_is_reachable) {
-        while (beoff_is_reachable && ((beoff <= aboff) || !aboff_is_reachable)) {
-            segment_t * seg = segment_get(segment->process, addr - beoff);
-            if (!seg) {
-                /* we found gap between segments */
-                address_t seg_start = addr - beoff;
-                size_t size = pgsize;
-
-                beoff += pgsize;
-                beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
-                while ((size < max_size) &&
-                        beoff_is_reachable &&
-                        !segment_get(segment->process, addr - beoff)) {
-
-                    size += pgsize;
-                    seg_start -= pgsize;
-
-                    beoff += pgsize;
-                    beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
-                }
-
-                res = fn(seg_start, size, NULL);
-
-            } else {
-                if (segment_is_unused(seg) && arch_check_relative_jump(hi, seg->start)) {
-                    /* unusable segment, probably gap between elf segments */
-                    res = fn(0, 0, seg);
-                }
-                beoff += (seg->end - seg->start);
-                beoff_is_reachable = arch_check_relative_jump(hi, addr - beoff);
-            }
-
-            if (res)
-                return true;
+/* Enable or disable the segment's tracepoints according to their options.  Only the instruction at the tracepoint
+ * address is patched, trampolines stay in place.  The process must be stopped.  Return true on success. */
+bool tracepoints_toggle(thread_t * thread, segment_t * segment) {
+    const injectable_t * injectable = segment->injection->injectable;
+    patch_batch_t batch;
+    bool ret = true;
+    
+    bool changed(const tracepoint_t * tracepoint) {
+        address_t address = segment_addr2fo(segment, tracepoint->address);
+        return tracepoint_options_get(injectable, address)->enabled != tracepoint->enabled;
+    }
+    
+    patch_batch_init(&batch);
+    
+    TREE_ITER(&segment->tracepoints, node) {
+        tracepoint_t * tracepoint = node->val;
+        
+        if (!changed(tracepoint))
+            continue;
+            
+        if (!tracepoint->enabled)
+            tracepoint_patch_entry(&batch, tracepoint);
+        else
+            patch_batch_insn(&batch, tracepoint->address, tracepoint->insn_kind, tracepoint->insn);
+    }
+    
+    if (batch.count && !patch_batch_commit(thread, &batch)) {
+        error("Error toggling tracepoints in %s.", str_process(thread->process));
+        ret = false;
+    } else {
+        /* Update the state only after the code was actually patched. */
+        TREE_ITER(&segment->tracepoints, node) {
+            tracepoint_t * tracepoint = node->val;
+            if (changed(tracepoint))
+                tracepoint->enabled = !tracepoint->enabled;
         }
-        while (aboff_is_reachable && ((aboff <= beoff) || !beoff_is_reachable)) {
-            segment_t * seg = segment_get(segment->process, addr + aboff);
-            if (!seg) {
-                /* we found gap between segments */
-                address_t seg_start = addr + aboff;
-                size_t size = pgsize;
-
-                aboff += pgsize;
-                aboff_is_reachable = arch_check_relative_jump(low, addr + aboff + pgsize);
-                while ((size < max_size) &&
-                        aboff_is_reachable &&
-                        !segment_get(segment->process, addr - aboff)) {
-
-                    size += pgsize;
-
-                    aboff += pgsize;
-                    aboff_is_reachable = arch_check_relative_jump(low, addr - aboff + pgsize);
-                }
-
-                res = fn(seg_start, size, NULL);
-            } else {
-                if (segment_is_unused(seg) && arch_check_relative_jump(low, seg->end)) {
-                    /* unusable segment, probably gap between elf segments */
-                    res = fn(0, 0, seg);
-                }
-                aboff += (seg->end - seg->start);
-                aboff_is_reachable = arch_check_relative_jump(low, addr + aboff);
-            }
+    }
+    
+    patch_batch_free(&batch);
+    return ret;
+}
 
-            if (res)
-                return true;
-        }
+bool tracepoints_any_defined(const segment_t * segment, const injectable_t * injectable) {
+    bool ret = false;
+    
+    void callback(address_t address, offset_t __attribute__((unused)) handler) {
+        if (segment_fo2addr(segment, address))
+            ret = true;
     }
-    return false;
+    
+    assert(strcmp(segment->filename, injectable->injfile->name) == 0);
+    injectable_iter_tracepoints(injectable, callback);
+    return ret;
 }
 
 /* Function allocates memory for trampoline code */
@@ -260,61 +305,56 @@ static bool allocate_trampoline(thread_t * thread, segment_t * segment) {
         tp_high = tp_high < tp_addr ? tp_addr : tp_high;
     }
 
-    size_t trampolines_size = fncall_align_to_page(segment->trampolines_size);
+    return arena_alloc(thread, segment, tp_low, tp_high);
+}
 
-    /* try to find coherent memory region  */
-    bool find_coherent(address_t start, size_t size, segment_t * seg) {
-        if (seg && ((seg->end - seg->start) >= trampolines_size)) {
-            /* unusable segment, probably gap between elf segments, steal it */
-            if (trampoline_mmap(thread, seg->start, trampolines_size, &segment->trampolines)) {
-                segment->trampoline_stolen = true;
-                return true;
-            }
-        } else if (trampolines_size <= size) {
-            /* we found gap between segments */
-            if (trampoline_mmap(thread, start, trampolines_size, &segment->trampolines))
-                return true;
-        }
-        return false;
+static void tracepoints_report_error(thread_t * thread, segment_t * segment, const char * reason) {
+    if (!event_wanted(EVENT_TRACEPOINT_ERROR))
+        return;
+    TREE_ITER(&segment->tracepoints, node) {
+        tracepoint_t * tracepoint = node->val;
+        event_post(EVENT_TRACEPOINT_ERROR, thread->process->pid, thread->pid, tracepoint->address, reason);
     }
-
-    if (tracepoint_iter_free_segments_around(segment, tp_low, tp_high, trampolines_size, find_coherent))
-        return true;
-
-    warning("Suitable segment for relative jumps not found.");
-
-    return fncall_allocate(thread, segment->trampolines_size, &segment->trampolines);
-
 }
 
 void tracepoints_init(thread_t * thread, segment_t * segment) {
-    if (!segment->injection || !segment->injection->injectable->injfile->tpoints) {
+    uint8_t * image;
+    patch_batch_t batch;
+    
+    if (!segment->injection) {
         /* The segment has no injection with handlers. */
         return;
     }
     
     segment->trampolines_size = 0;
     
-    for (struct injfile_tracepoint_t * tp = segment->injection->injectable->injfile->tpoints; tp->address; ++tp) {
-        address_t rt_addr = segment_fo2addr(segment, tp->address);
-        address_t handler_addr = segment->injection->address + tp->handler_fn;
+    void create_tracepoint(address_t address, offset_t handler) {
+        address_t rt_addr = segment_fo2addr(segment, address);
+        address_t handler_addr = segment->injection->address + handler;
         
         if (!rt_addr) {
             /* Tracepoint is outside the segment. */
-            continue;
+            return;
         }
         
         tracepoint_t * tracepoint = tracepoint_create(thread, rt_addr, handler_addr);
         
         if (tracepoint) {
             tree_insert(&segment->tracepoints, rt_addr, tracepoint);
+            tracepoint_apply_options(thread, tracepoint,
+                                     tracepoint_options_get(segment->injection->injectable, address));
             tracepoint->trampoline = segment->trampolines_size;
-            segment->trampolines_size += tracepoint->template->bindata.size;
+            segment->trampolines_size += tracepoint_trampoline_size(tracepoint);
         } else {
             error("Unable to create tracepoint at %lx for handler at %lx.", rt_addr, handler_addr);
+            event_post(EVENT_TRACEPOINT_ERROR, thread->process->pid, thread->pid, rt_addr,
+                       "Unsupported instruction.");
         }
     }
     
+    /* Tracepoints defined by the inj file and added at runtime. */
+    injectable_iter_tracepoints(segment->injection->injectable, create_tracepoint);
+    
     if (tree_empty(&segment->tracepoints)) {
         /* There are no tracepoints for this segment, we don't need a trampoline segment. */
         return;
@@ -323,28 +363,37 @@ void tracepoints_init(thread_t * thread, segment_t * segment) {
     if (!allocate_trampoline(thread, segment)) {
         /* Error allocating trampoline segment -- forget the tracepoints. */
         segment->trampolines = 0;
+        tracepoints_report_error(thread, segment, "Error allocating trampolines.");
         goto rollback;
     }
     
-    /* It's time to install the tracepoints. */
+    /* It's time to install the tracepoints.  The whole trampoline segment is assembled locally and written at once,
+     * the jumps to trampolines are collected in a patch batch and written afterwards. */
+    image = adbi_malloc(segment->trampolines_size);
+    patch_batch_init(&batch);
+    
     TREE_ITER(&segment->tracepoints, node) {
         tracepoint_t * tracepoint = node->val;
+        offset_t offset = tracepoint->trampoline;
         
         /* Evaluate runtime address of the trampoline. */
         tracepoint->trampoline += segment->trampolines;
+        tree_insert(&segment->trampoline_tracepoints, tracepoint->trampoline, tracepoint);
         
-        /* Make the program jump to the trampoline on tracepoint hit. */
-        if (arch_check_relative_jump_kind(tracepoint->insn_kind, tracepoint->address, tracepoint->trampoline)) {
-            patch_relative_jump(thread, tracepoint->address, tracepoint->trampoline, tracepoint->insn_kind);
-        } else {
+        /* Make the program jump to the trampoline on tracepoint hit -- directly or through veneers. */
+        tracepoint->entry = veneer_route(thread, segment, tracepoint->insn_kind, tracepoint->address,
+                                         tracepoint->trampoline);
+        if (!tracepoint->entry) {
             /* Can't jump to trampoline. Use fallback method */
             warning("Can't install relative jump for tracepoint %s to trampoline at %p. Using fallback method.",
                     str_tracepoint(tracepoint), (void *) tracepoint->trampoline);
-            patch_breakpoint(thread, tracepoint->address, tracepoint->insn_kind);
             jump_install(thread->process, tracepoint->address, tracepoint->trampoline);
         }
+        if (tracepoint->enabled)
+            tracepoint_patch_entry(&batch, tracepoint);
         /* Instantiate the template. */
-        template_instance_t * trampoline_code = template_get_handler(tracepoint->template, tracepoint->trampoline,
+        address_t template_address = tracepoint_template_address(tracepoint);
+        template_instance_t * trampoline_code = template_get_handler(tracepoint->template, template_address,
                 tracepoint->address, tracepoint->handler, tracepoint->insn, tracepoint->insn_kind);
                 
         assert(trampoline_code);
@@ -353,10 +402,11 @@ void tracepoints_init(thread_t * thread, segment_t * segment) {
             assert(!thread->process->mode32);
             void callback(address_t from, address_t to) {
                 insn_kind_t kind = template_get_template_kind(tracepoint->template);
-                offset_t off = from - tracepoint->trampoline;
+                offset_t off = from - template_address;
                 insn_t * data_ptr = (insn_t *) (trampoline_code->data + off);
-                if (arch_check_relative_jump_kind(kind, from, to)) {
-                    *data_ptr = arch_get_relative_jump_insn(kind, from, to);
+                address_t target = veneer_route(thread, segment, kind, from, to);
+                if (target) {
+                    *data_ptr = arch_get_relative_jump_insn(kind, from, target);
                     //debug("Installed return relative jump (%x) inside trampoline at offset %lx (%p) to %p:",
                     //        *data_ptr, off, (void *) from, (void *) to);
                 } else {
@@ -367,17 +417,36 @@ void tracepoints_init(thread_t * thread, segment_t * segment) {
                 }
             }
             template_iter_return_address(tracepoint->address, tracepoint->insn, tracepoint->insn_kind,
-                    tracepoint->template, tracepoint->trampoline, callback);
+                    tracepoint->template, template_address, callback);
         }
 
-        /* Copy the trampoline into the process. */
-        if (trampoline_code->size != mem_write(thread, tracepoint->trampoline, trampoline_code->size,
-                                               trampoline_code->data))
-            goto rollback;
+        /* Copy the trampoline into the segment image -- the prologue (if any) followed by the template instance. */
+        assert(offset + tracepoint_trampoline_size(tracepoint) <= segment->trampolines_size);
+        if (tracepoint->prologue_size) {
+            size_t size = prologue_encode(tracepoint, tracepoint->trampoline, image + offset);
+            adbi_assure(size == tracepoint->prologue_size);
+        }
+        memcpy(image + offset + tracepoint->prologue_size, trampoline_code->data, trampoline_code->size);
 
         arch_disassemble_handler(thread, tracepoint, trampoline_code->data);
         template_instance_free(trampoline_code);
     }
+    
+    /* Write all trampolines at once... */
+    if (mem_write(thread, segment->trampolines, segment->trampolines_size, image) != segment->trampolines_size) {
+        free(image);
+        patch_batch_free(&batch);
+        tracepoints_report_error(thread, segment, "Error writing trampolines.");
+        goto rollback;
+    }
+    free(image);
+    
+    /* ...and then activate them by patching the code. */
+    if (!patch_batch_commit(thread, &batch)) {
+        tracepoints_report_error(thread, segment, "Error patching code.");
+        goto rollback;
+    }
+    
     return;
     
 rollback:
@@ -394,7 +463,9 @@ void tracepoints_fork(segment_t * child, const segment_t * parent) {
     }
     child->trampolines = parent->trampolines;
     child->trampolines_size = parent->trampolines_size;
-    child->trampoline_stolen = parent->trampoline_stolen;
+    if (child->trampolines)
+        arena_fork(child, parent);
+    veneers_fork(child, parent);
     
     /* Clone tracepoints. */
     TREE_ITER(&parent->tracepoints, node) {
@@ -407,21 +478,22 @@ void tracepoints_fork(segment_t * child, const segment_t * parent) {
             if (tree_get(&parent->process->jumps, from))
                 jump_install(child->process, from, to);
         }
-        template_iter_return_address(tp->address, tp->insn, tp->insn_kind, tp->template, tp->trampoline, callback);
+        template_iter_return_address(tp->address, tp->insn, tp->insn_kind, tp->template,
+                                     tracepoint_template_address(tp), callback);
 
-        tree_insert(&child->tracepoints, node->key, tracepoint_clone(child->process, node->val, install_jump));
+        tracepoint_t * clone = tracepoint_clone(child->process, node->val, install_jump);
+        tree_insert(&child->tracepoints, node->key, clone);
+        tree_insert(&child->trampoline_tracepoints, clone->trampoline, clone);
     }
 }
 
 const tracepoint_t * tracepoint_get_by_trampoline_address(const segment_t * segment, address_t address) {
-    TREE_ITER(&segment->tracepoints, node) {
-        tracepoint_t * tracepoint = node->val;
-        address_t low = tracepoint->trampoline;
-        address_t high = low + tracepoint->template->bindata.size;
-        if ((low <= address) && (address < high))
-                    return tracepoint;
-    }
-            return NULL;
+    /* Trampolines of a segment don't overlap, so the closest one starting at or below the address is the only
+     * candidate. */
+    const tracepoint_t * tracepoint = tree_get_le(&segment->trampoline_tracepoints, address);
+    if (tracepoint && (address < tracepoint->trampoline + tracepoint_trampoline_size(tracepoint)))
+        return tracepoint;
+    return NULL;
 }
 
 const tracepoint_t * tracepoint_get_by_runtime_address(const process_t * process, address_t address) {
@@ -4,6 +4,7 @@
 #include "process/segment.h"
 #include "injectable/injectable.h"
 #include "template.h"
+#include "option.h"
 
 struct tracepoint_t {
     /* runtime address */
@@ -21,10 +22,40 @@ struct tracepoint_t {
     
     /* handler template */
     const template_t * template;
+    
+    /* mode and the size of the trampoline prologue (see prologue.h), which precedes the template instance */
+    tracepoint_mode_t mode;
+    size_t prologue_size;
+    
+    /* tracepoint slot and coverage map byte runtime addresses (see slot.h) or 0 */
+    address_t slot;
+    address_t cover;
+    
+    /* private copy of the predicate or NULL */
+    predicate_t * predicate;
+    
+    /* true if the prologue samples hits (the rate is kept in the slot and can be changed at any time) */
+    bool sampled;
+    
+    /* target of the jump patched at the tracepoint address (the trampoline or a veneer) or 0 if a breakpoint is used */
+    address_t entry;
+    
+    /* true if the tracepoint address is patched, false if the original instruction is in place */
+    bool enabled;
 };
 
 typedef struct tracepoint_t tracepoint_t;
 
+/* Return the address of the template instance in the tracepoint's trampoline. */
+static inline address_t tracepoint_template_address(const tracepoint_t * tracepoint) {
+    return tracepoint->trampoline + tracepoint->prologue_size;
+}
+
+/* Return the size of the tracepoint's trampoline. */
+static inline size_t tracepoint_trampoline_size(const tracepoint_t * tracepoint) {
+    return tracepoint->prologue_size + tracepoint->template->bindata.size;
+}
+
 void tracepoints_init(thread_t * thread, segment_t * segment);
 void tracepoints_gone(thread_t * thread, segment_t * segment);
 
@@ -32,6 +63,9 @@ void tracepoints_reset(segment_t * segment);
 void tracepoints_detach(thread_t * thread, segment_t * segment);
 void tracepoints_fork(segment_t * child, const segment_t * parent);
 
+bool tracepoints_set_rate(segment_t * segment, address_t address, uint32_t rate);
+bool tracepoints_toggle(thread_t * thread, segment_t * segment);
+
 bool tracepoints_any_defined(const segment_t * segment, const injectable_t * injectable);
 
 const tracepoint_t * tracepoint_get_by_trampoline_address(const segment_t * segment, address_t address);
@@ -0,0 +1,258 @@
+#include <sys/mman.h>
+#include <string.h>
+
+#include "process/process.h"
+#include "process/thread.h"
+#include "process/segment.h"
+#include "process/artificial.h"
+
+#include "injection/fncall.h"
+#include "procutil/mem.h"
+
+#include "veneer.h"
+#include "patch.h"
+
+/* Veneers are small islands of code used when a tracepoint (or a trampoline returning to the original code) is too
+ * far from its destination for a relative jump.  The jump goes to a veneer placed in a free page within its range
+ * instead and the veneer continues to the destination.  On ARM and Thumb a single veneer loads the destination into
+ * the PC, so it reaches any address.  On A64 veneers are plain branches and are chained until the destination is in
+ * range.  Veneer pages belong to a segment and live as long as its trampolines. */
+
+/* Maximum number of veneers chained to reach a single destination. */
+#define VENEER_MAX_HOPS         16
+
+/* Maximum number of mmap calls made to find a page for new veneers. */
+#define VENEER_MAP_ATTEMPTS     8
+
+typedef struct veneer_page_t {
+    address_t address;
+    size_t size;
+    size_t used;
+} veneer_page_t;
+
+static inline address_t veneer_distance(address_t a, address_t b) {
+    return a < b ? b - a : a - b;
+}
+
+/* Check if a veneer at the given address can be reached from `from` and helps reaching `to`.  Set *final if the veneer
+ * can jump to `to` directly. */
+static bool veneer_usable(insn_kind_t kind, address_t from, address_t address, address_t to, bool * final) {
+    uint8_t code[VENEER_SIZE];
+
+    if (!arch_check_relative_jump_kind(kind, from, address))
+        return false;
+
+    *final = patch_encode_veneer(kind, address, to, code) != 0;
+    return *final || (veneer_distance(address, to) < veneer_distance(from, to));
+}
+
+/* Return a page of the segment with a free slot usable for a jump from `from` towards `to`.  Pages with a veneer
+ * reaching `to` are preferred, otherwise the page closest to `to` is returned. */
+static veneer_page_t * veneer_find_page(segment_t * segment, insn_kind_t kind, address_t from, address_t to,
+                                        bool * final) {
+    veneer_page_t * best = NULL;
+
+    *final = false;
+    TREE_ITER(&segment->veneers, node) {
+        veneer_page_t * page = node->val;
+        address_t slot = page->address + page->used;
+        bool reaches;
+
+        if (page->used + VENEER_SIZE > page->size)
+            continue;
+
+        if (!veneer_usable(kind, from, slot, to, &reaches))
+            continue;
+
+        if (reaches) {
+            *final = true;
+            return page;
+        }
+
+        if (!best || (veneer_distance(slot, to) < veneer_distance(best->address + best->used, to)))
+            best = page;
+    }
+    return best;
+}
+
+/* Return the page aligned address farthest from `from` in the direction of `to`, which can still be reached by a jump
+ * of the given kind, or 0 if there is no such page. */
+static address_t veneer_farthest(insn_kind_t kind, address_t from, address_t to, size_t pgsize) {
+    size_t limit = veneer_distance(from, to);
+    size_t distance = 0;
+    size_t step = pgsize;
+    bool growing = true;
+
+    address_t toward(size_t offset) {
+        if (to > from)
+            return (from + offset) & ~(pgsize - 1);
+        else
+            return (from - offset + pgsize - 1) & ~(pgsize - 1);
+    }
+
+    /* Jump ranges are symmetric, so grow the distance exponentially and then refine it. */
+    while (step >= pgsize) {
+        size_t next = distance + step;
+        if ((next < limit) && arch_check_relative_jump_kind(kind, from, toward(next))) {
+            distance = next;
+            if (growing)
+                step *= 2;
+        } else {
+            growing = false;
+            step /= 2;
+        }
+    }
+
+    return distance ? toward(distance) : 0;
+}
+
+/* Check if the page at the given address is occupied by a known segment or an artificial region.  If so, return the
+ * boundaries of the occupying region in *start and *end. */
+static bool veneer_page_occupied(const process_t * process, address_t address, address_t * start, address_t * end) {
+    const segment_t * segment = segment_get(process, address);
+    if (segment) {
+        *start = segment->start;
+        *end = segment->end;
+        return true;
+    }
+
+    const artificial_t * artificial = artificial_get(process, address);
+    if (artificial) {
+        *start = artificial->start;
+        *end = artificial->end;
+        return true;
+    }
+    return false;
+}
+
+/* Map a new page for veneers usable for a jump from `from` towards `to`.  The search starts at the farthest reachable
+ * page and continues towards `from`, skipping known mappings.  The candidate address is only a hint for mmap, so
+ * mappings created since the last segment scan are never overwritten. */
+static veneer_page_t * veneer_map_page(thread_t * thread, segment_t * segment, insn_kind_t kind, address_t from,
+                                       address_t to, bool * final) {
+    const size_t pgsize = fncall_align_to_page(1);
+    const bool upwards = to > from;
+    address_t candidate = veneer_farthest(kind, from, to, pgsize);
+    unsigned int attempts = VENEER_MAP_ATTEMPTS;
+
+    while (candidate && attempts) {
+        address_t start, end, address;
+
+        if (veneer_page_occupied(segment->process, candidate, &start, &end)) {
+            /* Skip the whole region. */
+            if (upwards)
+                candidate = (start & ~(pgsize - 1)) >= pgsize ? (start & ~(pgsize - 1)) - pgsize : 0;
+            else
+                candidate = fncall_align_to_page(end);
+        } else {
+            --attempts;
+            if (!fncall_mmap(thread, &address, candidate, pgsize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+                return NULL;
+
+            if (address & (pgsize - 1)) {
+                /* mmap failed. */
+                return NULL;
+            }
+
+            if (veneer_usable(kind, from, address, to, final)) {
+                veneer_page_t * page = adbi_malloc(sizeof(veneer_page_t));
+                page->address = address;
+                page->size = pgsize;
+                page->used = 0;
+                tree_insert(&segment->veneers, address, page);
+                artificial_add_veneers(segment, address, pgsize);
+                debug("Mapped veneer page at %p for %s.", (void *) address, str_segment(segment));
+                return page;
+            }
+
+            /* The page was placed elsewhere, so the candidate is occupied by a mapping we don't know yet. */
+            fncall_free(thread, address, pgsize);
+            candidate = upwards ? candidate - pgsize : candidate + pgsize;
+        }
+
+        /* Stop when the candidate gets as close to `from` as the original address. */
+        if (upwards ? (candidate <= from) : (candidate + pgsize > from))
+            candidate = 0;
+    }
+    return NULL;
+}
+
+/* Return the address a jump of the given kind at `from` should target to reach `to`.  This is `to` itself if it is in
+ * range, otherwise a chain of veneers leading to `to` is created and its first veneer is returned.  Return 0 if no
+ * chain can be created. */
+address_t veneer_route(thread_t * thread, segment_t * segment, insn_kind_t kind, address_t from, address_t to) {
+    address_t hops[VENEER_MAX_HOPS];
+    size_t count = 0;
+    bool final = false;
+    address_t at = from;
+
+    if (arch_check_relative_jump_kind(kind, from, to))
+        return to;
+
+    while (!final && (count < VENEER_MAX_HOPS)) {
+        veneer_page_t * page = veneer_find_page(segment, kind, at, to, &final);
+
+        if (!final) {
+            /* No existing veneer can reach the destination, try a new page. */
+            bool fresh_final = false;
+            veneer_page_t * fresh = veneer_map_page(thread, segment, kind, at, to, &fresh_final);
+            if (fresh && (fresh_final || !page ||
+                          (veneer_distance(fresh->address, to) < veneer_distance(page->address + page->used, to)))) {
+                page = fresh;
+                final = fresh_final;
+            }
+        }
+
+        if (!page) {
+            /* Slots reserved so far stay unused until the page is freed. */
+            return 0;
+        }
+
+        at = page->address + page->used;
+        page->used += VENEER_SIZE;
+        hops[count++] = at;
+    }
+
+    if (!final)
+        return 0;
+
+    /* Write the chain starting from its end, so that it's complete once the first veneer is reachable. */
+    for (size_t i = count; i-- > 0;) {
+        uint8_t code[VENEER_SIZE];
+        address_t dest = (i + 1 < count) ? hops[i + 1] : to;
+        size_t size = patch_encode_veneer(kind, hops[i], dest, code);
+
+        assert(size);
+        if (mem_write(thread, hops[i], size, code) != size) {
+            error("Error writing veneer at %p in %s.", (void *) hops[i], str_process(thread->process));
+            return 0;
+        }
+    }
+
+    debug("Jump from %p to %p uses %zu veneer(s) starting at %p.", (void *) from, (void *) to, count,
+          (void *) hops[0]);
+    return hops[0];
+}
+
+/* Forget veneer pages of the segment.  If free_pages is true, unmap them using the given thread. */
+void veneers_cleanup(thread_t * thread, segment_t * segment, bool free_pages) {
+    veneer_page_t * page;
+    while ((page = tree_pop(&segment->veneers))) {
+        if (free_pages && !fncall_free(thread, page->address, page->size))
+            error("Error freeing up veneer page at %p in %s.", (void *) page->address,
+                  str_process(thread->process));
+        artificial_remove(segment->process, page->address);
+        free(page);
+    }
+}
+
+/* Clone veneer pages of the parent segment.  The memory is inherited by the child process. */
+void veneers_fork(segment_t * child, const segment_t * parent) {
+    TREE_ITER(&parent->veneers, node) {
+        veneer_page_t * page = adbi_malloc(sizeof(veneer_page_t));
+        memcpy(page, node->val, sizeof(veneer_page_t));
+        tree_insert(&child->veneers, page->address, page);
+        artificial_add_veneers(child, page->address, page->size);
+    }
+}
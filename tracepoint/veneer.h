@@ -0,0 +1,12 @@
+#ifndef VENEER_H_
+#define VENEER_H_
+
+#include "process/thread.h"
+#include "process/segment.h"
+
+address_t veneer_route(thread_t * thread, segment_t * segment, insn_kind_t kind, address_t from, address_t to);
+
+void veneers_cleanup(thread_t * thread, segment_t * segment, bool free_pages);
+void veneers_fork(segment_t * child, const segment_t * parent);
+
+#endif
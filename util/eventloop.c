@@ -0,0 +1,138 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "tree.h"
+
+#include "signal.h"
+#include "eventloop.h"
+
+/* Maximum number of events dispatched in a single eventloop_wait call. */
+#define EVENTLOOP_MAX_EVENTS 64
+
+typedef struct eventloop_handler_t {
+    int fd;
+    uint32_t events;
+    eventloop_callback_t callback;
+    void * data;
+} eventloop_handler_t;
+
+static int eventloop_fd = -1;
+
+/* Registered handlers, indexed by file descriptor. */
+static tree_t eventloop_handlers = NULL;
+
+/* Handlers removed during dispatch.  Further events from the same epoll_pwait batch may still point to them, so they
+ * are freed only after the whole batch is dispatched. */
+static tree_t eventloop_removed = NULL;
+
+static bool eventloop_ctl(int op, eventloop_handler_t * handler) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = handler->events;
+    event.data.ptr = handler;
+    return epoll_ctl(eventloop_fd, op, handler->fd, &event) == 0;
+}
+
+/* Start monitoring the given file descriptor.  The callback is called with the given data pointer each time one of the
+ * given events occurs on the file descriptor. */
+bool eventloop_add(int fd, uint32_t events, eventloop_callback_t callback, void * data) {
+    assert(!tree_contains(&eventloop_handlers, fd));
+
+    eventloop_handler_t * handler = adbi_malloc(sizeof(eventloop_handler_t));
+    handler->fd = fd;
+    handler->events = events;
+    handler->callback = callback;
+    handler->data = data;
+
+    if (!eventloop_ctl(EPOLL_CTL_ADD, handler)) {
+        error("Error adding fd %d to event loop: %s.", fd, strerror(errno));
+        free(handler);
+        return false;
+    }
+
+    tree_insert(&eventloop_handlers, fd, handler);
+    return true;
+}
+
+/* Change the set of monitored events of an already registered file descriptor. */
+bool eventloop_modify(int fd, uint32_t events) {
+    eventloop_handler_t * handler = tree_get(&eventloop_handlers, fd);
+    assert(handler);
+
+    if (handler->events == events)
+        return true;
+
+    handler->events = events;
+    if (!eventloop_ctl(EPOLL_CTL_MOD, handler)) {
+        error("Error modifying events of fd %d: %s.", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Stop monitoring the given file descriptor.  This must be called before the file descriptor is closed. */
+void eventloop_remove(int fd) {
+    eventloop_handler_t * handler = tree_get(&eventloop_handlers, fd);
+    assert(handler);
+
+    if (epoll_ctl(eventloop_fd, EPOLL_CTL_DEL, fd, NULL))
+        error("Error removing fd %d from event loop: %s.", fd, strerror(errno));
+
+    tree_remove(&eventloop_handlers, fd);
+    handler->callback = NULL;
+    tree_insert(&eventloop_removed, (intptr_t) handler, handler);
+}
+
+/* Wait for events on the registered file descriptors and dispatch them.  The function returns after dispatching a
+ * batch of events or after one of the signals handled by signal.c is delivered.  If block is false, the function
+ * only dispatches events which are already pending. */
+void eventloop_wait(bool block) {
+    struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+    int count;
+
+    /* Our signals are blocked all the time except when waiting here, so it's impossible to miss one of them. */
+    count = epoll_pwait(eventloop_fd, events, EVENTLOOP_MAX_EVENTS, block ? -1 : 0, signal_wait_mask());
+
+    if (count < 0) {
+        if (errno != EINTR)
+            error("Error waiting for events: %s.", strerror(errno));
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        eventloop_handler_t * handler = events[i].data.ptr;
+        if (likely(handler->callback))
+            handler->callback(handler->fd, events[i].events, handler->data);
+    }
+
+    while (!tree_empty(&eventloop_removed))
+        free(tree_pop(&eventloop_removed));
+}
+
+void eventloop_cleanup() {
+    while (!tree_empty(&eventloop_handlers)) {
+        eventloop_handler_t * handler = tree_pop(&eventloop_handlers);
+        warning("File descriptor %d still registered in event loop.", handler->fd);
+        free(handler);
+    }
+
+    while (!tree_empty(&eventloop_removed))
+        free(tree_pop(&eventloop_removed));
+
+    if (eventloop_fd >= 0) {
+        close(eventloop_fd);
+        eventloop_fd = -1;
+    }
+}
+
+bool eventloop_init() {
+    eventloop_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (eventloop_fd < 0) {
+        fatal("Error creating epoll instance: %s.", strerror(errno));
+        return false;
+    }
+    debug("Event loop initialized.");
+    return true;
+}
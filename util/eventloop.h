@@ -0,0 +1,19 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* Callback invoked when a registered file descriptor becomes ready.  The events argument is a mask of EPOLL* flags. */
+typedef void (*eventloop_callback_t)(int fd, uint32_t events, void * data);
+
+bool eventloop_init();
+void eventloop_cleanup();
+
+bool eventloop_add(int fd, uint32_t events, eventloop_callback_t callback, void * data);
+bool eventloop_modify(int fd, uint32_t events);
+void eventloop_remove(int fd);
+
+void eventloop_wait(bool block);
+
+#endif
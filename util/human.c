@@ -177,6 +177,9 @@ const char * str_address(const struct process_t * process, address_t address) {
     
     segment = segment_get_by_trampoline(process, address);
     if (segment) {
+        if ((address < segment->trampolines) || (address >= segment->trampolines + segment->trampolines_size))
+            return stringbuf_printf("%p (veneer for tracepoints in %s)", (void *) address, segment->filename);
+
         /* Address is in a trampoline segment. */
         const tracepoint_t * tracepoint = tracepoint_get_by_trampoline_address(segment, address);
         if (!tracepoint)
@@ -0,0 +1,33 @@
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+/* Return the current time of the monotonic clock in microseconds. */
+uint64_t latency_clock() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        adbi_bug("Error reading monotonic clock.");
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Add a sample (in microseconds) to the histogram. */
+void latency_record(latency_t * latency, uint64_t usec) {
+    unsigned int bucket = 0;
+    
+    while (usec >> bucket)
+        ++bucket;
+        
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+        
+    ++latency->count;
+    ++latency->buckets[bucket];
+    latency->total += usec;
+    if (usec > latency->max)
+        latency->max = usec;
+}
+
+void latency_reset(latency_t * latency) {
+    memset(latency, 0, sizeof(latency_t));
+}
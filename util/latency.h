@@ -0,0 +1,22 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* Number of histogram buckets.  Bucket i counts samples of at least 2^(i-1) and less than 2^i microseconds, the last
+ * bucket counts all longer samples. */
+#define LATENCY_BUCKETS 32
+
+typedef struct latency_t {
+    uint64_t count;
+    uint64_t total;     /* sum of all samples (us) */
+    uint64_t max;       /* longest sample (us) */
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_t;
+
+uint64_t latency_clock();
+
+void latency_record(latency_t * latency, uint64_t usec);
+void latency_reset(latency_t * latency);
+
+#endif
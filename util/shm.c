@@ -0,0 +1,61 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "shm.h"
+
+/* Directory used for shared memory files if memfd_create is not available. */
+#define SHM_TMP_DIR "/data/local/tmp"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/* Create an anonymous file using memfd_create.  Return the file descriptor or -1. */
+static int shm_memfd(const char * name) {
+#ifdef __NR_memfd_create
+    return (int) syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+#else
+    UNUSED(name);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Create a file in the temporary directory and unlink it immediately.  Return the file descriptor or -1. */
+static int shm_tmpfile(const char * name) {
+    char path[MAX_PATH];
+    int fd;
+    
+    snprintf(path, sizeof(path), SHM_TMP_DIR "/%s-XXXXXX", name);
+    
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+        
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* Create an anonymous shared memory file of the given size, which can be mapped by this and other processes.  The
+ * memory is backed by memfd_create if the kernel supports it, otherwise by an unlinked temporary file.  Return the
+ * file descriptor or -1 on error. */
+int shm_create(const char * name, size_t size) {
+    int fd = shm_memfd(name);
+    
+    if ((fd < 0) && ((fd = shm_tmpfile(name)) < 0)) {
+        error("Error creating shared memory file: %s.", strerror(errno));
+        return -1;
+    }
+    
+    if (ftruncate(fd, size)) {
+        error("Error resizing shared memory file to %zu bytes: %s.", size, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
@@ -0,0 +1,8 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+
+int shm_create(const char * name, size_t size);
+
+#endif
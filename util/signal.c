@@ -8,23 +8,16 @@
 
 static sigset_t signal_signals;
 
-volatile int signal_child;
-volatile int signal_io;
 volatile int signal_quit;
-volatile int signal_disconnected;
 volatile int signal_alarm;
 
 
 static void signal_handler(int sig) {
 
-    if (likely(sig == SIGCHLD)) {
-        signal_child += 1;
-    } else if (sig == SIGIO) {
-        signal_io += 1;
-    } else if ((sig == SIGINT) || (sig == SIGTERM)) {
+    if ((sig == SIGINT) || (sig == SIGTERM)) {
         signal_quit += 1;
     } else if ((sig == SIGPIPE)) {
-        signal_disconnected += 1;
+        /* Sockets are written with MSG_NOSIGNAL, disconnections are detected by send and recv. */
     } else if ((sig == SIGALRM)) {
         signal_alarm += 1;
     }
@@ -87,14 +80,25 @@ static int signal_init_single(int signo) {
         return result == 0;
 }
 
-/* Wait until at least one of the signals handled by us occurs. */
-void signal_wait() {
-    int res;
+/* Block the given signal also while waiting.  This is used for signals which are read from a signalfd instead of being
+ * handled by signal_handler (e.g. SIGCHLD, see procutil/wait.c), because an unblocked signal would be discarded. */
+static int signal_init_blocked(int signo) {
+    if (!signals_block(signo)) {
+        fatal("Error blocking signal %s.", str_signal(signo));
+        return 0;
+    }
     
+    if (sigaddset(&signal_signals, signo))
+        adbi_bug("Error adding signal %s to signal mask.", str_signal(signo));
+        
+    return 1;
+}
+
+/* Return the signal mask to use while waiting for events.  The signals handled by us are blocked all the time, except
+ * when the process waits with this mask installed (e.g. in epoll_pwait). */
+const sigset_t * signal_wait_mask() {
     assert(!sigismember(&signal_signals, SIGINT));
-    
-    res = sigsuspend(&signal_signals);
-    assert((res == -1) && (errno == EINTR));
+    return &signal_signals;
 }
 
 void signal_reset() {
@@ -128,9 +132,8 @@ int signal_init() {
     /* Block the signals. */
     return signal_init_single(SIGINT) &&
            signal_init_single(SIGTERM) &&
-           signal_init_single(SIGIO) &&
            signal_init_single(SIGPIPE) &&
-           signal_init_single(SIGCHLD) &&
+           signal_init_blocked(SIGCHLD) &&
            signal_init_single(SIGALRM);
            
 }
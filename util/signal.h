@@ -1,15 +1,14 @@
 #ifndef SIGHANDLERS_H
 #define SIGHANDLERS_H
 
-extern volatile int signal_child;
-extern volatile int signal_io;
+#include <signal.h>
+
 extern volatile int signal_quit;
-extern volatile int signal_disconnected;
 extern volatile int signal_alarm;
 
 int signal_init();
 
-void signal_wait();
+const sigset_t * signal_wait_mask();
 void signal_wait_single(int signo, int interruptable);
 
 void signal_block_int(int block);